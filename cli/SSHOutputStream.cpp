@@ -77,6 +77,7 @@ void SSHOutputStream::PutString(const char* str)
 
 void SSHOutputStream::Flush()
 {
-	m_server->SendSessionData(m_sessid, m_socket, (const char*)m_fifo.Rewind(), m_fifo.ReadSize());
+	//Let the SSH server merge this with other small writes rather than sending a packet for every line
+	m_server->QueueSessionData(m_sessid, m_socket, (const char*)m_fifo.Rewind(), m_fifo.ReadSize());
 	m_fifo.Reset();
 }
@@ -155,7 +155,7 @@ void DHCPClient::Renew()
 	auto eth = ipv4->GetEthernet();
 
 	//Allocate a packet for the reply and give up if we can't make one
-	auto upack = m_udp->GetTxPacket(m_serverAddress);
+	auto upack = m_udp->GetTxPacket(m_serverAddress, TX_CLASS_CONTROL);
 	if(!upack)
 		return;
 
@@ -213,7 +213,7 @@ void DHCPClient::SendDiscover()
 	auto eth = m_udp->GetIPv4()->GetEthernet();
 
 	//Allocate a packet for the reply and give up if we can't make one
-	auto upack = m_udp->GetTxPacket(broadcast);
+	auto upack = m_udp->GetTxPacket(broadcast, TX_CLASS_CONTROL);
 	if(!upack)
 	{
 		//immediately re-send next tick in hopes of getting a valid packet (link up?)
@@ -390,7 +390,7 @@ void DHCPClient::OnRxOffer(DHCPPacket* pack, IPv4Address srcip, uint16_t payload
 		return;
 
 	//Allocate a packet for the reply and give up if we can't make one
-	auto upack = m_udp->GetTxPacket(broadcast);
+	auto upack = m_udp->GetTxPacket(broadcast, TX_CLASS_CONTROL);
 	if(!upack)
 		return;
 
@@ -233,6 +233,7 @@ void APBEthernetInterface::SendTxFrame(EthernetFrame* frame, bool markFree)
 		{
 			m_txFreeList.push_back(m_dmaTxFrame);
 			m_dmaTxFrame = nullptr;
+			NotifyTxSpaceAvailable();
 		}
 		g_ethPacketLen[0] = len;
 
@@ -359,3 +360,22 @@ void APBEthernetInterface::ReleaseRxFrame(EthernetFrame* frame)
 {
 	m_rxFreeList.push_back(frame);
 }
+
+/**
+	@brief Moves a received frame to the transmit side
+
+	RX and TX buffers are interchangeable (the hardware has its own FIFOs and we copy in and out of them), so the RX
+	pool is given a free TX buffer in exchange for the frame to keep both pools the same size.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool APBEthernetInterface::TurnaroundRxFrame([[maybe_unused]] EthernetFrame* frame)
+{
+	if(m_txFreeList.empty())
+		return false;
+
+	m_rxFreeList.push_back(m_txFreeList.back());
+	m_txFreeList.pop_back();
+	return true;
+}
@@ -75,6 +75,11 @@ public:
 	virtual EthernetFrame* GetRxFrame() override;
 	virtual void ReleaseRxFrame(EthernetFrame* frame) override;
 	virtual bool IsTxBufferAvailable() override;
+	virtual size_t GetTxBufferFreeCount() override
+	{ return m_txFreeList.size(); }
+	virtual size_t GetRxBufferFreeCount() override
+	{ return m_rxFreeList.size(); }
+	virtual bool TurnaroundRxFrame(EthernetFrame* frame) override;
 
 	void Init();
 
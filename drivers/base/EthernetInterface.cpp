@@ -30,3 +30,18 @@
 #include <staticnet-config.h>
 #include "../../stack/staticnet.h"
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transmit path
+
+/**
+	@brief Tells the protocol stack that TX frames have been returned to the pool
+
+	Drivers should call this whenever a frame which was sent with markFree=true finishes transmission and becomes
+	available again (frames returned by CancelTxFrame() are tracked by the stack itself). This only sets a flag, so it's
+	safe to call from an interrupt handler.
+ */
+void EthernetInterface::NotifyTxSpaceAvailable()
+{
+	if(m_protocol)
+		m_protocol->OnTxSpaceAvailable();
+}
@@ -38,12 +38,25 @@
 #include "../../net/ethernet/EthernetFrame.h"
 #include "EthernetInterfacePerformanceCounters.h"
 
+class EthernetProtocol;
+
 /**
 	@brief Ethernet driver base class
  */
 class EthernetInterface
 {
 public:
+	EthernetInterface()
+	: m_protocol(nullptr)
+	{}
+
+	/**
+		@brief Sets the protocol stack to notify when TX buffers become available
+
+		This is called automatically by the EthernetProtocol constructor.
+	 */
+	void UseProtocol(EthernetProtocol* protocol)
+	{ m_protocol = protocol; }
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Transmit path
@@ -63,6 +76,15 @@ public:
 	 */
 	virtual bool IsTxBufferAvailable() =0;
 
+	/**
+		@brief Returns the number of TX frames currently available
+
+		This is used to hold frames in reserve for high priority traffic. The default implementation is for drivers
+		which can't count their free buffers: it returns zero or a very large number, which disables the reserves.
+	 */
+	virtual size_t GetTxBufferFreeCount()
+	{ return IsTxBufferAvailable() ? SIZE_MAX : 0; }
+
 	/**
 		@brief Sends a frame.
 
@@ -103,6 +125,39 @@ public:
 	 */
 	virtual void ReleaseRxFrame(EthernetFrame* frame) =0;
 
+	/**
+		@brief Returns the number of RX frame buffers currently free for the driver to receive into
+
+		The stack uses this to decide whether upper layers may hold on to received frames. The default implementation
+		is for drivers which can't count their free buffers and returns a very large number.
+	 */
+	virtual size_t GetRxBufferFreeCount()
+	{ return SIZE_MAX; }
+
+	/**
+		@brief Converts a received frame into a transmit frame in place, so a reply can be sent without allocating a
+		new buffer or copying the request.
+
+		On success, ownership of the frame passes to the caller as if it had come from GetTxFrame(), and it must be
+		returned by calling SendTxFrame() or CancelTxFrame() rather than ReleaseRxFrame().
+
+		Drivers which cannot move buffers between their receive and transmit pools (e.g. because of DMA descriptor
+		rings) should return false, which is what the default implementation does. The caller then falls back to
+		allocating a separate TX frame.
+	 */
+	virtual bool TurnaroundRxFrame([[maybe_unused]] EthernetFrame* frame)
+	{ return false; }
+
+	/**
+		@brief Enables or disables the interrupt signaling that received frames are waiting
+
+		StackRunner disables the interrupt while it is polling under load, and enables it again once traffic dies
+		down. When enabled, the interrupt must fire if frames are already waiting, or a frame which arrived just before
+		the switch could sit unprocessed. The default implementation is for drivers which are only ever polled.
+	 */
+	virtual void SetRxInterruptEnabled([[maybe_unused]] bool enabled)
+	{}
+
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Performance counters
 
@@ -118,6 +173,12 @@ protected:
 	EthernetInterfacePerformanceCounters m_perfCounters;
 
 #endif
+
+protected:
+	void NotifyTxSpaceAvailable();
+
+	///@brief The protocol stack using this interface (if any)
+	EthernetProtocol* m_protocol;
 };
 
 #endif
@@ -0,0 +1,74 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of MonotonicClock
+ */
+
+#ifndef MonotonicClock_h
+#define MonotonicClock_h
+
+#include <stdint.h>
+
+///@brief Value returned by GetNextDeadline() when no timers are pending
+#define TIMER_NO_DEADLINE 0xffffffff
+
+/**
+	@brief Monotonic time source base class
+
+	Provides a millisecond timestamp to the protocol stack, so that timers (retransmits etc) can be scheduled against
+	real deadlines rather than counting calls to OnAgingTick10x().
+
+	Timestamps are 32 bits and wrap around every ~49.7 days, so they must only ever be compared using the wraparound
+	safe helpers below.
+ */
+class MonotonicClock
+{
+public:
+
+	/**
+		@brief Returns the current time, in milliseconds since an arbitrary epoch
+	 */
+	virtual uint32_t GetTimeMs() =0;
+
+	///@brief Checks if a deadline has been reached
+	static bool IsExpired(uint32_t now, uint32_t deadline)
+	{ return static_cast<int32_t>(now - deadline) >= 0; }
+
+	///@brief Returns the number of ms from now until a deadline, or zero if it's already passed
+	static uint32_t TimeUntil(uint32_t now, uint32_t deadline)
+	{
+		if(IsExpired(now, deadline))
+			return 0;
+		return deadline - now;
+	}
+};
+
+#endif
@@ -45,6 +45,7 @@ STM32EthernetInterface::STM32EthernetInterface()
 	: m_nextRxBuffer(0)
 	, m_nextTxDescriptorWrite(0)
 	, m_nextTxDescriptorDone(0)
+	, m_txFreeCount(0)
 {
 	RCCHelper::Enable(&EMAC);
 
@@ -83,6 +84,7 @@ STM32EthernetInterface::STM32EthernetInterface()
 	//Set up free list for transmit frame buffers
 	for(int i=0; i<TX_BUFFER_FRAMES; i++)
 		m_txFreeList.Push(&m_txBuffers[i]);
+	m_txFreeCount = TX_BUFFER_FRAMES;
 
 	//Wait for this write to commit before polling DMA
 	asm("dmb st");
@@ -111,6 +113,7 @@ EthernetFrame* STM32EthernetInterface::GetTxFrame()
 		return NULL;
 
 	auto frame = m_txFreeList.Pop();
+	m_txFreeCount --;
 
 	#ifdef ZEROIZE_BUFFERS_BEFORE_USE
 		memset(frame, 0, sizeof(EthernetFrame));
@@ -119,6 +122,25 @@ EthernetFrame* STM32EthernetInterface::GetTxFrame()
 	return frame;
 }
 
+bool STM32EthernetInterface::IsTxBufferAvailable()
+{
+	while(CheckForFinishedFrames())
+	{}
+
+	return !m_txFreeList.IsEmpty();
+}
+
+/**
+	@brief Returns the number of free TX buffers, after reclaiming any the DMA has finished with
+ */
+size_t STM32EthernetInterface::GetTxBufferFreeCount()
+{
+	while(CheckForFinishedFrames())
+	{}
+
+	return m_txFreeCount;
+}
+
 /**
 	@brief Check if any frames in the DMA are done, return true if yes
  */
@@ -148,12 +170,14 @@ bool STM32EthernetInterface::CheckForFinishedFrames()
 	{
 		//EthernetFrame has 2 bytes of length before the buffer
 		m_txFreeList.Push(reinterpret_cast<EthernetFrame*>(m_txDmaDescriptors[m_nextTxDescriptorDone].TDES2 - 2));
+		m_txFreeCount ++;
 
 		m_txDmaDescriptors[m_nextTxDescriptorDone].TDES2 = 0;
 
 		//go on to next descriptor in the ring
 		m_nextTxDescriptorDone = (m_nextTxDescriptorDone + 1) % 4;
 
+		NotifyTxSpaceAvailable();
 		return true;
 	}
 
@@ -206,6 +230,7 @@ void STM32EthernetInterface::CancelTxFrame(EthernetFrame* frame)
 {
 	//Return it to the free list
 	m_txFreeList.Push(frame);
+	m_txFreeCount ++;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -48,6 +48,8 @@ public:
 	STM32EthernetInterface();
 
 	virtual EthernetFrame* GetTxFrame() override;
+	virtual bool IsTxBufferAvailable() override;
+	virtual size_t GetTxBufferFreeCount() override;
 	virtual void SendTxFrame(EthernetFrame* frame, bool markFree=true) override;
 	virtual void CancelTxFrame(EthernetFrame* frame) override;
 	virtual EthernetFrame* GetRxFrame() override;
@@ -85,6 +87,9 @@ protected:
 
 	///@brief FIFO of free TX buffers
 	FIFO<EthernetFrame*, TX_BUFFER_FRAMES> m_txFreeList;
+
+	///@brief Number of frames in m_txFreeList
+	size_t m_txFreeCount;
 };
 
 #endif
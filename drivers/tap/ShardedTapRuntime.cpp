@@ -0,0 +1,136 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include <staticnet-config.h>
+#include <staticnet/stack/staticnet.h>
+#include "ShardedTapRuntime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+ShardedTapRuntime::ShardedTapRuntime()
+	: m_count(0)
+	, m_running(false)
+	, m_stopping(false)
+{
+}
+
+ShardedTapRuntime::~ShardedTapRuntime()
+{
+	Stop();
+}
+
+/**
+	@brief Adds a shard to the runtime, returning its index
+
+	Called by the TapShard constructor. Shards can't be added once the runtime is started.
+ */
+uint32_t ShardedTapRuntime::AddShard(TapShard* shard)
+{
+	if(m_running || (m_count >= TAP_MAX_SHARDS) )
+	{
+		fprintf(stderr, "ShardedTapRuntime: can't add shard (too many shards, or already running)\n");
+		abort();
+	}
+
+	m_shards[m_count] = shard;
+	return m_count ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Steering
+
+/**
+	@brief Passes a received frame to the shard which owns its flow
+
+	Returns false if the destination shard is too far behind to take it, in which case the frame is still owned by
+	the caller.
+ */
+bool ShardedTapRuntime::Forward(EthernetFrame* frame, uint32_t from, uint32_t to)
+{
+	if(!m_inboxes[from][to].Push(frame))
+		return false;
+
+	m_shards[to]->Wake();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Thread management
+
+/**
+	@brief Starts one thread per shard
+
+	Each shard's stack must be attached (see TapShard::UseStack()) before calling this. Returns false if there are no
+	shards, or the runtime is already running.
+ */
+bool ShardedTapRuntime::Start()
+{
+	if(m_running || (m_count == 0) )
+		return false;
+
+	//Set up everything before starting any threads, since a shard can forward frames to any other as soon as it runs
+	for(uint32_t i=0; i<m_count; i++)
+		m_shards[i]->Start(m_count);
+
+	m_stopping = false;
+	m_running = true;
+	for(uint32_t i=0; i<m_count; i++)
+		m_threads[i] = std::thread(&TapShard::Run, m_shards[i]);
+	return true;
+}
+
+/**
+	@brief Stops all of the shard threads, and discards any frames still waiting to be forwarded
+ */
+void ShardedTapRuntime::Stop()
+{
+	if(!m_running)
+		return;
+
+	__atomic_store_n(&m_stopping, true, __ATOMIC_RELEASE);
+	for(uint32_t i=0; i<m_count; i++)
+		m_shards[i]->Wake();
+	for(uint32_t i=0; i<m_count; i++)
+		m_threads[i].join();
+	m_running = false;
+
+	for(uint32_t from=0; from<m_count; from++)
+	{
+		for(uint32_t to=0; to<m_count; to++)
+		{
+			EthernetFrame* frame;
+			while(m_inboxes[from][to].Pop(frame))
+				m_shards[to]->ReleaseRxFrame(frame);
+		}
+	}
+}
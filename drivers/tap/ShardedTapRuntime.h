@@ -0,0 +1,130 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of ShardedTapRuntime
+ */
+
+#ifndef ShardedTapRuntime_h
+#define ShardedTapRuntime_h
+
+#include <thread>
+
+#include "../../util/SPSCRing.h"
+#include "TapShard.h"
+
+#ifndef ARP_CACHE_SHARED
+#error ShardedTapRuntime requires ARP_CACHE_SHARED to be defined in staticnet-config.h
+#endif
+
+//Max number of shards (threads) in a ShardedTapRuntime
+#ifndef TAP_MAX_SHARDS
+#define TAP_MAX_SHARDS 8
+#endif
+
+//Number of frames one shard can have waiting to be forwarded to another (must be a power of two)
+#ifndef TAP_SHARD_INBOX_SIZE
+#define TAP_SHARD_INBOX_SIZE 64
+#endif
+
+/**
+	@brief Runs several copies of the stack on a multi-queue tap device, one thread per copy
+
+	Used to scale the stack across cores on Linux hosts (simulators, gateways). Connection state is already per
+	TCPProtocol instance, so each shard simply gets its own TCPProtocol (and SSHTransportServer, etc.) and connections
+	are split between them by a hash of their 4-tuple. See TapShard for how frames are steered.
+
+	All shards' IPv4Protocol and ARPProtocol instances must use the same ARPCache, which is built for concurrent
+	lookups when ARP_CACHE_SHARED is defined. Address configuration (e.g. from DHCP) must be applied to every shard.
+	Application callbacks run on the shard threads, so anything they share must be thread safe. SPSC_CACHE_LINE_SIZE
+	should be set to 64 for host builds.
+
+	Typical use:
+
+		ShardedTapRuntime runtime;
+		for(each shard)
+		{
+			auto shard = new TapShard(runtime, "simtap");
+			auto eth = new EthernetProtocol(*shard, mac);
+			eth->UseClock(&clock);
+			//...set up ARP and IPv4 with the shared cache, TCP, SSH, etc.
+			auto runner = new StackRunner(*shard, *eth);
+			runner->UseTCP(tcp);
+			shard->UseStack(runner, arp, tcp);
+		}
+		runtime.Start();
+ */
+class ShardedTapRuntime
+{
+public:
+	ShardedTapRuntime();
+	~ShardedTapRuntime();
+
+	uint32_t AddShard(TapShard* shard);
+
+	///@brief Returns the number of shards
+	uint32_t GetShardCount()
+	{ return m_count; }
+
+	///@brief Gets the queue of frames forwarded from one shard to another
+	SPSCRing<EthernetFrame*, TAP_SHARD_INBOX_SIZE>& GetInbox(uint32_t from, uint32_t to)
+	{ return m_inboxes[from][to]; }
+
+	bool Forward(EthernetFrame* frame, uint32_t from, uint32_t to);
+
+	bool Start();
+	void Stop();
+
+	///@brief Checks if the shard threads have been asked to exit
+	bool IsStopping()
+	{ return __atomic_load_n(&m_stopping, __ATOMIC_ACQUIRE); }
+
+protected:
+
+	///@brief The shards
+	TapShard* m_shards[TAP_MAX_SHARDS];
+
+	///@brief Number of valid entries in m_shards
+	uint32_t m_count;
+
+	///@brief Frames received by one shard (first index) for flows owned by another (second index)
+	SPSCRing<EthernetFrame*, TAP_SHARD_INBOX_SIZE> m_inboxes[TAP_MAX_SHARDS][TAP_MAX_SHARDS];
+
+	///@brief Thread running each shard
+	std::thread m_threads[TAP_MAX_SHARDS];
+
+	///@brief True if the threads are running
+	bool m_running;
+
+	///@brief Set to make the threads exit
+	bool m_stopping;
+};
+
+#endif
@@ -47,7 +47,14 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
 
-TapEthernetInterface::TapEthernetInterface(const char* name)
+/**
+	@brief Opens a tap device
+
+	If multiQueue is set, the device is opened with IFF_MULTI_QUEUE. Each TapEthernetInterface created with the same
+	name is then a separate queue of one device, so several copies of the stack can each read and write their own
+	queue from a different thread. The kernel sends each flow to the queue which most recently transmitted on it.
+ */
+TapEthernetInterface::TapEthernetInterface(const char* name, bool multiQueue)
 {
 	signal(SIGPIPE, SIG_IGN);
 
@@ -71,6 +78,8 @@ TapEthernetInterface::TapEthernetInterface(const char* name)
 	ifreq ifr;
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if(multiQueue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
 	if(ioctl(m_hTun, TUNSETIFF, &ifr) < 0)
 	{
@@ -93,9 +102,16 @@ EthernetFrame* TapEthernetInterface::GetTxFrame()
 	return new EthernetFrame;
 }
 
+bool TapEthernetInterface::IsTxBufferAvailable()
+{
+	//Frames are heap allocated, so we never run out
+	return true;
+}
+
 void TapEthernetInterface::SendTxFrame(EthernetFrame* frame, bool markFree)
 {
-	write(m_hTun, frame->RawData(), frame->Length());
+	//If the kernel can't take the frame right now, it's lost like it would be on a real wire
+	[[maybe_unused]] auto len = write(m_hTun, frame->RawData(), frame->Length());
 
 	if(markFree)
 		delete frame;
@@ -43,15 +43,24 @@
 class TapEthernetInterface : public EthernetInterface
 {
 public:
-	TapEthernetInterface(const char* name);
+	TapEthernetInterface(const char* name, bool multiQueue = false);
 	virtual ~TapEthernetInterface();
 
 	virtual EthernetFrame* GetTxFrame() override;
+	virtual bool IsTxBufferAvailable() override;
 	virtual void SendTxFrame(EthernetFrame* frame, bool markFree=true) override;
 	virtual void CancelTxFrame(EthernetFrame* frame) override;
 	virtual EthernetFrame* GetRxFrame() override;
 	virtual void ReleaseRxFrame(EthernetFrame* frame) override;
 
+	///@brief RX and TX frames are both heap allocated, so any frame can be used for either
+	virtual bool TurnaroundRxFrame([[maybe_unused]] EthernetFrame* frame) override
+	{ return true; }
+
+	///@brief Returns the file descriptor of the tap device, for use with poll() etc
+	int GetFD()
+	{ return m_hTun; }
+
 protected:
 	int m_hTun;
 };
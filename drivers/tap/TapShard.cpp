@@ -0,0 +1,237 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include <staticnet-config.h>
+#include <staticnet/stack/staticnet.h>
+#include "ShardedTapRuntime.h"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Opens a new queue of a multi-queue tap device, and adds it to a runtime as a new shard
+ */
+TapShard::TapShard(ShardedTapRuntime& runtime, const char* name)
+	: m_runtime(runtime)
+	, m_tap(name, true)
+	, m_index(runtime.AddShard(this))
+	, m_count(1)
+	, m_runner(nullptr)
+	, m_arp(nullptr)
+	, m_tcp(nullptr)
+	, m_arpSequence(0)
+	, m_forwardDrops(0)
+{
+	m_wakeFd = eventfd(0, EFD_NONBLOCK);
+	if(m_wakeFd < 0)
+	{
+		perror("eventfd");
+		abort();
+	}
+}
+
+TapShard::~TapShard()
+{
+	close(m_wakeFd);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Receive path
+
+/**
+	@brief Returns the next received frame for a flow we own
+
+	Frames forwarded by other shards come first. Frames read from our queue which belong to another shard are passed
+	on to it, or dropped if it can't keep up.
+ */
+EthernetFrame* TapShard::GetRxFrame()
+{
+	EthernetFrame* frame;
+	for(uint32_t i=0; i<m_count; i++)
+	{
+		if( (i != m_index) && m_runtime.GetInbox(i, m_index).Pop(frame) )
+			return frame;
+	}
+
+	while(true)
+	{
+		frame = m_tap.GetRxFrame();
+		if(!frame)
+			return nullptr;
+
+		auto owner = GetOwner(frame);
+		if(owner == m_index)
+			return frame;
+
+		if(!m_runtime.Forward(frame, m_index, owner))
+		{
+			m_forwardDrops ++;
+			m_tap.ReleaseRxFrame(frame);
+		}
+	}
+}
+
+/**
+	@brief Figures out which shard should process a received frame
+
+	This runs before the stack has looked at the frame, so it works on the raw bytes in network byte order. Only TCP
+	is steered, and only if the frame is well formed enough for the TCP stack to accept it. Anything else is processed
+	by whichever shard received it.
+ */
+uint32_t TapShard::GetOwner(EthernetFrame* frame)
+{
+	if(m_count == 1)
+		return m_index;
+
+	auto data = frame->RawData();
+	auto len = frame->Length();
+	const uint32_t ethHeaderLen = 14;
+	if(len < ethHeaderLen)
+		return m_index;
+	uint16_t ethertype = (data[12] << 8) | data[13];
+
+	//Find the remote address, in the form TCPProtocol keys its table by, and the TCP header
+	IPv4Address key;
+	const uint8_t* tcp;
+	auto ip = data + ethHeaderLen;
+	if(ethertype == ETHERTYPE_IPV4)
+	{
+		if(len < ethHeaderLen + 20)
+			return m_index;
+
+		//Not TCP, or a fragment
+		if( (ip[9] != IP_PROTO_TCP) || ( ( (ip[6] << 8) | ip[7]) & 0x3fff) )
+			return m_index;
+
+		memcpy(key.m_octets, ip + 12, IPV4_ADDR_SIZE);
+		tcp = ip + (ip[0] & 0xf) * 4;
+	}
+	else if(ethertype == ETHERTYPE_IPV6)
+	{
+		if( (len < ethHeaderLen + 40) || (ip[6] != IP_PROTO_TCP) )
+			return m_index;
+
+		IPv6Address src;
+		memcpy(src.m_octets, ip + 8, IPV6_ADDR_SIZE);
+		key = TCPRemoteAddress(src).m_key;
+		tcp = ip + 40;
+	}
+	else
+		return m_index;
+
+	if(tcp + 4 > data + len)
+		return m_index;
+
+	uint16_t remotePort = (tcp[0] << 8) | tcp[1];
+	uint16_t localPort = (tcp[2] << 8) | tcp[3];
+	return TCPProtocol::GetFlowShard(key, localPort, remotePort, m_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Thread
+
+/**
+	@brief Prepares the shard to run, once every shard has been added to the runtime
+ */
+void TapShard::Start(uint32_t count)
+{
+	m_count = count;
+
+	if(m_tcp)
+		m_tcp->SetShard(m_index, count);
+
+	//The first shard ages the shared ARP cache for everyone
+	if(m_arp)
+	{
+		m_arp->SetCacheOwner(m_index == 0);
+		m_arpSequence = m_arp->GetCache()->GetSequence();
+	}
+}
+
+/**
+	@brief Main loop of the shard's thread
+ */
+void TapShard::Run()
+{
+	while(!m_runtime.IsStopping())
+	{
+		bool more = m_runner->Poll();
+
+		//If another shard learned a new mapping, send anything we were holding for it
+		if(m_arp)
+		{
+			auto seq = m_arp->GetCache()->GetSequence();
+			if(seq != m_arpSequence)
+			{
+				m_arpSequence = seq;
+				m_arp->CheckPendingQueries();
+			}
+		}
+
+		if(!more)
+			Wait(m_runner->GetNextDeadline());
+	}
+}
+
+/**
+	@brief Sleeps until a frame arrives on our queue, another shard forwards us one, or a timeout in ms passes
+ */
+void TapShard::Wait(uint32_t timeout)
+{
+	pollfd fds[2];
+	fds[0].fd = m_tap.GetFD();
+	fds[0].events = POLLIN;
+	fds[1].fd = m_wakeFd;
+	fds[1].events = POLLIN;
+	poll(fds, 2, (timeout > INT32_MAX) ? -1 : static_cast<int>(timeout));
+
+	//Clear the wakeup before looking at the inboxes, so a frame forwarded after this wakes us again.
+	//The only possible failure is EAGAIN if someone else already cleared it, which is fine
+	uint64_t count;
+	if( (fds[1].revents & POLLIN) && (read(m_wakeFd, &count, sizeof(count)) != sizeof(count)) )
+		count = 0;
+}
+
+/**
+	@brief Wakes the shard's thread if it's sleeping (safe to call from any thread)
+ */
+void TapShard::Wake()
+{
+	//This can only fail if the counter is about to overflow, in which case the thread is awake anyway
+	uint64_t one = 1;
+	if(write(m_wakeFd, &one, sizeof(one)) != sizeof(one))
+		return;
+}
@@ -0,0 +1,145 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of TapShard
+ */
+
+#ifndef TapShard_h
+#define TapShard_h
+
+#include "TapEthernetInterface.h"
+
+class ShardedTapRuntime;
+class StackRunner;
+class ARPProtocol;
+class TCPProtocol;
+
+/**
+	@brief One shard of a ShardedTapRuntime: a queue of a multi-queue tap device, and the stack which runs on it
+
+	Each shard has its own complete copy of the stack (EthernetProtocol, IPv4Protocol, TCPProtocol, SSH server etc.),
+	run from its own thread by a StackRunner, with only the ARP cache shared between them. The shard is the driver for
+	its copy of the stack.
+
+	TCP connections are owned by whichever shard TCPProtocol::GetFlowShard() picks for them. The kernel usually
+	delivers a flow to the right queue, since it sends each flow to the queue which last transmitted on it, but not
+	always (e.g. the first SYN of an inbound connection). Received TCP frames for flows owned by another shard are
+	forwarded to that shard through a lock-free queue before the stack sees them. Everything else (ARP, ICMP, UDP) is
+	handled by whichever shard received it.
+ */
+class TapShard : public EthernetInterface
+{
+public:
+	TapShard(ShardedTapRuntime& runtime, const char* name);
+	virtual ~TapShard();
+
+	virtual EthernetFrame* GetTxFrame() override
+	{ return m_tap.GetTxFrame(); }
+
+	virtual bool IsTxBufferAvailable() override
+	{ return m_tap.IsTxBufferAvailable(); }
+
+	virtual void SendTxFrame(EthernetFrame* frame, bool markFree=true) override
+	{ m_tap.SendTxFrame(frame, markFree); }
+
+	virtual void CancelTxFrame(EthernetFrame* frame) override
+	{ m_tap.CancelTxFrame(frame); }
+
+	virtual EthernetFrame* GetRxFrame() override;
+
+	virtual void ReleaseRxFrame(EthernetFrame* frame) override
+	{ m_tap.ReleaseRxFrame(frame); }
+
+	virtual bool TurnaroundRxFrame(EthernetFrame* frame) override
+	{ return m_tap.TurnaroundRxFrame(frame); }
+
+	/**
+		@brief Attaches this shard's copy of the stack
+
+		@param runner	Runner for the shard's EthernetProtocol, with the TCP stack (if any) already attached
+		@param arp		The shard's ARP stack, sharing its cache with the other shards (may be null)
+		@param tcp		The shard's TCP stack (may be null)
+	 */
+	void UseStack(StackRunner* runner, ARPProtocol* arp, TCPProtocol* tcp)
+	{
+		m_runner = runner;
+		m_arp = arp;
+		m_tcp = tcp;
+	}
+
+	///@brief Returns the index of this shard in the runtime
+	uint32_t GetIndex()
+	{ return m_index; }
+
+	///@brief Returns the number of received frames dropped because another shard's inbox was full
+	uint32_t GetForwardDropCount()
+	{ return m_forwardDrops; }
+
+	void Start(uint32_t count);
+	void Run();
+	void Wake();
+
+protected:
+	uint32_t GetOwner(EthernetFrame* frame);
+	void Wait(uint32_t timeout);
+
+	///@brief The runtime we're part of
+	ShardedTapRuntime& m_runtime;
+
+	///@brief Our queue of the tap device
+	TapEthernetInterface m_tap;
+
+	///@brief Index of this shard in the runtime
+	uint32_t m_index;
+
+	///@brief Number of shards in the runtime
+	uint32_t m_count;
+
+	///@brief eventfd used to wake our thread when another shard forwards us a frame
+	int m_wakeFd;
+
+	///@brief Runner for our copy of the stack
+	StackRunner* m_runner;
+
+	///@brief Our ARP stack (if any)
+	ARPProtocol* m_arp;
+
+	///@brief Our TCP stack (if any)
+	TCPProtocol* m_tcp;
+
+	///@brief ARP cache sequence count when we last checked for queries answered to other shards
+	uint32_t m_arpSequence;
+
+	///@brief Number of frames dropped because another shard's inbox was full
+	uint32_t m_forwardDrops;
+};
+
+#endif
@@ -34,9 +34,16 @@
 // Construction / destruction
 
 ARPCache::ARPCache()
-	: m_nextWayToEvict(0)
+	: m_now(0)
 	, m_cacheLifetime(300)
+	, m_generation(0)
+	, m_lastRefreshed(nullptr)
+	, m_pinnedCount(0)
 {
+#ifdef ARP_CACHE_SHARED
+	m_sequence = 0;
+	m_writeLock = false;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -70,17 +77,21 @@ __attribute__((section(".tcmtext")))
 #endif
 bool ARPCache::Lookup(MACAddress& mac, IPv4Address ip)
 {
-	size_t hash = Hash(ip);
-	for(size_t way=0; way < ARP_CACHE_WAYS; way++)
+	uint32_t seq;
+	ARPCacheEntry* row;
+	bool found;
+	do
 	{
-		auto& row = m_ways[way].m_lines[hash];
-		if(row.m_valid && row.m_ip == ip)
-		{
-			mac = row.m_mac;
-			return true;
-		}
-	}
-	return false;
+		seq = ReadBegin();
+		row = Find(ip);
+		found = row && IsUsable(*row);
+		if(found)
+			mac = row->m_mac;
+	} while(ReadRetry(seq));
+
+	if(found)
+		Touch(*row);
+	return found;
 }
 
 /**
@@ -90,18 +101,24 @@ bool ARPCache::Lookup(MACAddress& mac, IPv4Address ip)
  */
 bool ARPCache::LookupAndExpiryCheck(MACAddress& mac, IPv4Address ip, uint16_t& expiry)
 {
-	size_t hash = Hash(ip);
-	for(size_t way=0; way < ARP_CACHE_WAYS; way++)
+	uint32_t seq;
+	ARPCacheEntry* row;
+	bool found;
+	do
 	{
-		auto& row = m_ways[way].m_lines[hash];
-		if(row.m_valid && row.m_ip == ip)
+		seq = ReadBegin();
+		row = Find(ip);
+		found = row && IsUsable(*row);
+		if(found)
 		{
-			mac = row.m_mac;
-			expiry = row.m_lifetime;
-			return true;
+			mac = row->m_mac;
+			expiry = GetRemainingLifetime(*row);
 		}
-	}
-	return false;
+	} while(ReadRetry(seq));
+
+	if(found)
+		Touch(*row);
+	return found;
 }
 
 /**
@@ -109,14 +126,16 @@ bool ARPCache::LookupAndExpiryCheck(MACAddress& mac, IPv4Address ip, uint16_t& e
  */
 uint16_t ARPCache::GetExpiry(IPv4Address ip)
 {
-	size_t hash = Hash(ip);
-	for(size_t way=0; way < ARP_CACHE_WAYS; way++)
+	uint32_t seq;
+	uint16_t expiry;
+	do
 	{
-		auto& row = m_ways[way].m_lines[hash];
-		if(row.m_valid && row.m_ip == ip)
-			return row.m_lifetime;
-	}
-	return 0;
+		seq = ReadBegin();
+		auto row = Find(ip);
+		expiry = row ? GetRemainingLifetime(*row) : 0;
+	} while(ReadRetry(seq));
+
+	return expiry;
 }
 
 /**
@@ -126,88 +145,292 @@ uint16_t ARPCache::GetExpiry(IPv4Address ip)
  */
 void ARPCache::Insert(MACAddress& mac, IPv4Address ip)
 {
-	size_t hash = Hash(ip);
+	WriteBegin();
+	InsertLocked(mac, ip);
+	WriteEnd();
+}
 
-	//Look for a free space or duplicate entry
-	bool foundEmpty = false;
-	size_t way = 0;
-	for(; way < ARP_CACHE_WAYS; way ++)
+/**
+	@brief Implementation of Insert(), called with the write lock held
+ */
+void ARPCache::InsertLocked(MACAddress& mac, IPv4Address ip)
+{
+	//Does the cache already have an entry for this IP? Update the MAC and lifetime, then we're done
+	//(unless it's static, in which case whatever we heard on the wire doesn't get to override it)
+	auto row = Find(ip);
+	if(row)
 	{
-		auto& row = m_ways[way].m_lines[hash];
-
-		//There's something in the row. We can't insert here.
-		if(row.m_valid)
+		if(!row->m_static)
 		{
-			//Does the row already have an entry for this IP? Update the MAC and lifetime, then we're done
-			if(row.m_ip == ip)
+			if(row->m_mac != mac)
 			{
-				row.m_mac = mac;
-				row.m_lifetime = m_cacheLifetime;
-				return;
+				row->m_mac = mac;
+				BumpGeneration();
 			}
-
-			//Nope, it's another IP. Ignore it.
+			row->m_expiry = m_now + m_cacheLifetime;
 		}
+		return;
+	}
 
-		//Unoccupied! Report this way as available for insertion
-		else
+	//Not already in the cache, find a space for it
+	row = Allocate(ip);
+	if(!row)
+		return;
+
+	Fill(row, mac, ip);
+	row->m_pinned = IsPinnedAddress(ip);
+	row->m_static = false;
+}
+
+/**
+	@brief Updates the cache after receiving a frame from a given (MAC, IP) pair
+
+	This is called for every frame received from the local subnet, so it's optimized for the common case of hearing
+	from a peer we already know about: the cache is only written to if the MAC changed or the entry is close to
+	expiring, and repeated frames from the same peer skip the hash lookup entirely.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void ARPCache::Refresh(MACAddress& mac, IPv4Address ip)
+{
+#ifdef ARP_CACHE_SHARED
+
+	//Check if anything needs changing before taking the write lock, so other threads' lookups don't have to retry
+	uint32_t seq;
+	ARPCacheEntry* row;
+	bool current;
+	do
+	{
+		seq = ReadBegin();
+		row = Find(ip);
+		current = row && (row->m_static ||
+			( (row->m_mac == mac) && (GetRemainingLifetime(*row) >= ARP_CACHE_RX_REFRESH_THRESHOLD) ) );
+	} while(ReadRetry(seq));
+
+	if(current)
+	{
+		Touch(*row);
+		return;
+	}
+
+#endif
+
+	WriteBegin();
+	RefreshLocked(mac, ip);
+	WriteEnd();
+}
+
+/**
+	@brief Implementation of Refresh(), called with the write lock held
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void ARPCache::RefreshLocked(MACAddress& mac, IPv4Address ip)
+{
+	auto row = m_lastRefreshed;
+	if(!row || !row->m_valid || (row->m_ip != ip) )
+	{
+		row = Find(ip);
+		if(!row)
 		{
-			foundEmpty = true;
-			way = way;
-			break;
+			InsertLocked(mac, ip);
+			return;
 		}
+		m_lastRefreshed = row;
 	}
 
-	//If we get here, it's not already in the cache. Did we have space to insert?
-	//If no space, pick an entry to overwrite
-	if(!foundEmpty)
+	if(row->m_static)
+		return;
+
+	Touch(*row);
+	if(row->m_mac != mac)
 	{
-		way = m_nextWayToEvict;
+		row->m_mac = mac;
+		row->m_expiry = m_now + m_cacheLifetime;
+		BumpGeneration();
+	}
+	else if(GetRemainingLifetime(*row) < ARP_CACHE_RX_REFRESH_THRESHOLD)
+		row->m_expiry = m_now + m_cacheLifetime;
+}
 
-		//Pick another way to use next time
-		//For now, sequential replacement policy
-		m_nextWayToEvict = (m_nextWayToEvict + 1) % ARP_CACHE_WAYS;
+/**
+	@brief Inserts a static entry into the ARP cache, replacing any learned entry for the same IP
+
+	Static entries never expire and are never evicted. Returns false if every way of the cache line is already pinned.
+ */
+bool ARPCache::InsertStatic(MACAddress& mac, IPv4Address ip)
+{
+	WriteBegin();
+
+	auto row = Find(ip);
+	if(!row)
+		row = Allocate(ip);
+	if(row)
+	{
+		Fill(row, mac, ip);
+		row->m_pinned = true;
+		row->m_static = true;
 	}
 
-	//Insert the new entry
-	auto& row = m_ways[way].m_lines[hash];
-	row.m_valid = true;
-	row.m_ip = ip;
-	row.m_mac = mac;
-	row.m_lifetime = m_cacheLifetime;
+	WriteEnd();
+	return (row != nullptr);
 }
 
 /**
-	@brief Timer handler for aging out stale cache entries
+	@brief Sets up a newly allocated entry
+ */
+void ARPCache::Fill(ARPCacheEntry* row, MACAddress& mac, IPv4Address ip)
+{
+	//Replacing an existing mapping (or changing one to static)
+	if(row->m_valid)
+		BumpGeneration();
+
+	row->m_valid = true;
+	row->m_ip = ip;
+	row->m_mac = mac;
+	row->m_expiry = m_now + m_cacheLifetime;
+	Touch(*row);
+}
+
+/**
+	@brief Pins the entry for an address (e.g. the default gateway), now and whenever it's learned in the future
 
-	Call this function at approximately 1 Hz.
+	Pinned entries are never evicted to make room for other addresses, and stay usable after their lifetime runs out
+	so that a late refresh doesn't cut off all traffic. ARPProtocol sends refresh queries for them in the background.
+
+	Returns false if too many addresses are pinned already.
  */
-void ARPCache::OnAgingTick()
+bool ARPCache::Pin(IPv4Address ip)
 {
-	for(size_t i=0; i<ARP_CACHE_WAYS; i++)
+	WriteBegin();
+
+	bool ok = true;
+	if(!IsPinnedAddress(ip))
 	{
-		for(size_t j=0; j<ARP_CACHE_LINES; j++)
+		if(m_pinnedCount >= ARP_CACHE_MAX_PINNED)
+			ok = false;
+		else
 		{
-			auto& row = m_ways[i].m_lines[j];
-			if(row.m_valid)
-			{
-				if(row.m_lifetime == 0)
-					row.m_valid = false;
-				else
-					row.m_lifetime --;
-			}
+			m_pinnedAddrs[m_pinnedCount] = ip;
+			m_pinnedCount ++;
+		}
+	}
+
+	if(ok)
+	{
+		auto row = Find(ip);
+		if(row)
+			row->m_pinned = true;
+		BumpGeneration();
+	}
+
+	WriteEnd();
+	return ok;
+}
+
+/**
+	@brief Reverts an address pinned by Pin() to a normal entry
+ */
+void ARPCache::Unpin(IPv4Address ip)
+{
+	WriteBegin();
+
+	for(uint32_t i=0; i<m_pinnedCount; i++)
+	{
+		if(m_pinnedAddrs[i] == ip)
+		{
+			m_pinnedCount --;
+			m_pinnedAddrs[i] = m_pinnedAddrs[m_pinnedCount];
+			break;
 		}
 	}
+
+	//If it was only being kept around because it was pinned, it'll now be treated as expired
+	auto row = Find(ip);
+	if(row && !row->m_static)
+		row->m_pinned = false;
+	BumpGeneration();
+
+	WriteEnd();
+}
+
+/**
+	@brief Checks if an address is in the pinned list
+ */
+bool ARPCache::IsPinnedAddress(IPv4Address ip)
+{
+	for(uint32_t i=0; i<m_pinnedCount; i++)
+	{
+		if(m_pinnedAddrs[i] == ip)
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Finds the cache entry for an address, if we have one (even if it has expired)
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+ARPCacheEntry* ARPCache::Find(IPv4Address ip)
+{
+	size_t hash = Hash(ip);
+	for(size_t way=0; way < ARP_CACHE_WAYS; way++)
+	{
+		auto& row = m_ways[way].m_lines[hash];
+		if(row.m_valid && row.m_ip == ip)
+			return &row;
+	}
+	return nullptr;
+}
+
+/**
+	@brief Picks a cache entry to store a new address in, evicting an existing entry if needed
+
+	Free or expired entries are used first. Otherwise the least recently used entry in the line is replaced, so that
+	busy peers stay in the cache while idle ones are evicted. Pinned entries are never evicted. Returns nullptr if every
+	way of the line is pinned.
+ */
+ARPCacheEntry* ARPCache::Allocate(IPv4Address ip)
+{
+	size_t hash = Hash(ip);
+
+	ARPCacheEntry* victim = nullptr;
+	for(size_t way=0; way < ARP_CACHE_WAYS; way++)
+	{
+		auto& row = m_ways[way].m_lines[hash];
+		if(!IsUsable(row))
+			return &row;
+		if(row.m_pinned)
+			continue;
+
+		if(!victim || ( (m_now - GetLastUsed(row)) > (m_now - GetLastUsed(*victim)) ) )
+			victim = &row;
+	}
+
+	return victim;
 }
 
 /**
-	@brief Marks the entire cache as invalid
+	@brief Marks the entire cache, other than static entries, as invalid
  */
 void ARPCache::Clear()
 {
+	WriteBegin();
+	BumpGeneration();
+
 	for(size_t i=0; i<ARP_CACHE_WAYS; i++)
 	{
 		for(size_t j=0; j<ARP_CACHE_LINES; j++)
-			m_ways[i].m_lines[j].m_valid = false;
+		{
+			auto& row = m_ways[i].m_lines[j];
+			if(!row.m_static)
+				row.m_valid = false;
+		}
 	}
+
+	WriteEnd();
 }
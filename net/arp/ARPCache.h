@@ -37,6 +37,17 @@
 
 #include "../ipv4/IPv4Address.h"
 #include "../ethernet/MACAddress.h"
+#include "../../drivers/base/MonotonicClock.h"
+
+//Maximum number of addresses whose cache entries may be pinned at once
+#ifndef ARP_CACHE_MAX_PINNED
+#define ARP_CACHE_MAX_PINNED 2
+#endif
+
+//Remaining lifetime, in seconds, below which a received frame extends its sender's cache entry
+#ifndef ARP_CACHE_RX_REFRESH_THRESHOLD
+#define ARP_CACHE_RX_REFRESH_THRESHOLD 60
+#endif
 
 /**
 	@brief A single entry in an ARP cache
@@ -46,10 +57,24 @@ class ARPCacheEntry
 public:
 	ARPCacheEntry()
 	: m_valid(false)
+	, m_pinned(false)
+	, m_static(false)
 	{}
 
 	bool m_valid;
-	uint16_t m_lifetime;
+
+	///@brief Pinned entries are never evicted, and stay valid (with the last known MAC) after their lifetime runs out
+	bool m_pinned;
+
+	///@brief Static entries are pinned, never expire, and are not changed by learned mappings
+	bool m_static;
+
+	///@brief Time (on the cache's clock, in seconds) at which the entry expires
+	uint32_t m_expiry;
+
+	///@brief Time (on the cache's clock, in seconds) at which the entry was last used, for LRU replacement
+	uint32_t m_lastUsed;
+
 	IPv4Address m_ip;
 	MACAddress m_mac;
 };
@@ -65,6 +90,11 @@ public:
 
 /**
 	@brief The ARP cache
+
+	If ARP_CACHE_SHARED is defined, one cache may be shared by several stacks running on different threads (see
+	ShardedTapRuntime). Lookups are lock-free: readers retry if the cache's sequence count changed while they were
+	looking, while writers take a spinlock and bump the count before and after each change. Since most frames only
+	read the cache, this keeps the stacks from contending with each other in the common case.
  */
 class ARPCache
 {
@@ -74,8 +104,36 @@ public:
 	bool Lookup(MACAddress& mac, IPv4Address ip);
 	bool LookupAndExpiryCheck(MACAddress& mac, IPv4Address ip, uint16_t& expiry);
 	void Insert(MACAddress& mac, IPv4Address ip);
+	void Refresh(MACAddress& mac, IPv4Address ip);
+	bool InsertStatic(MACAddress& mac, IPv4Address ip);
+
+	bool Pin(IPv4Address ip);
+	void Unpin(IPv4Address ip);
+
+	/**
+		@brief Returns the number of pinned addresses
+	 */
+	uint32_t GetPinnedCount()
+	{ return m_pinnedCount; }
 
-	void OnAgingTick();
+	/**
+		@brief Returns a pinned address
+	 */
+	IPv4Address GetPinned(uint32_t i)
+	{ return m_pinnedAddrs[i]; }
+
+	/**
+		@brief Timer handler for aging out stale cache entries
+
+		Call this function at approximately 1 Hz. Entries carry absolute expiration times, so this just advances the
+		cache's clock.
+	 */
+	void OnAgingTick()
+	{
+		WriteBegin();
+		__atomic_store_n(&m_now, m_now + 1, __ATOMIC_RELAXED);
+		WriteEnd();
+	}
 
 	void Clear();
 
@@ -96,18 +154,181 @@ public:
 
 	uint16_t GetExpiry(IPv4Address ip);
 
+	/**
+		@brief Returns a counter which changes whenever a mapping is changed or removed
+
+		Anything which caches MAC addresses outside the ARP cache (e.g. IPv4TxTemplate) must discard them when this
+		changes.
+	 */
+	uint32_t GetGeneration()
+	{
+	#ifdef ARP_CACHE_SHARED
+		return __atomic_load_n(&m_generation, __ATOMIC_ACQUIRE);
+	#else
+		return m_generation;
+	#endif
+	}
+
+	///@brief Returns the current time on the cache's clock, in seconds
+	uint32_t GetTime()
+	{
+	#ifdef ARP_CACHE_SHARED
+		return __atomic_load_n(&m_now, __ATOMIC_RELAXED);
+	#else
+		return m_now;
+	#endif
+	}
+
+	/**
+		@brief Returns the remaining lifetime of an entry, in seconds (zero if expired)
+	 */
+	uint16_t GetRemainingLifetime(const ARPCacheEntry& row)
+	{
+		if(row.m_static)
+			return 0xffff;
+		auto now = GetTime();
+		if(MonotonicClock::IsExpired(now, row.m_expiry))
+			return 0;
+		return row.m_expiry - now;
+	}
+
+	/**
+		@brief Checks if an entry may be used to send traffic
+	 */
+	bool IsUsable(const ARPCacheEntry& row)
+	{ return row.m_valid && (row.m_pinned || !MonotonicClock::IsExpired(GetTime(), row.m_expiry)); }
+
+#ifdef ARP_CACHE_SHARED
+	/**
+		@brief Returns a counter which changes whenever anything in the cache is written to
+
+		Stacks sharing the cache can poll this to find out when another one learned a mapping.
+	 */
+	uint32_t GetSequence()
+	{ return __atomic_load_n(&m_sequence, __ATOMIC_ACQUIRE); }
+#endif
+
 protected:
 
+	/**
+		@brief Starts a lookup, returning the sequence count to pass to ReadRetry() at the end
+	 */
+	uint32_t ReadBegin()
+	{
+	#ifdef ARP_CACHE_SHARED
+		while(true)
+		{
+			auto seq = __atomic_load_n(&m_sequence, __ATOMIC_ACQUIRE);
+			if(!(seq & 1))
+				return seq;
+		}
+	#else
+		return 0;
+	#endif
+	}
+
+	///@brief Checks if the cache was written to during a lookup, in which case the results must be discarded
+	bool ReadRetry([[maybe_unused]] uint32_t seq)
+	{
+	#ifdef ARP_CACHE_SHARED
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		return __atomic_load_n(&m_sequence, __ATOMIC_RELAXED) != seq;
+	#else
+		return false;
+	#endif
+	}
+
+	///@brief Takes the write lock, and marks the cache as being changed
+	void WriteBegin()
+	{
+	#ifdef ARP_CACHE_SHARED
+		while(__atomic_test_and_set(&m_writeLock, __ATOMIC_ACQUIRE))
+		{}
+		__atomic_store_n(&m_sequence, m_sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	#endif
+	}
+
+	/**
+		@brief Records that an entry was just used, for LRU replacement
+
+		Lookups call this without the write lock, after they're done reading. The timestamp is only a replacement hint,
+		so racing updates are harmless, but in shared mode they have to be atomic.
+	 */
+	void Touch(ARPCacheEntry& row)
+	{
+	#ifdef ARP_CACHE_SHARED
+		__atomic_store_n(&row.m_lastUsed, GetTime(), __ATOMIC_RELAXED);
+	#else
+		row.m_lastUsed = m_now;
+	#endif
+	}
+
+	///@brief Gets the time an entry was last used (see Touch())
+	uint32_t GetLastUsed(const ARPCacheEntry& row)
+	{
+	#ifdef ARP_CACHE_SHARED
+		return __atomic_load_n(&row.m_lastUsed, __ATOMIC_RELAXED);
+	#else
+		return row.m_lastUsed;
+	#endif
+	}
+
+	///@brief Invalidates MAC addresses cached outside the cache (see GetGeneration()). Call with the write lock held
+	void BumpGeneration()
+	{
+	#ifdef ARP_CACHE_SHARED
+		__atomic_store_n(&m_generation, m_generation + 1, __ATOMIC_RELEASE);
+	#else
+		m_generation ++;
+	#endif
+	}
+
+	///@brief Publishes changes and releases the write lock
+	void WriteEnd()
+	{
+	#ifdef ARP_CACHE_SHARED
+		__atomic_store_n(&m_sequence, m_sequence + 1, __ATOMIC_RELEASE);
+		__atomic_clear(&m_writeLock, __ATOMIC_RELEASE);
+	#endif
+	}
+
+#ifdef ARP_CACHE_SHARED
+	///@brief Sequence count for lock-free lookups, odd while a write is in progress
+	uint32_t m_sequence;
+
+	///@brief Serializes writers
+	bool m_writeLock;
+#endif
+
 	///@brief The actual cache data
 	ARPCacheWay m_ways[ARP_CACHE_WAYS];
 
-	///@brief Cache way to evict next time there's contention for space
-	size_t m_nextWayToEvict;
+	///@brief Current time, in seconds, advanced by OnAgingTick()
+	uint32_t m_now;
 
 	///@brief Lifetime of cache entries, in seconds
 	uint16_t m_cacheLifetime;
 
+	///@brief Incremented whenever a mapping is changed or removed
+	uint32_t m_generation;
+
+	///@brief The entry most recently refreshed by a received frame, checked first by Refresh()
+	ARPCacheEntry* m_lastRefreshed;
+
+	///@brief Addresses whose entries are pinned as soon as they're learned
+	IPv4Address m_pinnedAddrs[ARP_CACHE_MAX_PINNED];
+
+	///@brief Number of valid entries in m_pinnedAddrs
+	uint32_t m_pinnedCount;
+
 	size_t Hash(IPv4Address ip);
+	ARPCacheEntry* Find(IPv4Address ip);
+	ARPCacheEntry* Allocate(IPv4Address ip);
+	bool IsPinnedAddress(IPv4Address ip);
+	void InsertLocked(MACAddress& mac, IPv4Address ip);
+	void RefreshLocked(MACAddress& mac, IPv4Address ip);
+	void Fill(ARPCacheEntry* row, MACAddress& mac, IPv4Address ip);
 };
 
 #endif
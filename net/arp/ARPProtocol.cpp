@@ -40,17 +40,28 @@ ARPProtocol::ARPProtocol(EthernetProtocol& eth, IPv4Address& ip, ARPCache& cache
 	: m_eth(eth)
 	, m_ip(ip)
 	, m_cache(cache)
+	, m_queryCount(0)
+	, m_heldCount(0)
+	, m_cacheOwner(true)
 {
 
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Handler for incoming packets
+// Address resolution
+
+/**
+	@brief Sends an ARP query, unconditionally
 
+	Most callers should use Resolve() instead, which avoids flooding the network with duplicate queries.
+ */
 void ARPProtocol::SendQuery(IPv4Address& ip)
 {
 	//Prepare reply packet
-	auto frame = m_eth.GetTxFrame(ETHERTYPE_ARP, MACAddress{{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}});
+	auto frame = m_eth.GetTxFrame(
+		ETHERTYPE_ARP, MACAddress{{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}}, TX_CLASS_CONTROL);
+	if(!frame)
+		return;
 	frame->SetPayloadLength(sizeof(ARPPacket));
 	ARPPacket* query = reinterpret_cast<ARPPacket*>(frame->Payload());
 
@@ -71,6 +82,135 @@ void ARPProtocol::SendQuery(IPv4Address& ip)
 	m_eth.SendTxFrame(frame);
 }
 
+/**
+	@brief Starts resolving an address, if we aren't already
+
+	The first query is sent immediately. If it isn't answered, it is repeated every ARP_QUERY_INTERVAL_MS from
+	OnAgingTick() up to ARP_QUERY_RETRIES times, after which the address is remembered as unreachable for
+	ARP_NEGATIVE_CACHE_MS. Calling this again while a query is outstanding does nothing, so callers can use it on
+	every cache miss.
+
+	Returns false if the address recently failed to answer, or if no query could be started because every slot in the
+	query table is busy with another address. Either way nobody is resolving it, so there's no point waiting for it.
+ */
+bool ARPProtocol::Resolve(IPv4Address ip)
+{
+	for(uint32_t i=0; i<m_queryCount; i++)
+	{
+		if(m_queries[i].m_ip == ip)
+			return !m_queries[i].m_failed;
+	}
+
+	//Not being resolved yet. Find a slot for it, replacing the oldest failure if the table is full
+	ARPQuery* query = nullptr;
+	if(m_queryCount < ARP_MAX_PENDING_QUERIES)
+	{
+		query = &m_queries[m_queryCount];
+		m_queryCount ++;
+	}
+	else
+	{
+		auto now = m_eth.GetTimeMs();
+		for(uint32_t i=0; i<m_queryCount; i++)
+		{
+			auto& q = m_queries[i];
+			if(!q.m_failed)
+				continue;
+			if(!query || ( (now - q.m_timestamp) > (now - query->m_timestamp) ) )
+				query = &q;
+		}
+
+		//Everything in the table is still in progress. Don't query now, the caller will retry if it still cares
+		if(!query)
+			return false;
+	}
+
+	query->m_ip = ip;
+	query->m_timestamp = m_eth.GetTimeMs();
+	query->m_attempts = 1;
+	query->m_failed = false;
+	SendQuery(ip);
+	return true;
+}
+
+/**
+	@brief Forgets about any query for an address once we've heard from it
+ */
+void ARPProtocol::OnResolved(IPv4Address ip)
+{
+	for(uint32_t i=0; i<m_queryCount; i++)
+	{
+		if(m_queries[i].m_ip == ip)
+		{
+			RemoveQuery(i);
+			return;
+		}
+	}
+}
+
+/**
+	@brief Handles a query which has gone unanswered for ARP_QUERY_INTERVAL_MS
+ */
+void ARPProtocol::OnQueryTimeout(ARPQuery& query)
+{
+	query.m_timestamp = m_eth.GetTimeMs();
+
+	//Try again
+	if(query.m_attempts <= ARP_QUERY_RETRIES)
+	{
+		query.m_attempts ++;
+		SendQuery(query.m_ip);
+		return;
+	}
+
+	//Give up, and discard anything which was waiting for it
+	query.m_failed = true;
+	for(uint32_t i=0; i<m_heldCount; )
+	{
+		if(m_held[i].m_nextHop == query.m_ip)
+			DropHeldFrame(i);
+		else
+			i++;
+	}
+}
+
+/**
+	@brief Completes queries which were answered to someone else sharing our cache
+
+	The reply to a query only goes to the instance which received it, so when several instances share one ARPCache,
+	the others must call this after the cache changes to send any frames they were holding for the new mapping.
+ */
+void ARPProtocol::CheckPendingQueries()
+{
+	for(uint32_t i=0; i<m_queryCount; )
+	{
+		auto& query = m_queries[i];
+		MACAddress mac;
+		if(query.m_failed || !m_cache.Lookup(mac, query.m_ip))
+		{
+			i++;
+			continue;
+		}
+
+		auto ip = query.m_ip;
+		RemoveQuery(i);
+		if(m_heldCount)
+			FlushHeldFrames(mac, ip);
+	}
+}
+
+/**
+	@brief Removes an entry from the query table
+ */
+void ARPProtocol::RemoveQuery(uint32_t i)
+{
+	m_queryCount --;
+	m_queries[i] = m_queries[m_queryCount];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handler for incoming packets
+
 /**
 	@brief Handle an incoming ARP packet
  */
@@ -115,12 +255,23 @@ void ARPProtocol::OnRequestPacket(ARPPacket* packet)
 		return;
 
 	//Add entry for sender to our ARP table if needed
-	m_cache.Insert(packet->m_senderHardwareAddress, packet->m_senderProtocolAddress);
+	Insert(packet->m_senderHardwareAddress, packet->m_senderProtocolAddress);
 
-	//Prepare reply packet
-	auto frame = m_eth.GetTxFrame(ETHERTYPE_ARP, packet->m_senderHardwareAddress);
-	if(!frame)
-		return;
+	//Save the requester's addresses, since the reply may be formatted over the top of the request
+	MACAddress senderMAC = packet->m_senderHardwareAddress;
+	IPv4Address senderIP = packet->m_senderProtocolAddress;
+
+	//Prepare reply packet, reusing the request buffer if the driver allows it.
+	//Requests are normally broadcast, so always set the destination explicitly
+	auto frame = m_eth.TurnaroundRxFrame(TX_CLASS_CONTROL);
+	if(frame)
+		frame->DstMAC() = senderMAC;
+	else
+	{
+		frame = m_eth.GetTxFrame(ETHERTYPE_ARP, senderMAC, TX_CLASS_CONTROL);
+		if(!frame)
+			return;
+	}
 	frame->SetPayloadLength(sizeof(ARPPacket));
 	ARPPacket* reply = reinterpret_cast<ARPPacket*>(frame->Payload());
 
@@ -133,8 +284,8 @@ void ARPProtocol::OnRequestPacket(ARPPacket* packet)
 
 	reply->m_senderHardwareAddress = m_eth.GetMACAddress();
 	reply->m_senderProtocolAddress = m_ip;
-	reply->m_targetHardwareAddress = packet->m_senderHardwareAddress;
-	reply->m_targetProtocolAddress = packet->m_senderProtocolAddress;
+	reply->m_targetHardwareAddress = senderMAC;
+	reply->m_targetProtocolAddress = senderIP;
 
 	//Swap endianness and send
 	reply->ByteSwap();
@@ -148,9 +299,196 @@ void ARPProtocol::OnReplyPacket(ARPPacket* packet)
 {
 	//No filtering needed, any ARP packet gets in our table
 
-	//Add entry for sender to our ARP table
-	m_cache.Insert(packet->m_senderHardwareAddress, packet->m_senderProtocolAddress);
+	//Add entry for sender to our ARP table (and send anything we were holding for them)
+	Insert(packet->m_senderHardwareAddress, packet->m_senderProtocolAddress);
 
 	//No reply needed
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Hold queue for frames awaiting resolution
+
+/**
+	@brief Checks if there's room to hold another frame for the given next hop
+ */
+bool ARPProtocol::CanHold(IPv4Address nextHop)
+{
+	if(m_heldCount >= ARP_HOLD_QUEUE_SIZE)
+		return false;
+
+	uint32_t count = 0;
+	for(uint32_t i=0; i<m_heldCount; i++)
+	{
+		if(m_held[i].m_nextHop == nextHop)
+			count ++;
+	}
+	return count < ARP_HOLD_PER_DEST;
+}
+
+/**
+	@brief Parks an outbound frame until the MAC address of its next hop is known
+
+	The frame must be complete except for the destination MAC, and have its Ethernet header still in host byte order.
+	The header is converted to network byte order immediately, so the frame can be re-sent as-is by its owner if it is
+	dropped from the queue before it goes out.
+
+	If markFree is true, ownership of the frame passes to us and it is freed if the queue is full or the hold times out.
+	If false, the caller keeps ownership (e.g. a TCP segment in the retransmit pool) and must call Unhold() before
+	freeing it.
+ */
+void ARPProtocol::Hold(EthernetFrame* frame, IPv4Address nextHop, bool markFree)
+{
+	frame->ByteSwap();
+
+	if(!CanHold(nextHop))
+	{
+		if(markFree)
+			m_eth.CancelTxFrame(frame);
+		return;
+	}
+
+	auto& held = m_held[m_heldCount];
+	held.m_frame = frame;
+	held.m_nextHop = nextHop;
+	held.m_timestamp = m_eth.GetTimeMs();
+	held.m_markFree = markFree;
+	m_heldCount ++;
+}
+
+/**
+	@brief Checks if a frame is currently in the hold queue
+ */
+bool ARPProtocol::IsHeld(EthernetFrame* frame)
+{
+	for(uint32_t i=0; i<m_heldCount; i++)
+	{
+		if(m_held[i].m_frame == frame)
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Removes a frame from the hold queue without sending or freeing it
+
+	Owners of frames held with markFree=false must call this before freeing the frame. Harmless if not held.
+ */
+void ARPProtocol::Unhold(EthernetFrame* frame)
+{
+	for(uint32_t i=0; i<m_heldCount; i++)
+	{
+		if(m_held[i].m_frame == frame)
+		{
+			RemoveHeldFrame(i);
+			return;
+		}
+	}
+}
+
+/**
+	@brief Sends all frames which were waiting on a newly learned mapping, in the order they were queued
+ */
+void ARPProtocol::FlushHeldFrames(const MACAddress& mac, IPv4Address ip)
+{
+	for(uint32_t i=0; i<m_heldCount; )
+	{
+		auto& held = m_held[i];
+		if(held.m_nextHop != ip)
+		{
+			i++;
+			continue;
+		}
+
+		//Headers were already swapped when the frame was parked, so send as-is
+		auto frame = held.m_frame;
+		auto markFree = held.m_markFree;
+		RemoveHeldFrame(i);
+		frame->DstMAC() = mac;
+		m_eth.ResendTxFrame(frame, markFree);
+	}
+}
+
+/**
+	@brief Removes an entry from the hold queue, preserving the order of the remaining ones
+ */
+void ARPProtocol::RemoveHeldFrame(uint32_t i)
+{
+	for(uint32_t j=i+1; j<m_heldCount; j++)
+		m_held[j-1] = m_held[j];
+	m_heldCount --;
+}
+
+/**
+	@brief Gives up on a held frame, freeing it if we own it
+ */
+void ARPProtocol::DropHeldFrame(uint32_t i)
+{
+	auto frame = m_held[i].m_frame;
+	auto markFree = m_held[i].m_markFree;
+	RemoveHeldFrame(i);
+	if(markFree)
+		m_eth.CancelTxFrame(frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Aging
+
+/**
+	@brief Timer handler for aging out stale cache entries and held frames, and retrying queries
+
+	Call this function at approximately 1 Hz.
+ */
+void ARPProtocol::OnAgingTick()
+{
+	if(m_cacheOwner)
+		m_cache.OnAgingTick();
+
+	//Retry unanswered queries, and forget old failures
+	auto now = m_eth.GetTimeMs();
+	for(uint32_t i=0; i<m_queryCount; )
+	{
+		auto& query = m_queries[i];
+		if(query.m_failed)
+		{
+			if(MonotonicClock::IsExpired(now, query.m_timestamp + ARP_NEGATIVE_CACHE_MS))
+			{
+				RemoveQuery(i);
+				continue;
+			}
+		}
+		else if(MonotonicClock::IsExpired(now, query.m_timestamp + ARP_QUERY_INTERVAL_MS))
+			OnQueryTimeout(query);
+		i++;
+	}
+
+	//Refresh pinned entries before they go stale
+	if(m_cacheOwner)
+	{
+		for(uint32_t i=0; i<m_cache.GetPinnedCount(); i++)
+		{
+			auto ip = m_cache.GetPinned(i);
+			if(m_cache.GetExpiry(ip) < ARP_REFRESH_THRESHOLD)
+				Resolve(ip);
+		}
+	}
+
+	//Give up on frames which have been waiting too long
+	for(uint32_t i=0; i<m_heldCount; )
+	{
+		if(MonotonicClock::IsExpired(now, m_held[i].m_timestamp + ARP_HOLD_TIMEOUT_MS))
+			DropHeldFrame(i);
+		else
+			i++;
+	}
+}
+
+/**
+	@brief Discards all held frames and query state when the link goes down, since nobody will be answering
+ */
+void ARPProtocol::OnLinkDown()
+{
+	m_queryCount = 0;
+	while(m_heldCount)
+		DropHeldFrame(0);
+}
+
@@ -39,6 +39,86 @@
 #include "ARPPacket.h"
 #include "ARPCache.h"
 
+//Maximum number of outbound frames held while waiting for ARP resolution, across all destinations
+#ifndef ARP_HOLD_QUEUE_SIZE
+#define ARP_HOLD_QUEUE_SIZE 4
+#endif
+
+//Maximum number of held frames for any single next-hop address
+#ifndef ARP_HOLD_PER_DEST
+#define ARP_HOLD_PER_DEST 2
+#endif
+
+//Time, in milliseconds, after which a held frame is discarded if its destination still hasn't answered
+#ifndef ARP_HOLD_TIMEOUT_MS
+#define ARP_HOLD_TIMEOUT_MS 3000
+#endif
+
+//Maximum number of addresses we can be resolving (or remember as not answering) at once
+#ifndef ARP_MAX_PENDING_QUERIES
+#define ARP_MAX_PENDING_QUERIES 4
+#endif
+
+//Minimum time, in milliseconds, between queries for the same address
+#ifndef ARP_QUERY_INTERVAL_MS
+#define ARP_QUERY_INTERVAL_MS 1000
+#endif
+
+//Number of times an unanswered query is repeated before giving up
+#ifndef ARP_QUERY_RETRIES
+#define ARP_QUERY_RETRIES 2
+#endif
+
+//Time, in milliseconds, for which we stop querying an address (and fail sends to it) after it didn't answer
+#ifndef ARP_NEGATIVE_CACHE_MS
+#define ARP_NEGATIVE_CACHE_MS 20000
+#endif
+
+//Remaining lifetime, in seconds, below which cache entries in use are refreshed
+#ifndef ARP_REFRESH_THRESHOLD
+#define ARP_REFRESH_THRESHOLD 15
+#endif
+
+/**
+	@brief An address we're trying to resolve, or which recently failed to answer
+ */
+class ARPQuery
+{
+public:
+
+	///@brief The address being resolved
+	IPv4Address m_ip;
+
+	///@brief Time the last query was sent, or the time we gave up
+	uint32_t m_timestamp;
+
+	///@brief Number of queries sent so far
+	uint8_t m_attempts;
+
+	///@brief True if the address didn't answer any of our queries
+	bool m_failed;
+};
+
+/**
+	@brief An outbound frame waiting for its next hop to be resolved
+ */
+class ARPHeldFrame
+{
+public:
+
+	///@brief The frame, with all headers except the destination MAC ready to go
+	EthernetFrame* m_frame;
+
+	///@brief Address we're waiting to resolve
+	IPv4Address m_nextHop;
+
+	///@brief Time at which the frame was parked
+	uint32_t m_timestamp;
+
+	///@brief True if the frame should be returned to the driver once sent (false if the sender still owns it)
+	bool m_markFree;
+};
+
 /**
 	@brief ARP protocol logic for a single physical interface
  */
@@ -48,6 +128,7 @@ public:
 	ARPProtocol(EthernetProtocol& eth, IPv4Address& ip, ARPCache& cache);
 
 	void SendQuery(IPv4Address& ip);
+	bool Resolve(IPv4Address ip);
 
 	void OnRxPacket(ARPPacket* packet);
 
@@ -57,16 +138,54 @@ public:
 		ARP_REPLY = 2
 	};
 
+	/**
+		@brief Adds a mapping to the cache, then sends anything which was waiting on it
+	 */
 	void Insert(MACAddress& mac, IPv4Address ip)
-	{ m_cache.Insert(mac, ip); }
+	{
+		m_cache.Insert(mac, ip);
+		if(m_queryCount)
+			OnResolved(ip);
+		if(m_heldCount)
+			FlushHeldFrames(mac, ip);
+	}
 
 	/**
-		@brief Timer handler for aging out stale cache entries
+		@brief Updates the cache after receiving an IPv4 frame from a host on the local subnet
 
-		Call this function at approximately 1 Hz.
+		Cheaper than Insert(), since the cache is only written to if something changed.
 	 */
-	void OnAgingTick()
-	{ m_cache.OnAgingTick(); }
+	void Learn(MACAddress& mac, IPv4Address ip)
+	{
+		m_cache.Refresh(mac, ip);
+		if(m_queryCount)
+			OnResolved(ip);
+		if(m_heldCount)
+			FlushHeldFrames(mac, ip);
+	}
+
+	void OnAgingTick();
+	void OnLinkDown();
+
+	void CheckPendingQueries();
+
+	/**
+		@brief Sets whether this instance is responsible for aging the cache and refreshing pinned entries
+
+		When several ARPProtocol instances share one ARPCache, exactly one of them should own it. Otherwise the cache
+		would age once per instance per second, and every instance would send its own refresh queries.
+	 */
+	void SetCacheOwner(bool owner)
+	{ m_cacheOwner = owner; }
+
+	bool CanHold(IPv4Address nextHop);
+	void Hold(EthernetFrame* frame, IPv4Address nextHop, bool markFree);
+	bool IsHeld(EthernetFrame* frame);
+	void Unhold(EthernetFrame* frame);
+
+	///@brief Returns the number of frames currently waiting for resolution
+	uint32_t GetHeldFrameCount()
+	{ return m_heldCount; }
 
 	ARPCache* GetCache()
 	{ return &m_cache; }
@@ -76,6 +195,14 @@ protected:
 	void OnRequestPacket(ARPPacket* packet);
 	void OnReplyPacket(ARPPacket* packet);
 
+	void OnResolved(IPv4Address ip);
+	void OnQueryTimeout(ARPQuery& query);
+	void RemoveQuery(uint32_t i);
+
+	void FlushHeldFrames(const MACAddress& mac, IPv4Address ip);
+	void RemoveHeldFrame(uint32_t i);
+	void DropHeldFrame(uint32_t i);
+
 	///@brief The Ethernet protocol stack
 	EthernetProtocol& m_eth;
 
@@ -84,6 +211,21 @@ protected:
 
 	///@brief Cache for storing IP -> MAC associations
 	ARPCache& m_cache;
+
+	///@brief Addresses currently being resolved, or recently failed
+	ARPQuery m_queries[ARP_MAX_PENDING_QUERIES];
+
+	///@brief Number of valid entries in m_queries
+	uint32_t m_queryCount;
+
+	///@brief Frames waiting for resolution, oldest first
+	ARPHeldFrame m_held[ARP_HOLD_QUEUE_SIZE];
+
+	///@brief Number of valid entries in m_held
+	uint32_t m_heldCount;
+
+	///@brief True if we age the cache (see SetCacheOwner())
+	bool m_cacheOwner;
 };
 
 #endif
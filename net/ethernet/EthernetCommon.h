@@ -65,4 +65,16 @@ enum ethertype_t
 	ETHERTYPE_IPV6	= 0x86dd
 };
 
+/**
+	@brief Priority classes for outbound traffic
+
+	Higher priority classes may use TX buffers held in reserve for them, so they can't be starved by lower ones.
+ */
+enum txclass_t
+{
+	TX_CLASS_CONTROL,	//ARP, ICMP, pure ACKs, etc: may use any free TX buffer
+	TX_CLASS_NORMAL,	//Default for application traffic
+	TX_CLASS_BULK		//Large transfers: only uses what's left after the reserves for other classes
+};
+
 #endif
@@ -41,9 +41,18 @@ EthernetProtocol::EthernetProtocol(EthernetInterface& iface, MACAddress our_mac)
 	, m_arp(nullptr)
 	, m_ipv4(nullptr)
 	, m_ipv6(nullptr)
+	, m_ingressFilter(nullptr)
 	, m_linkUp(false)
+	, m_txSpaceAvailable(false)
+	, m_currentRxFrame(nullptr)
+	, m_currentRxFrameRetained(false)
+	, m_heldRxFrames(0)
+	, m_clock(nullptr)
+	, m_coarseTime(0)
+	, m_nextAgingTick(0)
+	, m_nextFastTick(0)
 {
-
+	m_iface.UseProtocol(this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -63,6 +72,8 @@ void EthernetProtocol::OnLinkDown()
 {
 	m_linkUp = false;
 
+	if(m_arp)
+		m_arp->OnLinkDown();
 	if(m_ipv6)
 		m_ipv6->OnLinkDown();
 }
@@ -84,12 +95,23 @@ void EthernetProtocol::OnRxFrame(EthernetFrame* frame)
 		return;
 	}
 
+	//Drop floods before spending any more time on them
+	if(m_ingressFilter && !m_ingressFilter->Accept(frame, GetTimeMs()))
+	{
+		m_iface.ReleaseRxFrame(frame);
+		return;
+	}
+
 	//Byte swap header fields
 	frame->ByteSwap();
 
 	//TODO: VLAN processing
 	//For now, ignore VLAN tags
 
+	//Upper layers may take ownership of the frame while we're processing it
+	m_currentRxFrame = frame;
+	m_currentRxFrameRetained = false;
+
 	//Send to appropriate upper layer stack
 	auto& ethertype = frame->InnerEthertype();
 	if(ethertype <= 1500)
@@ -116,7 +138,7 @@ void EthernetProtocol::OnRxFrame(EthernetFrame* frame)
 				if(m_arp)
 				{
 					if(m_ipv4->IsLocalSubnet(packet->m_sourceAddress))
-						m_arp->Insert(frame->SrcMAC(), packet->m_sourceAddress);
+						m_arp->Learn(frame->SrcMAC(), packet->m_sourceAddress);
 				}
 
 				//then process it
@@ -128,7 +150,7 @@ void EthernetProtocol::OnRxFrame(EthernetFrame* frame)
 		//Don't bother checking length, upper layer can do that
 		case ETHERTYPE_IPV6:
 			if(m_ipv6)
-				m_ipv6->OnRxPacket(reinterpret_cast<IPv6Packet*>(frame->Payload()), plen);
+				m_ipv6->OnRxPacket(reinterpret_cast<IPv6Packet*>(frame->Payload()), plen, frame->SrcMAC());
 			break;
 
 		//unrecognized ethertype, ignore
@@ -136,20 +158,110 @@ void EthernetProtocol::OnRxFrame(EthernetFrame* frame)
 			break;
 	}
 
+	//Return the frame to the driver, unless someone upstream is still using it
+	if(!m_currentRxFrameRetained)
+		m_iface.ReleaseRxFrame(frame);
+	m_currentRxFrame = nullptr;
+
+	//If processing this frame freed up TX buffers (most likely due to an ACK), let anyone waiting know right away
+	DeliverTxSpaceNotification();
+}
+
+/**
+	@brief Takes ownership of the frame currently being received, so it is not returned to the driver when processing
+	completes.
+
+	This may only be called from an upper layer's receive handler. Pointers into the frame (e.g. a TCP segment payload)
+	then remain valid until the frame is passed to ReleaseRxFrame(). Note that Ethernet and IP header fields have been
+	byte swapped to host order by the time the upper layer sees them.
+
+	Returns nullptr if the frame cannot be retained, because too many frames are held already or the driver is running
+	low on receive buffers. The caller must then copy whatever it needs before returning.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+EthernetFrame* EthernetProtocol::RetainRxFrame()
+{
+	if(!m_currentRxFrame || m_currentRxFrameRetained)
+		return nullptr;
+
+	//Don't starve the receive path
+	if(m_heldRxFrames >= ETHERNET_MAX_HELD_RX_FRAMES)
+		return nullptr;
+	if(m_iface.GetRxBufferFreeCount() < ETHERNET_RX_RESERVE)
+		return nullptr;
+
+	m_currentRxFrameRetained = true;
+	m_heldRxFrames ++;
+	return m_currentRxFrame;
+}
+
+/**
+	@brief Returns a frame previously taken by RetainRxFrame() to the driver
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void EthernetProtocol::ReleaseRxFrame(EthernetFrame* frame)
+{
+	//Don't let a stray release wrap the count, or RetainRxFrame() would never succeed again
+	if(m_heldRxFrames)
+		m_heldRxFrames --;
 	m_iface.ReleaseRxFrame(frame);
 }
 
+/**
+	@brief Converts the frame currently being received into a reply to its sender, without allocating or copying
+
+	This may only be called from an upper layer's receive handler. On success, the source and destination MAC addresses
+	have been swapped and the frame is owned by the caller exactly as if it had come from GetTxFrame() (header fields
+	are still in host order, and it must be sent with SendTxFrame() or freed with CancelTxFrame()). The caller may
+	reuse whatever parts of the request it needs in the reply, but must not touch the frame after sending it.
+
+	Returns nullptr if the driver doesn't support turnaround, the frame was already retained, or there is no TX
+	buffer available for the given class. The caller should then fall back to GetTxFrame().
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+EthernetFrame* EthernetProtocol::TurnaroundRxFrame(txclass_t txclass)
+{
+	if(!m_currentRxFrame || m_currentRxFrameRetained)
+		return nullptr;
+
+	//Some drivers trade a TX buffer for the frame, so respect the reserves for higher priority traffic
+	if(!IsTxBufferAvailable(txclass))
+		return nullptr;
+	if(!m_iface.TurnaroundRxFrame(m_currentRxFrame))
+		return nullptr;
+
+	//It's not ours to release any more
+	m_currentRxFrameRetained = true;
+
+	auto frame = m_currentRxFrame;
+	frame->DstMAC() = frame->SrcMAC();
+	frame->SrcMAC() = m_mac;
+	return frame;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Outbound frame path
 
 /**
 	@brief Sets up a new frame
+
+	Fails if allocating the frame would dip into the buffers held in reserve for higher priority traffic classes.
  */
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-EthernetFrame* EthernetProtocol::GetTxFrame(ethertype_t type, const MACAddress& dest)
+EthernetFrame* EthernetProtocol::GetTxFrame(ethertype_t type, const MACAddress& dest, txclass_t txclass)
 {
+	//Leave the reserved buffers for higher priority traffic
+	if( (txclass != TX_CLASS_CONTROL) && (m_iface.GetTxBufferFreeCount() <= GetTxReserve(txclass)) )
+		return nullptr;
+
 	//Allocate a new frame from the transmit driver
 	auto frame = m_iface.GetTxFrame();
 	if(!frame)
@@ -164,6 +276,25 @@ EthernetFrame* EthernetProtocol::GetTxFrame(ethertype_t type, const MACAddress&
 	return frame;
 }
 
+/**
+	@brief Notifies upper layers if any TX frames have been freed since the last call
+
+	Called automatically after each received frame and from the timer handlers. Applications may also call this from
+	their main loop if the driver reports completions from an interrupt handler.
+ */
+void EthernetProtocol::DeliverTxSpaceNotification()
+{
+	if(!m_txSpaceAvailable)
+		return;
+
+	//Clear the flag first, so anything freed during delivery is picked up next time
+	m_txSpaceAvailable = false;
+	if(m_ipv4)
+		m_ipv4->OnTxSpaceAvailable();
+	if(m_ipv6)
+		m_ipv6->OnTxSpaceAvailable();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Aging
 
@@ -180,6 +311,9 @@ void EthernetProtocol::OnAgingTick()
 		if(m_ipv4)
 			m_ipv4->OnAgingTick();
 	}
+
+	if(m_ipv6)
+		m_ipv6->OnAgingTick();
 }
 
 /**
@@ -189,6 +323,86 @@ void EthernetProtocol::OnAgingTick()
  */
 void EthernetProtocol::OnAgingTick10x()
 {
+	if(!m_clock)
+		m_coarseTime += 100;
+
+	DeliverTxSpaceNotification();
+
 	if(m_ipv4)
 		m_ipv4->OnAgingTick10x();
+	if(m_ipv6)
+		m_ipv6->OnAgingTick10x();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tickless timer support
+
+/**
+	@brief Timer handler for use with an attached MonotonicClock, replacing OnAgingTick() and OnAgingTick10x()
+
+	Call this function whenever the deadline returned by GetNextDeadline() has passed. Calling it early is harmless.
+ */
+void EthernetProtocol::OnTimer()
+{
+	auto now = GetTimeMs();
+
+	//Run the 1 Hz aging logic if it's due.
+	//If we slept through several ticks, only run it once and resynchronize rather than running a burst of ticks
+	if(MonotonicClock::IsExpired(now, m_nextAgingTick))
+	{
+		OnAgingTick();
+
+		m_nextAgingTick += 1000;
+		if(MonotonicClock::IsExpired(now, m_nextAgingTick))
+			m_nextAgingTick = now + 1000;
+	}
+
+	//Keep calling the 10 Hz hooks so application code overriding TCPProtocol::OnAgingTick10x() still gets polled.
+	//The default TCPProtocol::OnAgingTick10x() runs OnTimer(), so don't run the TCP timers a second time
+	if(MonotonicClock::IsExpired(now, m_nextFastTick))
+	{
+		m_nextFastTick += 100;
+		if(MonotonicClock::IsExpired(now, m_nextFastTick))
+			m_nextFastTick = now + 100;
+
+		OnAgingTick10x();
+		return;
+	}
+
+	DeliverTxSpaceNotification();
+
+	if(m_ipv4)
+		m_ipv4->OnTimer();
+	if(m_ipv6)
+		m_ipv6->OnTimer();
+}
+
+/**
+	@brief Returns the number of milliseconds until OnTimer() next needs to be called
+
+	The main loop can sleep until this deadline passes or a frame is received, whichever comes first.
+ */
+uint32_t EthernetProtocol::GetNextDeadline()
+{
+	auto now = GetTimeMs();
+	uint32_t next = MonotonicClock::TimeUntil(now, m_nextAgingTick);
+
+	auto fast = MonotonicClock::TimeUntil(now, m_nextFastTick);
+	if(fast < next)
+		next = fast;
+
+	if(m_ipv4)
+	{
+		auto ipdeadline = m_ipv4->GetNextDeadline();
+		if(ipdeadline < next)
+			next = ipdeadline;
+	}
+	if(m_ipv6)
+	{
+		auto ipdeadline = m_ipv6->GetNextDeadline();
+		if(ipdeadline < next)
+			next = ipdeadline;
+	}
+
+	return next;
 }
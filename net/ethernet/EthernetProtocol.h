@@ -37,10 +37,32 @@
 
 #include "EthernetCommon.h"
 #include "../../drivers/base/EthernetInterface.h"
+#include "../../drivers/base/MonotonicClock.h"
 
 class ARPProtocol;
 class IPv4Protocol;
 class IPv6Protocol;
+class IngressFilter;
+
+//Number of TX frames that only TX_CLASS_CONTROL traffic may use
+#ifndef ETHERNET_TX_RESERVE_CONTROL
+#define ETHERNET_TX_RESERVE_CONTROL 1
+#endif
+
+//Number of TX frames, on top of the control reserve, that TX_CLASS_BULK traffic may not use
+#ifndef ETHERNET_TX_RESERVE_NORMAL
+#define ETHERNET_TX_RESERVE_NORMAL 1
+#endif
+
+//Maximum number of RX frames upper layers may hold on to at once (see RetainRxFrame())
+#ifndef ETHERNET_MAX_HELD_RX_FRAMES
+#define ETHERNET_MAX_HELD_RX_FRAMES 2
+#endif
+
+//Number of RX frames which must remain free in the driver for RetainRxFrame() to succeed
+#ifndef ETHERNET_RX_RESERVE
+#define ETHERNET_RX_RESERVE 2
+#endif
 
 /**
 	@brief Ethernet protocol handling
@@ -53,10 +75,34 @@ public:
 
 	EthernetProtocol(EthernetInterface& iface, MACAddress our_mac);
 
-	bool IsTxBufferAvailable()
-	{ return m_iface.IsTxBufferAvailable(); }
+	///@brief Checks if a frame of the given priority class can be allocated
+	bool IsTxBufferAvailable(txclass_t txclass = TX_CLASS_NORMAL)
+	{
+		if(txclass == TX_CLASS_CONTROL)
+			return m_iface.IsTxBufferAvailable();
+		return m_iface.GetTxBufferFreeCount() > GetTxReserve(txclass);
+	}
+
+	/**
+		@brief Gets the number of TX frames which traffic of a given priority class must leave free
+	 */
+	static size_t GetTxReserve(txclass_t txclass)
+	{
+		switch(txclass)
+		{
+			case TX_CLASS_CONTROL:
+				return 0;
+
+			case TX_CLASS_NORMAL:
+				return ETHERNET_TX_RESERVE_CONTROL;
+
+			case TX_CLASS_BULK:
+			default:
+				return ETHERNET_TX_RESERVE_CONTROL + ETHERNET_TX_RESERVE_NORMAL;
+		}
+	}
 
-	EthernetFrame* GetTxFrame(ethertype_t type, const MACAddress& dest);
+	EthernetFrame* GetTxFrame(ethertype_t type, const MACAddress& dest, txclass_t txclass = TX_CLASS_NORMAL);
 
 	///@brief Sends a frame to the driver
 	void SendTxFrame(EthernetFrame* frame, bool markFree = true)
@@ -71,10 +117,32 @@ public:
 
 	///@brief Cancels sending of a frame
 	void CancelTxFrame(EthernetFrame* frame)
-	{ m_iface.CancelTxFrame(frame); }
+	{
+		m_iface.CancelTxFrame(frame);
+		m_txSpaceAvailable = true;
+	}
+
+	/**
+		@brief Called by the driver when TX frames are returned to the pool
+
+		Notifications are delivered to upper layers later on by DeliverTxSpaceNotification(), so this is safe to call
+		from an interrupt handler or in the middle of sending.
+	 */
+	void OnTxSpaceAvailable()
+	{ m_txSpaceAvailable = true; }
+
+	void DeliverTxSpaceNotification();
 
 	void OnRxFrame(EthernetFrame* frame);
 
+	EthernetFrame* RetainRxFrame();
+	void ReleaseRxFrame(EthernetFrame* frame);
+	EthernetFrame* TurnaroundRxFrame(txclass_t txclass = TX_CLASS_CONTROL);
+
+	///@brief Returns the number of received frames currently held by upper layers
+	uint32_t GetHeldRxFrameCount()
+	{ return m_heldRxFrames; }
+
 	void UseARP(ARPProtocol* arp)
 	{ m_arp = arp; }
 
@@ -84,12 +152,39 @@ public:
 	void UseIPv6(IPv6Protocol* ipv6)
 	{ m_ipv6 = ipv6; }
 
+	///@brief Attaches a filter to drop floods of incoming traffic as early as possible
+	void UseIngressFilter(IngressFilter* filter)
+	{ m_ingressFilter = filter; }
+
 	const MACAddress& GetMACAddress()
 	{ return m_mac; }
 
 	void OnAgingTick();
 	void OnAgingTick10x();
 
+	/**
+		@brief Attaches a monotonic clock to the stack
+
+		If no clock is attached, time is derived from calls to OnAgingTick10x() with 100ms resolution.
+	 */
+	void UseClock(MonotonicClock* clock)
+	{
+		m_clock = clock;
+		if(clock)
+		{
+			auto now = clock->GetTimeMs();
+			m_nextAgingTick = now + 1000;
+			m_nextFastTick = now + 100;
+		}
+	}
+
+	///@brief Returns the current time, in milliseconds
+	uint32_t GetTimeMs()
+	{ return m_clock ? m_clock->GetTimeMs() : m_coarseTime; }
+
+	void OnTimer();
+	uint32_t GetNextDeadline();
+
 	void OnLinkUp();
 	void OnLinkDown();
 
@@ -116,8 +211,35 @@ protected:
 	///@brief The IPv6 protocol stack for this port (if present)
 	IPv6Protocol* m_ipv6;
 
+	///@brief Early classifier / rate limiter for incoming frames (if present)
+	IngressFilter* m_ingressFilter;
+
 	///@brief Link state
 	bool m_linkUp;
+
+	///@brief Set when TX frames are freed, cleared when upper layers are notified
+	volatile bool m_txSpaceAvailable;
+
+	///@brief The received frame currently being processed (if any)
+	EthernetFrame* m_currentRxFrame;
+
+	///@brief True if an upper layer has taken ownership of m_currentRxFrame
+	bool m_currentRxFrameRetained;
+
+	///@brief Number of received frames retained by upper layers and not yet released
+	uint32_t m_heldRxFrames;
+
+	///@brief Time source (if present)
+	MonotonicClock* m_clock;
+
+	///@brief Coarse time derived from OnAgingTick10x() calls, used if we have no clock
+	uint32_t m_coarseTime;
+
+	///@brief Timestamp at which the next 1 Hz aging tick is due (only used if we have a clock)
+	uint32_t m_nextAgingTick;
+
+	///@brief Timestamp at which the next 10 Hz tick is due (only used if we have a clock)
+	uint32_t m_nextFastTick;
 };
 
 #endif
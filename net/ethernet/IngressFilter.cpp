@@ -0,0 +1,251 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Implementation of IngressFilter
+ */
+
+#include <staticnet-config.h>
+#include <staticnet/stack/staticnet.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TokenBucket
+
+/**
+	@brief Refills the bucket based on time elapsed since the last call, then takes one packet's worth of tokens
+
+	Returns false if the bucket was empty and the packet should be dropped.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool TokenBucket::Consume(uint32_t now)
+{
+	if(m_rate == 0)
+		return true;
+
+	//Refill. Anything long enough to fill the bucket from empty just fills it (which also avoids overflow)
+	uint32_t full = m_burst * 1000;
+	uint32_t elapsed = now - m_lastRefill;
+	m_lastRefill = now;
+	if(elapsed >= full / m_rate)
+		m_tokens = full;
+	else
+	{
+		m_tokens += elapsed * m_rate;
+		if(m_tokens > full)
+			m_tokens = full;
+	}
+
+	if(m_tokens < 1000)
+		return false;
+	m_tokens -= 1000;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+IngressFilter::IngressFilter()
+	: m_udpPortCount(0)
+{
+	m_buckets[INGRESS_CLASS_ARP].Configure(INGRESS_RATE_ARP, INGRESS_BURST_ARP);
+	m_buckets[INGRESS_CLASS_ICMP].Configure(INGRESS_RATE_ICMP, INGRESS_BURST_ICMP);
+	m_buckets[INGRESS_CLASS_TCP_SYN].Configure(INGRESS_RATE_TCP_SYN, INGRESS_BURST_TCP_SYN);
+	m_buckets[INGRESS_CLASS_UDP_UNKNOWN].Configure(INGRESS_RATE_UDP_UNKNOWN, INGRESS_BURST_UDP_UNKNOWN);
+
+	ResetCounters();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+/**
+	@brief Registers a local UDP port we expect traffic on, so it is not limited as INGRESS_CLASS_UDP_UNKNOWN
+
+	Returns false if the table is full.
+ */
+bool IngressFilter::AddUDPPort(uint16_t port)
+{
+	if(IsKnownUDPPort(port))
+		return true;
+	if(m_udpPortCount >= INGRESS_MAX_UDP_PORTS)
+		return false;
+
+	m_udpPorts[m_udpPortCount] = port;
+	m_udpPortCount ++;
+	return true;
+}
+
+/**
+	@brief Checks if a UDP destination port is one we expect traffic on
+
+	Derived classes may override this to open ports dynamically.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool IngressFilter::IsKnownUDPPort(uint16_t port)
+{
+	for(uint32_t i=0; i<m_udpPortCount; i++)
+	{
+		if(m_udpPorts[i] == port)
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Clears all of the drop counters
+ */
+void IngressFilter::ResetCounters()
+{
+	for(int i=0; i<INGRESS_CLASS_COUNT; i++)
+		m_drops[i] = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Filtering
+
+/**
+	@brief Decides whether an incoming frame should be processed
+
+	The frame must still be in network byte order. Returns false if it should be dropped.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool IngressFilter::Accept(const EthernetFrame* frame, uint32_t now)
+{
+	auto cls = Classify(frame);
+	if(cls == INGRESS_CLASS_UNLIMITED)
+		return true;
+
+	if(m_buckets[cls].Consume(now))
+		return true;
+
+	m_drops[cls] ++;
+	return false;
+}
+
+/**
+	@brief Figures out which class a frame belongs to, looking only at raw network-order bytes
+
+	Nothing is validated beyond making sure the fields we look at are within the frame. Malformed frames which can't
+	be classified are passed through as INGRESS_CLASS_UNLIMITED for the protocol stack to reject in the usual way.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+ingressclass_t IngressFilter::Classify(const EthernetFrame* frame)
+{
+	auto data = frame->RawData();
+	uint32_t len = frame->Length();
+
+	//Skip over the VLAN tag, if any
+	uint32_t off = ETHERNET_MAC_SIZE*2;
+	if(len < off + ETHERNET_ETHERTYPE_SIZE)
+		return INGRESS_CLASS_UNLIMITED;
+	uint16_t ethertype = (data[off] << 8) | data[off+1];
+	if(ethertype == ETHERTYPE_DOT1Q)
+	{
+		off += ETHERNET_DOT1Q_SIZE;
+		if(len < off + ETHERNET_ETHERTYPE_SIZE)
+			return INGRESS_CLASS_UNLIMITED;
+		ethertype = (data[off] << 8) | data[off+1];
+	}
+	off += ETHERNET_ETHERTYPE_SIZE;
+
+	auto payload = data + off;
+	uint32_t plen = len - off;
+	switch(ethertype)
+	{
+		case ETHERTYPE_ARP:
+			return INGRESS_CLASS_ARP;
+
+		case ETHERTYPE_IPV4:
+			{
+				if(plen < 20)
+					return INGRESS_CLASS_UNLIMITED;
+
+				//Only the first fragment has a transport header (and the stack drops fragments anyway)
+				if( ( (payload[6] & 0x1f) != 0) || (payload[7] != 0) )
+					return INGRESS_CLASS_UNLIMITED;
+
+				uint32_t hlen = (payload[0] & 0xf) * 4;
+				if(hlen > plen)
+					return INGRESS_CLASS_UNLIMITED;
+				return ClassifyTransport(payload[9], payload + hlen, plen - hlen);
+			}
+
+		//No extension header support, same as IPv6Protocol
+		case ETHERTYPE_IPV6:
+			if(plen < 40)
+				return INGRESS_CLASS_UNLIMITED;
+			return ClassifyTransport(payload[6], payload + 40, plen - 40);
+
+		default:
+			return INGRESS_CLASS_UNLIMITED;
+	}
+}
+
+/**
+	@brief Classifies an IPv4 or IPv6 packet by its upper layer protocol header
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+ingressclass_t IngressFilter::ClassifyTransport(uint8_t proto, const uint8_t* l4, uint32_t len)
+{
+	switch(proto)
+	{
+		case IP_PROTO_ICMP:
+		case IP_PROTO_ICMPV6:
+			return INGRESS_CLASS_ICMP;
+
+		//SYN without ACK is a new connection attempt, anything else belongs to an existing (or outbound) connection
+		case IP_PROTO_TCP:
+			if(len < 14)
+				return INGRESS_CLASS_UNLIMITED;
+			if( (l4[13] & (TCPSegment::FLAG_SYN | TCPSegment::FLAG_ACK)) == TCPSegment::FLAG_SYN)
+				return INGRESS_CLASS_TCP_SYN;
+			return INGRESS_CLASS_UNLIMITED;
+
+		case IP_PROTO_UDP:
+			if(len < 4)
+				return INGRESS_CLASS_UNLIMITED;
+			if(IsKnownUDPPort( (l4[2] << 8) | l4[3]))
+				return INGRESS_CLASS_UNLIMITED;
+			return INGRESS_CLASS_UDP_UNKNOWN;
+
+		default:
+			return INGRESS_CLASS_UNLIMITED;
+	}
+}
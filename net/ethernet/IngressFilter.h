@@ -0,0 +1,182 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of IngressFilter
+ */
+
+#ifndef IngressFilter_h
+#define IngressFilter_h
+
+#include "EthernetFrame.h"
+
+//Default rate limits (packets per second) and burst sizes (packets) for each class of flood-prone traffic.
+//A rate of zero disables limiting for that class.
+#ifndef INGRESS_RATE_ARP
+#define INGRESS_RATE_ARP 50
+#endif
+#ifndef INGRESS_BURST_ARP
+#define INGRESS_BURST_ARP 20
+#endif
+
+#ifndef INGRESS_RATE_ICMP
+#define INGRESS_RATE_ICMP 20
+#endif
+#ifndef INGRESS_BURST_ICMP
+#define INGRESS_BURST_ICMP 10
+#endif
+
+#ifndef INGRESS_RATE_TCP_SYN
+#define INGRESS_RATE_TCP_SYN 20
+#endif
+#ifndef INGRESS_BURST_TCP_SYN
+#define INGRESS_BURST_TCP_SYN 10
+#endif
+
+#ifndef INGRESS_RATE_UDP_UNKNOWN
+#define INGRESS_RATE_UDP_UNKNOWN 10
+#endif
+#ifndef INGRESS_BURST_UDP_UNKNOWN
+#define INGRESS_BURST_UDP_UNKNOWN 5
+#endif
+
+//Maximum number of UDP ports which can be registered as known (and thus not rate limited)
+#ifndef INGRESS_MAX_UDP_PORTS
+#define INGRESS_MAX_UDP_PORTS 4
+#endif
+
+/**
+	@brief Classes of incoming traffic which are subject to rate limiting
+ */
+enum ingressclass_t
+{
+	INGRESS_CLASS_ARP,			//All ARP traffic
+	INGRESS_CLASS_ICMP,			//ICMPv4 and ICMPv6 (including neighbor discovery)
+	INGRESS_CLASS_TCP_SYN,		//New inbound TCP connection attempts (SYN without ACK)
+	INGRESS_CLASS_UDP_UNKNOWN,	//UDP to a port not registered with AddUDPPort()
+
+	INGRESS_CLASS_COUNT,
+
+	//Everything else (established TCP, known UDP, unknown ethertypes, anything too short to classify)
+	INGRESS_CLASS_UNLIMITED = INGRESS_CLASS_COUNT
+};
+
+/**
+	@brief A token bucket rate limiter
+
+	Tokens are stored in thousandths of a packet so the bucket can be refilled with millisecond resolution.
+ */
+class TokenBucket
+{
+public:
+	TokenBucket()
+	: m_rate(0)
+	, m_burst(0)
+	, m_tokens(0)
+	, m_lastRefill(0)
+	{}
+
+	///@brief Sets the sustained rate (packets per second, zero for unlimited) and burst size, and fills the bucket
+	void Configure(uint16_t rate, uint16_t burst)
+	{
+		m_rate = rate;
+		m_burst = burst;
+		m_tokens = burst * 1000;
+	}
+
+	bool Consume(uint32_t now);
+
+protected:
+
+	///@brief Sustained rate, in packets per second (zero for unlimited)
+	uint16_t m_rate;
+
+	///@brief Maximum number of packets which can be accepted back to back
+	uint16_t m_burst;
+
+	///@brief Current fill level, in thousandths of a packet
+	uint32_t m_tokens;
+
+	///@brief Time (in milliseconds) at which the bucket was last refilled
+	uint32_t m_lastRefill;
+};
+
+/**
+	@brief Early classifier and rate limiter for incoming frames
+
+	Runs at the very start of EthernetProtocol::OnRxFrame(), on raw network-order bytes before any byte swapping,
+	cache updates, or checksum verification. Flood-prone classes of traffic (see ingressclass_t) are each limited by a
+	token bucket, so a broadcast storm, ping flood, or SYN flood can't consume all of the CPU time and starve
+	established connections (e.g. the management session being used to deal with it).
+
+	Established TCP traffic is never limited. Applications which expect UDP traffic (DHCP, NTP, etc.) should register
+	their local ports with AddUDPPort(), or override IsKnownUDPPort().
+ */
+class IngressFilter
+{
+public:
+	IngressFilter();
+	virtual ~IngressFilter()
+	{}
+
+	bool Accept(const EthernetFrame* frame, uint32_t now);
+	ingressclass_t Classify(const EthernetFrame* frame);
+
+	///@brief Changes the rate limit (packets per second, zero for unlimited) and burst size for a class
+	void SetRateLimit(ingressclass_t cls, uint16_t rate, uint16_t burst)
+	{ m_buckets[cls].Configure(rate, burst); }
+
+	bool AddUDPPort(uint16_t port);
+
+	///@brief Gets the number of frames of a given class dropped since the last ResetCounters() call
+	uint32_t GetDropCount(ingressclass_t cls)
+	{ return m_drops[cls]; }
+
+	void ResetCounters();
+
+protected:
+	virtual bool IsKnownUDPPort(uint16_t port);
+
+	ingressclass_t ClassifyTransport(uint8_t proto, const uint8_t* l4, uint32_t len);
+
+	///@brief Rate limiter for each class
+	TokenBucket m_buckets[INGRESS_CLASS_COUNT];
+
+	///@brief Number of frames dropped in each class
+	uint32_t m_drops[INGRESS_CLASS_COUNT];
+
+	///@brief UDP ports we expect traffic on
+	uint16_t m_udpPorts[INGRESS_MAX_UDP_PORTS];
+
+	///@brief Number of valid entries in m_udpPorts
+	uint32_t m_udpPortCount;
+};
+
+#endif
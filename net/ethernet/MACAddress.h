@@ -93,6 +93,17 @@ public:
 	bool IsUniversallyAdministered() const
 	{ return (m_address[0] & 2) == 0; }
 
+	///@brief Returns true if this is the all-zeroes address (used as a placeholder for "not yet resolved")
+	bool IsNull() const
+	{
+		for(size_t i=0; i<ETHERNET_MAC_SIZE; i++)
+		{
+			if(m_address[i] != 0)
+				return false;
+		}
+		return true;
+	}
+
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Raw field access
 
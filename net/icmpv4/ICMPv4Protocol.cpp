@@ -74,8 +74,27 @@ void ICMPv4Protocol::OnRxPacket(ICMPv4Packet* packet, uint16_t ipPayloadLength,
  */
 void ICMPv4Protocol::OnRxEchoRequest(ICMPv4Packet* packet, uint16_t ipPayloadLength, IPv4Address sourceAddress)
 {
+	//If the driver lets us, send the request back as the reply. The body is already there and only the type changes.
+	auto turned = m_ipv4.TurnaroundRxPacket(TX_CLASS_CONTROL);
+	if(turned)
+	{
+		uint16_t oldWord = (ICMPv4Packet::TYPE_ECHO_REQUEST << 8) | packet->m_code;
+		packet->m_type = ICMPv4Packet::TYPE_ECHO_REPLY;
+		packet->m_code = 0;
+
+		//Patch the checksum incrementally (RFC 1624 eqn 3) since the type/code word went from 0x08xx to 0x0000
+		uint32_t sum = static_cast<uint16_t>(~__builtin_bswap16(packet->m_checksum));
+		sum += static_cast<uint16_t>(~oldWord);
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum += (sum >> 16);
+		packet->m_checksum = __builtin_bswap16(static_cast<uint16_t>(~sum));
+
+		m_ipv4.SendTxPacket(turned, ipPayloadLength);
+		return;
+	}
+
 	//Get ready to send a reply
-	auto reply = m_ipv4.GetTxPacket(sourceAddress, IP_PROTO_ICMP);
+	auto reply = m_ipv4.GetTxPacket(sourceAddress, IP_PROTO_ICMP, TX_CLASS_CONTROL);
 	if(reply == NULL)
 		return;
 
@@ -89,8 +108,6 @@ void ICMPv4Protocol::OnRxEchoRequest(ICMPv4Packet* packet, uint16_t ipPayloadLen
 	memcpy(&payload->m_headerBody, packet->m_headerBody, ipPayloadLength - 4);
 
 	//Calculate the new checksum
-	//TODO: we can patch the checksum without fully recalculating,
-	//since it's addition based and we only changed one byte!
 	payload->m_checksum = ~__builtin_bswap16(
 		IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(payload), ipPayloadLength));
 
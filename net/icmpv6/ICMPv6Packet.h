@@ -57,7 +57,9 @@ public:
 	{
 		//TYPE_ECHO_REPLY		= 0,
 		//TYPE_ECHO_REQUEST	= 8
-		TYPE_ROUTER_ADVERTISEMENT	= 134
+		TYPE_ROUTER_ADVERTISEMENT	= 134,
+		TYPE_NEIGHBOR_SOLICITATION	= 135,
+		TYPE_NEIGHBOR_ADVERTISEMENT	= 136
 	};
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
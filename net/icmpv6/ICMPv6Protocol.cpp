@@ -77,6 +77,10 @@ void ICMPv6Protocol::OnRxPacket(
 			OnRxRouterAdvertisement(packet, ipPayloadLength, sourceAddress);
 			break;
 
+		case ICMPv6Packet::TYPE_NEIGHBOR_SOLICITATION:
+			OnRxNeighborSolicitation(packet, ipPayloadLength, sourceAddress);
+			break;
+
 		/*case ICMPv6Packet::TYPE_ECHO_REQUEST:
 			OnRxEchoRequest(packet, ipPayloadLength, sourceAddress);
 			break;*/
@@ -197,6 +201,83 @@ void ICMPv6Protocol::OnRxRouterAdvertisement(
 	}
 }
 
+/**
+	@brief Handles an incoming neighbor solicitation, answering it if it's looking for one of our addresses
+
+	Solicitations are normally multicast, so IPv6Protocol doesn't learn the sender's MAC. We take it from the source
+	link-layer address option instead, so the reply can be sent straight back.
+ */
+void ICMPv6Protocol::OnRxNeighborSolicitation(
+	ICMPv6Packet* packet,
+	uint16_t ipPayloadLength,
+	IPv6Address sourceAddress)
+{
+	//4 bytes reserved, then the target address
+	if(ipPayloadLength < (sizeof(ICMPv6Packet) + 4 + IPV6_ADDR_SIZE) )
+		return;
+	IPv6Address target;
+	memcpy(target.m_octets, packet->Payload() + 4, IPV6_ADDR_SIZE);
+	if(m_ipv6.GetAddressType(target) != IPv6Protocol::ADDR_UNICAST_US)
+		return;
+
+	//Ignore duplicate address detection probes (unspecified source), we don't do DAD
+	if( (sourceAddress.m_words[0] | sourceAddress.m_words[1] | sourceAddress.m_words[2] | sourceAddress.m_words[3]) == 0)
+		return;
+
+	//Learn the sender's MAC
+	uint8_t* popt = packet->Payload() + 4 + IPV6_ADDR_SIZE;
+	uint8_t* pend = reinterpret_cast<uint8_t*>(packet) + ipPayloadLength;
+	while( (popt + 2) <= pend)
+	{
+		//abort on invalid length rather than infinite looping
+		uint16_t len = popt[1] * 8;
+		if( (len == 0) || ( (popt + len) > pend) )
+			break;
+
+		auto type = static_cast<NeighborDiscoveryOption>(popt[0]);
+		if( (type == NeighborDiscoveryOption::SourceLinkLayerAddress) && (len == 8) )
+		{
+			MACAddress mac;
+			memcpy(mac.m_address, popt + 2, ETHERNET_MAC_SIZE);
+			m_ipv6.LearnNeighbor(mac, sourceAddress);
+		}
+
+		popt += len;
+	}
+
+	//Get ready to send a reply
+	auto reply = m_ipv6.GetTxPacket(sourceAddress, IP_PROTO_ICMPV6, TX_CLASS_CONTROL);
+	if(reply == nullptr)
+		return;
+
+	//Answer from the address that was asked about
+	reply->m_sourceAddress = target;
+
+	//Format the advertisement: solicited + override flags, target address, and our MAC
+	auto payload = reinterpret_cast<ICMPv6Packet*>(reply->Payload());
+	payload->m_type = ICMPv6Packet::TYPE_NEIGHBOR_ADVERTISEMENT;
+	payload->m_code = 0;
+	payload->m_checksum = 0;
+
+	auto body = payload->Payload();
+	body[0] = 0x60;
+	body[1] = 0;
+	body[2] = 0;
+	body[3] = 0;
+	memcpy(body + 4, target.m_octets, IPV6_ADDR_SIZE);
+
+	auto opt = body + 4 + IPV6_ADDR_SIZE;
+	opt[0] = static_cast<uint8_t>(NeighborDiscoveryOption::TargetLinkLayerAddress);
+	opt[1] = 1;
+	memcpy(opt + 2, m_ipv6.GetEthernet()->GetMACAddress().m_address, ETHERNET_MAC_SIZE);
+
+	//Calculate the checksum and send it
+	uint16_t len = sizeof(ICMPv6Packet) + 4 + IPV6_ADDR_SIZE + 8;
+	payload->m_checksum = ~__builtin_bswap16(
+		IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(payload), len, m_ipv6.PseudoHeaderChecksum(reply, len)));
+	m_ipv6.SendTxPacket(reply, len);
+}
+
 /**
 	@brief Handles an incoming echo request (ping) packet
  */
@@ -227,3 +308,52 @@ void ICMPv6Protocol::OnRxEchoRequest(ICMPv6Packet* packet, uint16_t ipPayloadLen
 	m_ipv6.SendTxPacket(reply, ipPayloadLength);
 }
 */
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Outbound neighbor discovery
+
+/**
+	@brief Sends a neighbor solicitation asking for the MAC address of target
+ */
+void ICMPv6Protocol::SendNeighborSolicitation(const IPv6Address& target)
+{
+	//Send to the solicited-node multicast group for the target (ff02::1:ffxx:xxxx)
+	IPv6Address dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.m_octets[0] = 0xff;
+	dest.m_octets[1] = 0x02;
+	dest.m_octets[11] = 0x01;
+	dest.m_octets[12] = 0xff;
+	dest.m_octets[13] = target.m_octets[13];
+	dest.m_octets[14] = target.m_octets[14];
+	dest.m_octets[15] = target.m_octets[15];
+
+	auto packet = m_ipv6.GetTxPacket(dest, IP_PROTO_ICMPV6, TX_CLASS_CONTROL);
+	if(packet == nullptr)
+		return;
+
+	//Ask from the address the reply should come back to
+	if(!IPv6Protocol::IsLinkLocal(target))
+		packet->m_sourceAddress = m_ipv6.GetOurAddress();
+
+	//Format the solicitation: reserved field, target address, and our MAC
+	auto payload = reinterpret_cast<ICMPv6Packet*>(packet->Payload());
+	payload->m_type = ICMPv6Packet::TYPE_NEIGHBOR_SOLICITATION;
+	payload->m_code = 0;
+	payload->m_checksum = 0;
+
+	auto body = payload->Payload();
+	memset(body, 0, 4);
+	memcpy(body + 4, target.m_octets, IPV6_ADDR_SIZE);
+
+	auto opt = body + 4 + IPV6_ADDR_SIZE;
+	opt[0] = static_cast<uint8_t>(NeighborDiscoveryOption::SourceLinkLayerAddress);
+	opt[1] = 1;
+	memcpy(opt + 2, m_ipv6.GetEthernet()->GetMACAddress().m_address, ETHERNET_MAC_SIZE);
+
+	//Calculate the checksum and send it
+	uint16_t len = sizeof(ICMPv6Packet) + 4 + IPV6_ADDR_SIZE + 8;
+	payload->m_checksum = ~__builtin_bswap16(
+		IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(payload), len, m_ipv6.PseudoHeaderChecksum(packet, len)));
+	m_ipv6.SendTxPacket(packet, len);
+}
@@ -51,18 +51,31 @@ public:
 		IPv6Address sourceAddress,
 		uint16_t pseudoHeaderChecksum);
 
+	void SendNeighborSolicitation(const IPv6Address& target);
+
 protected:
 	void OnRxRouterAdvertisement(
 		ICMPv6Packet* packet,
 		uint16_t ipPayloadLength,
 		IPv6Address sourceAddress);
 
+	void OnRxNeighborSolicitation(
+		ICMPv6Packet* packet,
+		uint16_t ipPayloadLength,
+		IPv6Address sourceAddress);
+
 	enum class RouterAdvertisementOption
 	{
 		SourceLinkLayerAddress = 1,
 		PrefixInformation = 3
 	};
 
+	enum class NeighborDiscoveryOption
+	{
+		SourceLinkLayerAddress = 1,
+		TargetLinkLayerAddress = 2
+	};
+
 /*
 	void OnRxEchoRequest(
 		ICMPv6Packet* packet,
@@ -51,7 +51,7 @@ IPv4Protocol::IPv4Protocol(EthernetProtocol& eth, IPv4Config& config, ARPCache&
 	, m_udp(nullptr)
 	, m_allowUnknownUnicasts(false)
 {
-
+	m_pinnedGateway.m_word = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -250,10 +250,11 @@ void IPv4Protocol::OnRxPacket(IPv4Packet* packet, uint16_t ethernetPayloadLength
  */
 void IPv4Protocol::OnLinkUp()
 {
-	//Send an ARP query for the default gateway
+	//Start resolving the default gateway right away, since most traffic will go through it
+	UpdateGatewayPin();
 	auto arp = m_eth.GetARP();
-	if(arp)
-		arp->SendQuery(m_config.m_gateway);
+	if(arp && m_config.m_gateway.m_word)
+		arp->Resolve(m_config.m_gateway);
 }
 
 /**
@@ -265,22 +266,34 @@ void IPv4Protocol::OnLinkDown()
 }
 
 /**
-	@brief Called at 1 Hz to handle cache aging
+	@brief Called at 1 Hz to handle cache and socket aging
  */
 void IPv4Protocol::OnAgingTick()
 {
 	if(m_udp)
 		m_udp->OnAgingTick();
+	if(m_tcp)
+		m_tcp->OnAgingTick();
 
-	auto expiry = m_cache.GetExpiry(m_config.m_gateway);
+	//The gateway may have been changed (e.g. by DHCP) since the last tick.
+	//ARPProtocol takes care of refreshing it in the background
+	UpdateGatewayPin();
+}
 
-	//If it expires soon, send a query
-	if(expiry < 15)
-	{
-		auto arp = m_eth.GetARP();
-		if(arp)
-			arp->SendQuery(m_config.m_gateway);
-	}
+/**
+	@brief Keeps the ARP cache entry for the current default gateway pinned
+ */
+void IPv4Protocol::UpdateGatewayPin()
+{
+	if(m_pinnedGateway == m_config.m_gateway)
+		return;
+
+	if(m_pinnedGateway.m_word)
+		m_cache.Unpin(m_pinnedGateway);
+
+	m_pinnedGateway = m_config.m_gateway;
+	if(m_pinnedGateway.m_word)
+		m_cache.Pin(m_pinnedGateway);
 }
 
 /**
@@ -293,18 +306,49 @@ void IPv4Protocol::OnAgingTick10x()
 		m_tcp->OnAgingTick10x();
 }
 
+/**
+	@brief Called by EthernetProtocol::OnTimer() to handle timers with deadlines more precise than the 1 Hz tick
+ */
+void IPv4Protocol::OnTimer()
+{
+	if(m_tcp)
+		m_tcp->OnTimer();
+}
+
+/**
+	@brief Returns the number of milliseconds until the next upper layer timer is due
+ */
+uint32_t IPv4Protocol::GetNextDeadline()
+{
+	if(m_tcp)
+		return m_tcp->GetNextDeadline();
+	return TIMER_NO_DEADLINE;
+}
+
+/**
+	@brief Called by EthernetProtocol when TX frames have been freed
+ */
+void IPv4Protocol::OnTxSpaceAvailable()
+{
+	if(m_tcp)
+		m_tcp->OnTxSpaceAvailable();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Handler for outbound packets
 
 /**
 	@brief Allocates an outbound packet and prepare to send it
 
-	Returns nullptr if we don't have an ARP entry for the destination yet and it's not a broadcast
+	If we don't have an ARP entry for the next hop yet, a query is sent and the packet is prepared anyway; it will be
+	parked in the ARP hold queue by SendTxPacket() and go out as soon as the reply arrives.
+
+	Returns nullptr if the next hop is unresolved and the hold queue for it is full (or there is no ARP stack).
  */
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto)
+IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto, txclass_t txclass)
 {
 	auto arp = m_eth.GetARP();
 
@@ -315,12 +359,13 @@ IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto)
 	{
 		if(!m_cache.Lookup(destmac, m_config.m_gateway))
 		{
-			//Send an ARP query for the default gateway
-			if(arp)
-				arp->SendQuery(m_config.m_gateway);
+			//Start resolving the default gateway, unless it recently failed to answer
+			if(!arp || !arp->Resolve(m_config.m_gateway))
+				return nullptr;
 
-			//But  for now, nothing we can do
-			return nullptr;
+			//Leave the destination MAC null, so SendTxPacket() knows to hold the packet until it's resolved
+			if(!arp->CanHold(m_config.m_gateway))
+				return nullptr;
 		}
 	}
 
@@ -343,19 +388,21 @@ IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto)
 			//Unicast? Check the ARP table
 			case ADDR_UNICAST_OTHER:
 
-				//Not in ARP cache? Send a query, but nothing we can do right now
+				//Not in ARP cache? Send a query (unless it recently failed to answer), and hold the packet until
+				//it's answered
 				if(!m_cache.LookupAndExpiryCheck(destmac, dest, expiry))
 				{
-					if(arp)
-						arp->SendQuery(dest);
-					return nullptr;
+					if(!arp || !arp->Resolve(dest))
+						return nullptr;
+					if(!arp->CanHold(dest))
+						return nullptr;
 				}
 
 				//In cache, but expiring soon? Send a query to refresh the cache entry
-				else if(expiry < 15)
+				else if(expiry < ARP_REFRESH_THRESHOLD)
 				{
 					if(arp)
-						arp->SendQuery(dest);
+						arp->Resolve(dest);
 				}
 
 				break;
@@ -367,7 +414,7 @@ IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto)
 	}
 
 	//Allocate the frame and fill headers
-	auto frame = m_eth.GetTxFrame(ETHERTYPE_IPV4, destmac);
+	auto frame = m_eth.GetTxFrame(ETHERTYPE_IPV4, destmac, txclass);
 	if(!frame)
 		return nullptr;
 
@@ -387,6 +434,36 @@ IPv4Packet* IPv4Protocol::GetTxPacket(IPv4Address dest, ipproto_t proto)
 	return reply;
 }
 
+/**
+	@brief Converts the packet currently being received into a reply to its sender, in place
+
+	This may only be called from an upper layer's receive handler. On success, the IPv4 header has been rewritten as if
+	by GetTxPacket() with the original sender as the destination and the same upper layer protocol, and the upper
+	layer payload is left untouched so it can be reused for the reply. The packet is then sent with SendTxPacket().
+
+	The reply goes back to the MAC address the request came from, so no ARP lookup is needed.
+
+	Returns nullptr if turnaround isn't possible (see EthernetProtocol::TurnaroundRxFrame()), in which case the caller
+	should fall back to GetTxPacket().
+ */
+IPv4Packet* IPv4Protocol::TurnaroundRxPacket(txclass_t txclass)
+{
+	auto frame = m_eth.TurnaroundRxFrame(txclass);
+	if(!frame)
+		return nullptr;
+
+	auto reply = reinterpret_cast<IPv4Packet*>(frame->Payload());
+	reply->m_dscpAndECN = 0;
+	reply->m_fragID = 0;
+	reply->m_flagsFragOffHigh = 0x40;	//DF
+	reply->m_fragOffLow = 0;
+	reply->m_ttl = 0xff;
+	reply->m_destAddress = reply->m_sourceAddress;
+	reply->m_sourceAddress = m_config.m_address;
+	reply->m_headerChecksum = 0;
+	return reply;
+}
+
 /**
 	@brief Sends a packet to the driver
 
@@ -408,6 +485,112 @@ void IPv4Protocol::SendTxPacket(IPv4Packet* packet, size_t upperLayerLength, boo
 	//Final fixup of checksum and byte ordering before sending it out
 	packet->ByteSwap();
 	packet->m_headerChecksum = ~__builtin_bswap16(InternetChecksum(reinterpret_cast<uint8_t*>(packet), 20));
+
+	//If the next hop wasn't resolved when the packet was allocated, park it until the ARP reply comes in
+	//(it may have arrived since, in which case there's no need to wait)
+	if(frame->DstMAC().IsNull())
+	{
+		auto nextHop = GetNextHop(packet->m_destAddress);
+		if(!m_cache.Lookup(frame->DstMAC(), nextHop))
+		{
+			m_eth.GetARP()->Hold(frame, nextHop, markFree);
+			return;
+		}
+	}
+
+	m_eth.SendTxFrame(frame, markFree);
+}
+
+/**
+	@brief Allocates an outbound packet using a cached header template, if possible
+
+	If the template is up to date, the headers are copied from it and the routing decision and ARP lookup are skipped.
+	Otherwise this behaves like the regular GetTxPacket() and the template is rebuilt from the result.
+
+	The packet should be sent with the SendTxPacket() overload taking the same template.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+IPv4Packet* IPv4Protocol::GetTxPacket(IPv4TxTemplate& tmpl, IPv4Address dest, ipproto_t proto, txclass_t txclass)
+{
+	if(IsTemplateCurrent(tmpl, dest, proto))
+	{
+		auto frame = m_eth.GetTxFrame(ETHERTYPE_IPV4, tmpl.m_dstMAC, txclass);
+		if(!frame)
+			return nullptr;
+
+		auto packet = reinterpret_cast<IPv4Packet*>(frame->Payload());
+		*packet = tmpl.m_header;
+		return packet;
+	}
+
+	//Snapshot the ARP generation before the lookup. If the mapping changes after this, the template is already stale
+	auto generation = m_cache.GetGeneration();
+	auto packet = GetTxPacket(dest, proto, txclass);
+	if(packet)
+		BuildTemplate(tmpl, packet, generation);
+	return packet;
+}
+
+/**
+	@brief Fills in a header template from a freshly allocated packet
+
+	Templates are only built for unicasts whose next hop is resolved and not about to expire, so refresh queries still
+	go out on time from the regular GetTxPacket() path.
+
+	arpGeneration must have been read from the ARP cache before the packet's destination MAC was looked up.
+ */
+void IPv4Protocol::BuildTemplate(IPv4TxTemplate& tmpl, IPv4Packet* packet, uint32_t arpGeneration)
+{
+	tmpl.m_valid = false;
+	auto now = m_cache.GetTime();
+
+	auto frame = reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET);
+	auto& mac = frame->DstMAC();
+	if(mac.IsNull() || mac.IsMulticast())
+		return;
+
+	auto lifetime = m_cache.GetExpiry(GetNextHop(packet->m_destAddress));
+	if(lifetime <= ARP_REFRESH_THRESHOLD)
+		return;
+
+	tmpl.m_arpGeneration = arpGeneration;
+	tmpl.m_validUntil = now + lifetime - ARP_REFRESH_THRESHOLD;
+	tmpl.m_dstMAC = mac;
+	tmpl.m_header = *packet;
+	tmpl.m_header.m_totalLength = 0;
+	tmpl.m_header.m_headerChecksum = 0;
+	tmpl.m_headerChecksum = InternetChecksum(reinterpret_cast<uint8_t*>(&tmpl.m_header), sizeof(IPv4Packet));
+	tmpl.m_pseudoHeaderChecksum = PseudoHeaderChecksum(packet, 0);
+	tmpl.m_valid = true;
+}
+
+/**
+	@brief Sends a packet allocated by the GetTxPacket() overload taking a template
+
+	The header checksum is patched up incrementally from the template, rather than computed from scratch.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void IPv4Protocol::SendTxPacket(IPv4TxTemplate& tmpl, IPv4Packet* packet, size_t upperLayerLength, bool markFree)
+{
+	//If the template was invalidated or rebuilt for a different address since the packet was allocated, do it the slow
+	//way. Same if the packet was allocated while the next hop was unresolved, even if the template has been rebuilt
+	//since then: it has no destination MAC, and has to go through the ARP hold queue
+	auto frame = reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET);
+	if(!tmpl.Matches(packet) || frame->DstMAC().IsNull())
+	{
+		SendTxPacket(packet, upperLayerLength, markFree);
+		return;
+	}
+
+	packet->m_totalLength = sizeof(IPv4Packet) + upperLayerLength;
+	frame->SetPayloadLength(packet->m_totalLength);
+	packet->m_headerChecksum = tmpl.HeaderChecksum(packet->m_totalLength);
+	packet->ByteSwap();
+
 	m_eth.SendTxFrame(frame, markFree);
 }
 
@@ -420,6 +603,39 @@ void IPv4Protocol::ResendTxPacket(IPv4Packet* packet, bool markFree)
 	//TODO: handle VLAN tagging?
 	auto frame = reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET);
 
+	//Never went out because the next hop wasn't resolved?
+	if(frame->DstMAC().IsNull())
+	{
+		//Still in the hold queue, so it'll be sent when the ARP reply arrives
+		auto arp = m_eth.GetARP();
+		if(arp->IsHeld(frame))
+			return;
+
+		//Timed out of the hold queue. Try resolving again, and wait for the next retransmit if we still can't
+		auto nextHop = GetNextHop(packet->m_destAddress);
+		if(!m_cache.Lookup(frame->DstMAC(), nextHop))
+		{
+			arp->Resolve(nextHop);
+			if(markFree)
+				m_eth.CancelTxFrame(frame);
+			return;
+		}
+	}
+
 	//Send it
 	m_eth.ResendTxFrame(frame, markFree);
 }
+
+/**
+	@brief Cancels sending of a packet
+ */
+void IPv4Protocol::CancelTxPacket(IPv4Packet* packet)
+{
+	auto frame = reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET);
+
+	//Make sure the ARP hold queue isn't still pointing to it
+	if(frame->DstMAC().IsNull())
+		m_eth.GetARP()->Unhold(frame);
+
+	m_eth.CancelTxFrame(frame);
+}
@@ -38,6 +38,7 @@
 #include <stdint.h>
 #include "IPv4Address.h"
 #include "IPv4Packet.h"
+#include "IPv4TxTemplate.h"
 #include "../IPProtocols.h"
 
 inline bool operator!= (const IPv4Address& a, const IPv4Address& b)
@@ -72,8 +73,8 @@ class IPv4Protocol
 public:
 	IPv4Protocol(EthernetProtocol& eth, IPv4Config& config, ARPCache& cache);
 
-	bool IsTxBufferAvailable()
-	{ return m_eth.IsTxBufferAvailable(); }
+	bool IsTxBufferAvailable(txclass_t txclass = TX_CLASS_NORMAL)
+	{ return m_eth.IsTxBufferAvailable(txclass); }
 
 	IPv4Protocol(const IPv4Protocol& rhs) =delete;
 
@@ -85,13 +86,15 @@ public:
 	void SetAllowUnknownUnicasts(bool allow)
 	{ m_allowUnknownUnicasts = allow; }
 
-	IPv4Packet* GetTxPacket(IPv4Address dest, ipproto_t proto);
+	IPv4Packet* GetTxPacket(IPv4Address dest, ipproto_t proto, txclass_t txclass = TX_CLASS_NORMAL);
 	void SendTxPacket(IPv4Packet* packet, size_t upperLayerLength, bool markFree = true);
+	IPv4Packet* GetTxPacket(
+		IPv4TxTemplate& tmpl, IPv4Address dest, ipproto_t proto, txclass_t txclass = TX_CLASS_NORMAL);
+	void SendTxPacket(IPv4TxTemplate& tmpl, IPv4Packet* packet, size_t upperLayerLength, bool markFree = true);
 	void ResendTxPacket(IPv4Packet* packet, bool markFree = false);
 
-	///@brief Cancels sending of a packet
-	void CancelTxPacket(IPv4Packet* packet)
-	{ m_eth.CancelTxFrame(reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET)); }
+	void CancelTxPacket(IPv4Packet* packet);
+	IPv4Packet* TurnaroundRxPacket(txclass_t txclass = TX_CLASS_CONTROL);
 
 	void OnRxPacket(IPv4Packet* packet, uint16_t ethernetPayloadLength);
 
@@ -99,6 +102,9 @@ public:
 	void OnLinkDown();
 	void OnAgingTick();
 	void OnAgingTick10x();
+	void OnTimer();
+	uint32_t GetNextDeadline();
+	void OnTxSpaceAvailable();
 
 	static uint16_t InternetChecksum(uint8_t* data, uint16_t len, uint16_t initial = 0);
 	uint16_t PseudoHeaderChecksum(IPv4Packet* packet, uint16_t length);
@@ -123,6 +129,10 @@ public:
 	AddressType GetAddressType(IPv4Address addr);
 	bool IsLocalSubnet(IPv4Address addr);
 
+	///@brief Returns the address which has to be resolved in order to reach a destination
+	IPv4Address GetNextHop(IPv4Address dest)
+	{ return IsLocalSubnet(dest) ? dest : m_config.m_gateway; }
+
 	EthernetProtocol* GetEthernet()
 	{ return &m_eth; }
 
@@ -151,6 +161,25 @@ protected:
 
 	///@brief True to forward unicasts to unknown addresses to us
 	bool m_allowUnknownUnicasts;
+
+	///@brief The gateway address currently pinned in the ARP cache (zero if none)
+	IPv4Address m_pinnedGateway;
+
+	void UpdateGatewayPin();
+	void BuildTemplate(IPv4TxTemplate& tmpl, IPv4Packet* packet, uint32_t arpGeneration);
+
+	/**
+		@brief Checks if a template can still be used to send a packet to the given destination
+	 */
+	bool IsTemplateCurrent(IPv4TxTemplate& tmpl, IPv4Address dest, ipproto_t proto)
+	{
+		return tmpl.m_valid &&
+			(tmpl.m_arpGeneration == m_cache.GetGeneration()) &&
+			(tmpl.m_header.m_destAddress == dest) &&
+			(tmpl.m_header.m_protocol == proto) &&
+			(tmpl.m_header.m_sourceAddress == m_config.m_address) &&
+			!MonotonicClock::IsExpired(m_cache.GetTime(), tmpl.m_validUntil);
+	}
 };
 
 #endif
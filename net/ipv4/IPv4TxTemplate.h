@@ -0,0 +1,113 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2021-2024 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of IPv4TxTemplate
+ */
+
+#ifndef IPv4TxTemplate_h
+#define IPv4TxTemplate_h
+
+#include "IPv4Packet.h"
+#include "../ethernet/MACAddress.h"
+
+/**
+	@brief Cached headers for a stream of packets sent to the same destination (e.g. one TCP connection)
+
+	Filled in by IPv4Protocol::GetTxPacket() the first time a packet is sent through it, then reused for later packets
+	so they skip the routing decision and ARP lookup. The template is discarded automatically if the ARP cache changes,
+	the entry it was built from gets close to expiring, or our address changes.
+ */
+class IPv4TxTemplate
+{
+public:
+	IPv4TxTemplate()
+	: m_valid(false)
+	{}
+
+	///@brief Forces the template to be rebuilt on the next send
+	void Invalidate()
+	{ m_valid = false; }
+
+	/**
+		@brief Checks if the template is valid and matches the addresses of a packet, so its checksums can be used
+	 */
+	bool Matches(IPv4Packet* packet)
+	{
+		return m_valid &&
+			(packet->m_sourceAddress.m_word == m_header.m_sourceAddress.m_word) &&
+			(packet->m_destAddress.m_word == m_header.m_destAddress.m_word);
+	}
+
+	/**
+		@brief Returns the TCP/UDP pseudoheader checksum for a packet with the given upper layer length
+	 */
+	uint16_t PseudoHeaderChecksum(uint16_t length)
+	{
+		uint32_t checksum = m_pseudoHeaderChecksum + length;
+		checksum = (checksum >> 16) + (checksum & 0xffff);
+		checksum += (checksum >> 16);
+		return checksum;
+	}
+
+	/**
+		@brief Returns the IPv4 header checksum (ready to write to the packet) for a given total length
+	 */
+	uint16_t HeaderChecksum(uint16_t totalLength)
+	{
+		uint32_t checksum = m_headerChecksum + totalLength;
+		checksum = (checksum >> 16) + (checksum & 0xffff);
+		checksum += (checksum >> 16);
+		return ~__builtin_bswap16(checksum);
+	}
+
+	///@brief True if the template has been filled in
+	bool m_valid;
+
+	///@brief ARP cache generation the template was built from
+	uint32_t m_arpGeneration;
+
+	///@brief ARP cache time (in seconds) after which the template must be rebuilt
+	uint32_t m_validUntil;
+
+	///@brief MAC address of the next hop
+	MACAddress m_dstMAC;
+
+	///@brief IPv4 header, as returned by GetTxPacket() (total length and checksum not yet filled in)
+	IPv4Packet m_header;
+
+	///@brief Partial checksum of m_header, not including the total length
+	uint16_t m_headerChecksum;
+
+	///@brief Partial pseudoheader checksum, not including the upper layer length
+	uint16_t m_pseudoHeaderChecksum;
+};
+
+#endif
@@ -49,11 +49,28 @@ IPv6Protocol::IPv6Protocol(EthernetProtocol& eth, IPv6Config& config)
 	: m_eth(eth)
 	, m_config(config)
 	, m_icmpv6(nullptr)
-	//, m_tcp(nullptr)
+	, m_tcp(nullptr)
 	//, m_udp(nullptr)
 	, m_allowUnknownUnicasts(false)
+	, m_lastSolicitTime(0)
 {
-
+	//Derive our link-local address from the MAC (modified EUI-64)
+	auto& mac = eth.GetMACAddress();
+	memset(&m_linkLocalAddress, 0, sizeof(m_linkLocalAddress));
+	m_linkLocalAddress.m_octets[0] = 0xfe;
+	m_linkLocalAddress.m_octets[1] = 0x80;
+	m_linkLocalAddress.m_octets[8] = mac[0] ^ 0x02;
+	m_linkLocalAddress.m_octets[9] = mac[1];
+	m_linkLocalAddress.m_octets[10] = mac[2];
+	m_linkLocalAddress.m_octets[11] = 0xff;
+	m_linkLocalAddress.m_octets[12] = 0xfe;
+	m_linkLocalAddress.m_octets[13] = mac[3];
+	m_linkLocalAddress.m_octets[14] = mac[4];
+	m_linkLocalAddress.m_octets[15] = mac[5];
+
+	for(auto& n : m_neighbors)
+		n.m_valid = false;
+	memset(&m_lastSolicitTarget, 0, sizeof(m_lastSolicitTarget));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -65,7 +82,7 @@ IPv6Protocol::IPv6Protocol(EthernetProtocol& eth, IPv6Config& config)
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-uint16_t IPv6Protocol::PseudoHeaderChecksum(IPv6Packet* packet)
+uint16_t IPv6Protocol::PseudoHeaderChecksum(IPv6Packet* packet, uint16_t length)
 {
 	uint16_t workingChecksum = IPv4Protocol::InternetChecksum(packet->m_sourceAddress.m_octets, 16);
 	workingChecksum = IPv4Protocol::InternetChecksum(packet->m_destAddress.m_octets, 16, workingChecksum);
@@ -74,8 +91,8 @@ uint16_t IPv6Protocol::PseudoHeaderChecksum(IPv6Packet* packet)
 	{
 		0x0,
 		packet->m_nextHeader,
-		static_cast<uint8_t>(packet->m_payloadLength >> 8),
-		static_cast<uint8_t>(packet->m_payloadLength & 0xff)
+		static_cast<uint8_t>(length >> 8),
+		static_cast<uint8_t>(length & 0xff)
 	};
 
 	return IPv4Protocol::InternetChecksum(pseudoheader, sizeof(pseudoheader), workingChecksum);
@@ -87,15 +104,18 @@ uint16_t IPv6Protocol::PseudoHeaderChecksum(IPv6Packet* packet)
 /**
 	@brief Figures out if an address is a unicast to us, a broad/multicast, or something else
  */
-IPv6Protocol::AddressType IPv6Protocol::GetAddressType(IPv6Address addr)
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+IPv6Protocol::AddressType IPv6Protocol::GetAddressType(const IPv6Address& addr)
 {
 	//Multicast have the most significant byte set
 	if(addr.m_octets[0] == 0xff)
 		return ADDR_MULTICAST;
 
-	//TODO: check for match to our link local or globally routable addresses
-	//if(addr == m_config.m_address)
-	//	return ADDR_UNICAST_US;
+	//Our link local or globally routable addresses
+	if( (addr == m_config.m_address) || (addr == m_linkLocalAddress) )
+		return ADDR_UNICAST_US;
 
 	//For anything else
 	else
@@ -117,8 +137,10 @@ bool IPv6Protocol::IsLocalSubnet(IPv6Address addr)
 
 /**
 	@brief Handle an incoming IPv6 packet
+
+	srcmac is the source address of the Ethernet frame the packet arrived in.
  */
-void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength)
+void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength, const MACAddress& srcmac)
 {
 	//See what we got
 /*	g_log("IPv6Protocol::OnRxPacket(%u bytes)\n", (uint32_t)ethernetPayloadLength);
@@ -134,7 +156,7 @@ void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength
 		return;
 
 	//Length must be plausible (not more than the MTU, we don't support fragmentation)
-	if( (packet->m_payloadLength + 36) > ethernetPayloadLength)
+	if( (packet->m_payloadLength + sizeof(IPv6Packet)) > ethernetPayloadLength)
 		return;
 
 	//Ignore hop limit
@@ -167,6 +189,11 @@ void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength
 	if( (type == ADDR_UNICAST_OTHER) && !m_allowUnknownUnicasts)
 		return;
 
+	//Remember where this address (or the router forwarding for it) is, so we can reply.
+	//Only trust unicasts to us, anyone on the link can spray multicasts with whatever source address they like
+	if(type == ADDR_UNICAST_US)
+		LearnNeighbor(srcmac, packet->m_sourceAddress);
+
 	//Figure out the upper layer protocol
 	switch(packet->m_nextHeader)
 	{
@@ -178,7 +205,20 @@ void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength
 					reinterpret_cast<ICMPv6Packet*>(packet->Payload()),
 					packet->m_payloadLength,
 					packet->m_sourceAddress,
-					PseudoHeaderChecksum(packet));
+					PseudoHeaderChecksum(packet, packet->m_payloadLength));
+			}
+			break;
+
+		//TCP segments must be directed at our unicast address.
+		//The connection oriented flow makes no sense to be broadcast/multicast.
+		case IP_PROTO_TCP:
+			if(m_tcp && (type == ADDR_UNICAST_US) )
+			{
+				m_tcp->OnRxPacket(
+					reinterpret_cast<TCPSegment*>(packet->Payload()),
+					packet->m_payloadLength,
+					packet->m_sourceAddress,
+					PseudoHeaderChecksum(packet, packet->m_payloadLength));
 			}
 			break;
 
@@ -189,19 +229,6 @@ void IPv6Protocol::OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength
 	}
 
 	/*
-	//TCP segments must be directed at our unicast address.
-	//The connection oriented flow makes no sense to be broadcast/multicast.
-	case IP_PROTO_TCP:
-		if(m_tcp && (type == ADDR_UNICAST_US) )
-		{
-			m_tcp->OnRxPacket(
-				reinterpret_cast<TCPSegment*>(packet->Payload()),
-				plen,
-				packet->m_sourceAddress,
-				PseudoHeaderChecksum(packet, plen));
-		}
-		break;
-
 	//Allow unknown unicasts on request for UDP to enable e.g. DHCP
 	case IP_PROTO_UDP:
 		if(m_udp && ( (type == ADDR_UNICAST_US) || m_allowUnknownUnicasts) )
@@ -237,144 +264,204 @@ void IPv6Protocol::OnLinkUp()
  */
 void IPv6Protocol::OnLinkDown()
 {
-	//m_cache.Clear();
+	for(auto& n : m_neighbors)
+		n.m_valid = false;
+}
+
+/**
+	@brief Checks if we're responsible for driving the attached TCP stack's timers
+
+	In a dual-stack setup the IPv4 side does it, so the timers don't run twice.
+ */
+bool IPv6Protocol::HasTCPTimers()
+{
+	return m_tcp && (m_tcp->GetIPv4() == nullptr);
 }
 
 /**
 	@brief Called at 1 Hz to handle cache aging
  */
-/*
 void IPv6Protocol::OnAgingTick()
 {
-	if(m_udp)
-		m_udp->OnAgingTick();
-
-	auto expiry = m_cache.GetExpiry(m_config.m_gateway);
-
-	//If it expires soon, send a query
-	if(expiry < 15)
-	{
-		auto arp = m_eth.GetARP();
-		if(arp)
-			arp->SendQuery(m_config.m_gateway);
-	}
+	if(HasTCPTimers())
+		m_tcp->OnAgingTick();
 }
-*/
 
 /**
 	@brief Called at 10 Hz to handle retransmit aging
  */
-/*
 void IPv6Protocol::OnAgingTick10x()
 {
-	//Check the TCP stack for anything we might have to retransmit etc
-	if(m_tcp)
+	if(HasTCPTimers())
 		m_tcp->OnAgingTick10x();
 }
-*/
+
+/**
+	@brief Called by EthernetProtocol::OnTimer() to handle timers with deadlines more precise than the 1 Hz tick
+ */
+void IPv6Protocol::OnTimer()
+{
+	if(HasTCPTimers())
+		m_tcp->OnTimer();
+}
+
+/**
+	@brief Returns the number of milliseconds until the next upper layer timer is due
+ */
+uint32_t IPv6Protocol::GetNextDeadline()
+{
+	if(HasTCPTimers())
+		return m_tcp->GetNextDeadline();
+	return TIMER_NO_DEADLINE;
+}
+
+/**
+	@brief Called by EthernetProtocol when TX frames have been freed
+ */
+void IPv6Protocol::OnTxSpaceAvailable()
+{
+	if(HasTCPTimers())
+		m_tcp->OnTxSpaceAvailable();
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Handler for outbound packets
+// Neighbor cache
 
 /**
-	@brief Allocates an outbound packet and prepare to send it
+	@brief Remembers the MAC address an incoming packet came from, so we know where to send replies
 
-	Returns nullptr if we don't have an ARP entry for the destination yet and it's not a broadcast
+	If the cache is full, the least recently used entry is replaced.
  */
-/*
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-IPv6Packet* IPv6Protocol::GetTxPacket(IPv6Address dest, ipproto_t proto)
+void IPv6Protocol::LearnNeighbor(const MACAddress& mac, const IPv6Address& ip)
 {
-	auto arp = m_eth.GetARP();
+	//Don't learn multicast or unspecified (duplicate address detection) sources
+	if( (ip.m_octets[0] == 0xff) || ( (ip.m_words[0] | ip.m_words[1] | ip.m_words[2] | ip.m_words[3]) == 0) )
+		return;
 
-	//Find target MAC address
-	//If not in our subnet, send it to the default gateway
-	MACAddress destmac = {{0, 0, 0, 0, 0, 0}};
-	if(!IsLocalSubnet(dest))
+	auto now = m_eth.GetTimeMs();
+
+	//Refresh the existing entry if there is one, otherwise use a free slot or the least recently used one
+	auto victim = &m_neighbors[0];
+	for(auto& n : m_neighbors)
 	{
-		if(!m_cache.Lookup(destmac, m_config.m_gateway))
+		if(n.m_valid && (n.m_ip == ip) )
 		{
-			//Send an ARP query for the default gateway
-			if(arp)
-				arp->SendQuery(m_config.m_gateway);
-
-			//But  for now, nothing we can do
-			return nullptr;
+			n.m_mac = mac;
+			n.m_lastUsed = now;
+			return;
 		}
+
+		if(!victim->m_valid)
+			continue;
+		if(!n.m_valid || ( (now - n.m_lastUsed) > (now - victim->m_lastUsed) ) )
+			victim = &n;
 	}
 
-	//It's in the local subnet. Either broadcast or ARP
-	else
+	victim->m_valid = true;
+	victim->m_ip = ip;
+	victim->m_mac = mac;
+	victim->m_lastUsed = now;
+}
+
+/**
+	@brief Looks up the MAC address to use for sending to a given IPv6 address
+
+	Returns false if we haven't heard from that address.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool IPv6Protocol::LookupNeighbor(MACAddress& mac, const IPv6Address& ip)
+{
+	for(auto& n : m_neighbors)
 	{
-		auto type = GetAddressType(dest);
-		uint16_t expiry;
-		switch(type)
+		if(n.m_valid && (n.m_ip == ip) )
 		{
-			//TODO: use well known mac for some multicasts
-			//For now, just fall through to broadcast MAC
-			case ADDR_MULTICAST:
-
-			//If it's a broadcast, set it to a layer-2 broadcast MAC
-			case ADDR_BROADCAST:
-				destmac = MACAddress{{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
-				break;
-
-			//Unicast? Check the ARP table
-			case ADDR_UNICAST_OTHER:
-
-				//Not in ARP cache? Send a query, but nothing we can do right now
-				if(!m_cache.LookupAndExpiryCheck(destmac, dest, expiry))
-				{
-					if(arp)
-						arp->SendQuery(dest);
-					return nullptr;
-				}
-
-				//In cache, but expiring soon? Send a query to refresh the cache entry
-				else if(expiry < 15)
-				{
-					if(arp)
-						arp->SendQuery(dest);
-				}
-
-				break;
-
-			//invalid destination (can't send to ourself)
-			default:
-				return nullptr;
+			mac = n.m_mac;
+			n.m_lastUsed = m_eth.GetTimeMs();
+			return true;
 		}
 	}
+	return false;
+}
+
+/**
+	@brief Asks the link where an address is, unless we did so very recently
+
+	The answer is learned by OnRxPacket() like any other unicast to us.
+ */
+void IPv6Protocol::SolicitNeighbor(const IPv6Address& ip)
+{
+	if(!m_icmpv6)
+		return;
+
+	auto now = m_eth.GetTimeMs();
+	if( (ip == m_lastSolicitTarget) &&
+		!MonotonicClock::IsExpired(now, m_lastSolicitTime + IPV6_NEIGHBOR_SOLICIT_INTERVAL_MS) )
+	{
+		return;
+	}
+
+	m_lastSolicitTarget = ip;
+	m_lastSolicitTime = now;
+	m_icmpv6->SendNeighborSolicitation(ip);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handler for outbound packets
+
+/**
+	@brief Allocates an outbound packet and prepare to send it
+
+	Unicasts go to the MAC we last heard the destination from, or failing that to the default router. If neither is
+	known yet, sends a neighbor solicitation for the destination and returns nullptr. The caller should retry later.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+IPv6Packet* IPv6Protocol::GetTxPacket(const IPv6Address& dest, ipproto_t proto, txclass_t txclass)
+{
+	//Find target MAC address
+	MACAddress destmac;
+	if(dest.m_octets[0] == 0xff)
+	{
+		//Multicasts map to 33:33 plus the low 32 bits of the group address
+		destmac = MACAddress{{0x33, 0x33, dest.m_octets[12], dest.m_octets[13], dest.m_octets[14], dest.m_octets[15]}};
+	}
+	else if(!LookupNeighbor(destmac, dest) && !LookupNeighbor(destmac, m_config.m_gateway))
+	{
+		SolicitNeighbor(dest);
+		return nullptr;
+	}
 
 	//Allocate the frame and fill headers
-	auto frame = m_eth.GetTxFrame(ETHERTYPE_IPV4, destmac);
+	auto frame = m_eth.GetTxFrame(ETHERTYPE_IPV6, destmac, txclass);
 	if(!frame)
 		return nullptr;
 
 	auto reply = reinterpret_cast<IPv6Packet*>(frame->Payload());
-	reply->m_versionAndHeaderLen = 0x45;
-	reply->m_dscpAndECN = 0;
-	reply->m_fragID = 0;
-	reply->m_flagsFragOffHigh = 0x40;	//DF
-	reply->m_fragOffLow = 0;
-	reply->m_ttl = 0xff;
-	reply->m_protocol = proto;
-	reply->m_sourceAddress = m_config.m_address;
+	reply->m_versionTrafficClassFlowLabel = 0x60000000;
+	reply->m_payloadLength = 0;
+	reply->m_nextHeader = proto;
+	reply->m_hopLimit = 0xff;
+	if(IsLinkLocal(dest))
+		reply->m_sourceAddress = m_linkLocalAddress;
+	else
+		reply->m_sourceAddress = m_config.m_address;
 	reply->m_destAddress = dest;
-	reply->m_headerChecksum = 0;
 
 	//Done
 	return reply;
 }
-*/
 
 /**
 	@brief Sends a packet to the driver
 
 	The packet MUST have been allocated by GetTxPacket().
  */
-/*
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
@@ -385,20 +472,17 @@ void IPv6Protocol::SendTxPacket(IPv6Packet* packet, size_t upperLayerLength, boo
 	auto frame = reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET);
 
 	//Update length in both IP header and Ethernet frame metadata
-	packet->m_totalLength = packet->HeaderLength() + upperLayerLength;
-	frame->SetPayloadLength(packet->m_totalLength);
+	packet->m_payloadLength = upperLayerLength;
+	frame->SetPayloadLength(sizeof(IPv6Packet) + upperLayerLength);
 
-	//Final fixup of checksum and byte ordering before sending it out
+	//No header checksum in IPv6, just fix byte ordering before sending it out
 	packet->ByteSwap();
-	packet->m_headerChecksum = ~__builtin_bswap16(InternetChecksum(reinterpret_cast<uint8_t*>(packet), 20));
 	m_eth.SendTxFrame(frame, markFree);
 }
-*/
 
 /**
 	@brief Re-sends a packet without touching the checksums or doing any byte swapping etc
  */
-/*
 void IPv6Protocol::ResendTxPacket(IPv6Packet* packet, bool markFree)
 {
 	//Get the full frame given the packet
@@ -408,4 +492,3 @@ void IPv6Protocol::ResendTxPacket(IPv6Packet* packet, bool markFree)
 	//Send it
 	m_eth.ResendTxFrame(frame, markFree);
 }
-*/
@@ -40,13 +40,14 @@
 #include "IPv6Packet.h"
 #include "../IPProtocols.h"
 
-/*
-inline bool operator!= (const IPv6Address& a, const IPv6Address& b)
-{ return a.m_word != b.m_word; }
-
 inline bool operator== (const IPv6Address& a, const IPv6Address& b)
-{ return a.m_word == b.m_word; }
-*/
+{
+	return	(a.m_words[0] == b.m_words[0]) && (a.m_words[1] == b.m_words[1]) &&
+			(a.m_words[2] == b.m_words[2]) && (a.m_words[3] == b.m_words[3]);
+}
+
+inline bool operator!= (const IPv6Address& a, const IPv6Address& b)
+{ return !(a == b); }
 
 /**
 	@brief IPv6 address configuration
@@ -64,7 +65,31 @@ class ICMPv6Protocol;
 class TCPProtocol;
 class UDPProtocol;
 
-//#define IPV4_PAYLOAD_MTU (ETHERNET_PAYLOAD_MTU - 20)
+#define IPV6_PAYLOAD_MTU (ETHERNET_PAYLOAD_MTU - 40)
+
+//Number of (IP, MAC) associations remembered for outbound IPv6 traffic
+#ifndef IPV6_NEIGHBOR_CACHE_SIZE
+#define IPV6_NEIGHBOR_CACHE_SIZE 8
+#endif
+
+//Minimum time between neighbor solicitations for the same address, in ms
+#ifndef IPV6_NEIGHBOR_SOLICIT_INTERVAL_MS
+#define IPV6_NEIGHBOR_SOLICIT_INTERVAL_MS 1000
+#endif
+
+/**
+	@brief A single entry in the IPv6 neighbor cache
+ */
+class IPv6NeighborEntry
+{
+public:
+	bool m_valid;
+	IPv6Address m_ip;
+	MACAddress m_mac;
+
+	///@brief Timestamp of the last time this entry was learned or looked up, for LRU eviction
+	uint32_t m_lastUsed;
+};
 
 /**
 	@brief IPv6 protocol driver
@@ -82,25 +107,32 @@ public:
 	void SetAllowUnknownUnicasts(bool allow)
 	{ m_allowUnknownUnicasts = allow; }
 
-	/*
-	IPv6Packet* GetTxPacket(IPv6Address dest, ipproto_t proto);
+	bool IsTxBufferAvailable(txclass_t txclass = TX_CLASS_NORMAL)
+	{ return m_eth.IsTxBufferAvailable(txclass); }
+
+	IPv6Packet* GetTxPacket(const IPv6Address& dest, ipproto_t proto, txclass_t txclass = TX_CLASS_NORMAL);
 	void SendTxPacket(IPv6Packet* packet, size_t upperLayerLength, bool markFree = true);
 	void ResendTxPacket(IPv6Packet* packet, bool markFree = false);
-	*/
 
 	///@brief Cancels sending of a packet
 	void CancelTxPacket(IPv6Packet* packet)
 	{ m_eth.CancelTxFrame(reinterpret_cast<EthernetFrame*>(reinterpret_cast<uint8_t*>(packet) - ETHERNET_PAYLOAD_OFFSET)); }
 
-	void OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength);
+	void OnRxPacket(IPv6Packet* packet, uint16_t ethernetPayloadLength, const MACAddress& srcmac);
 
 	void OnLinkUp();
 	void OnLinkDown();
-	/*
 	void OnAgingTick();
 	void OnAgingTick10x();
-	*/
-	uint16_t PseudoHeaderChecksum(IPv6Packet* packet);
+	void OnTimer();
+	uint32_t GetNextDeadline();
+	void OnTxSpaceAvailable();
+
+	uint16_t PseudoHeaderChecksum(IPv6Packet* packet, uint16_t length);
+
+	void LearnNeighbor(const MACAddress& mac, const IPv6Address& ip);
+	bool LookupNeighbor(MACAddress& mac, const IPv6Address& ip);
+	void SolicitNeighbor(const IPv6Address& ip);
 
 	enum AddressType
 	{
@@ -111,26 +143,43 @@ public:
 
 	void UseICMPv6(ICMPv6Protocol* icmpv6)
 	{ m_icmpv6 = icmpv6; }
-	/*
+
+	/**
+		@brief Attaches a TCP stack
+
+		The same TCPProtocol may also be attached to an IPv4Protocol for dual-stack operation. In that case its timers
+		are driven from the IPv4 side only.
+	 */
 	void UseTCP(TCPProtocol* tcp)
 	{ m_tcp = tcp; }
 
+	/*
 	void UseUDP(UDPProtocol* udp)
 	{ m_udp = udp; }
 	*/
 
-	AddressType GetAddressType(IPv6Address addr);
-	/*
-	bool IsLocalSubnet(IPv6Address addr);
+	AddressType GetAddressType(const IPv6Address& addr);
+
+	///@brief Checks if an address is link-local unicast (fe80::/10) or link-local multicast (ff02::/16)
+	static bool IsLinkLocal(const IPv6Address& addr)
+	{
+		return	( (addr.m_octets[0] == 0xfe) && ( (addr.m_octets[1] & 0xc0) == 0x80) ) ||
+				( (addr.m_octets[0] == 0xff) && ( (addr.m_octets[1] & 0x0f) == 0x02) );
+	}
 
 	EthernetProtocol* GetEthernet()
 	{ return &m_eth; }
 
-	IPv6Address GetOurAddress()
+	const IPv6Address& GetOurAddress()
 	{ return m_config.m_address; }
 
+	///@brief Gets our link-local address (derived from the MAC address)
+	const IPv6Address& GetLinkLocalAddress()
+	{ return m_linkLocalAddress; }
+
 protected:
-	*/
+	bool HasTCPTimers();
+
 	///@brief The Ethernet protocol stack
 	EthernetProtocol& m_eth;
 
@@ -139,16 +188,35 @@ protected:
 
 	///@brief ICMPv6 protocol
 	ICMPv6Protocol* m_icmpv6;
-	/*
+
 	///@brief TCP protocol
 	TCPProtocol* m_tcp;
 
+	/*
 	///@brief UDP protocol
 	UDPProtocol* m_udp;
 	*/
 
 	///@brief True to forward unicasts to unknown addresses to us
 	bool m_allowUnknownUnicasts;
+
+	///@brief Our EUI-64 based link-local address
+	IPv6Address m_linkLocalAddress;
+
+	/**
+		@brief Neighbor cache
+
+		Entries are learned passively from the source MAC of unicast packets sent to us (or the link-layer address
+		option of neighbor solicitations), so for hosts off the local link this holds the MAC of the router which
+		forwarded their traffic to us. That's exactly where replies need to go.
+	 */
+	IPv6NeighborEntry m_neighbors[IPV6_NEIGHBOR_CACHE_SIZE];
+
+	///@brief The address we last sent a neighbor solicitation for
+	IPv6Address m_lastSolicitTarget;
+
+	///@brief Timestamp of the last neighbor solicitation we sent
+	uint32_t m_lastSolicitTime;
 };
 
 #endif
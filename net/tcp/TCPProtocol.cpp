@@ -30,12 +30,44 @@
 #include <staticnet-config.h>
 #include <staticnet/stack/staticnet.h>
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
 
-TCPProtocol::TCPProtocol(IPv4Protocol* ipv4)
+/**
+	@brief Initializes the TCP stack
+
+	Either network layer may be null for a single-stack configuration, but not both. For dual-stack operation, attach
+	this object to both IPv4Protocol and IPv6Protocol with UseTCP().
+ */
+TCPProtocol::TCPProtocol(IPv4Protocol* ipv4, IPv6Protocol* ipv6)
 	: m_ipv4(ipv4)
+	, m_ipv6(ipv6)
+	, m_eth(ipv4 ? ipv4->GetEthernet() : ipv6->GetEthernet())
+	, m_lastHitState(nullptr)
+	, m_segmentFreeList(nullptr)
+	, m_segmentSlotsFree(TCP_SEGMENT_POOL_SIZE)
+	, m_segmentSlotsReserved(0)
+	, m_nextEphemeralPort(0)
+	, m_shardIndex(0)
+	, m_shardCount(1)
+	, m_deferAcks(false)
+	, m_deferredAckCount(0)
 {
+	for(size_t line=0; line<TCP_TABLE_LINES; line++)
+	{
+		for(size_t way=0; way<TCP_TABLE_WAYS; way++)
+			m_socketKeys[line].m_ways[way].m_localPort = 0;
+	}
+
+	for(size_t i=0; i<TCP_SEGMENT_POOL_SIZE; i++)
+	{
+		m_segmentPool[i].m_next = m_segmentFreeList;
+		m_segmentFreeList = &m_segmentPool[i];
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -46,83 +78,813 @@ __attribute__((section(".tcmtext")))
 #endif
 TCPSegment* TCPProtocol::GetTxSegment(TCPTableEntry* state)
 {
+	//Don't allocate a segment the peer has no room to receive (the persist timer will find out when it has)
+	if(!IsSendWindowOpen(state))
+	{
+		state->m_txBlocked = true;
+		return nullptr;
+	}
+
 	//Make sure we have space in the outbox for it
-	bool ok = false;
-	for(size_t i=0; i<TCP_MAX_UNACKED; i++)
+	if(!ClaimSegmentSlot(state))
+	{
+		state->m_txBlocked = true;
+		return nullptr;
+	}
+
+	//Allocate the frame and fail if we couldn't allocate one
+	auto segment = CreateReply(state, state->m_txClass);
+	if(!segment)
+	{
+		ReleaseSegmentSlot(state);
+		state->m_txBlocked = true;
+		return nullptr;
+	}
+
+	//All good
+	return segment;
+}
+
+/**
+	@brief Checks if the next call to GetTxSegment() on this socket will succeed
+
+	If not, OnTxSpaceAvailable() will be called for this socket once a retransmit slot or TX frame is freed, or the
+	remote side's receive window opens up.
+ */
+bool TCPProtocol::IsTxBufferAvailable(TCPTableEntry* state)
+{
+	//Same checks as ClaimSegmentSlot(), but without claiming anything
+	size_t inUse = state->m_txSegmentsAllocated + state->m_unackedCount;
+	bool slotAvailable =
+		(inUse < state->m_maxSegments) &&
+		( (inUse < state->m_minSegments) || (m_segmentSlotsFree > m_segmentSlotsReserved) );
+
+	if(!slotAvailable || !m_eth->IsTxBufferAvailable(state->m_txClass) || !IsSendWindowOpen(state))
+	{
+		state->m_txBlocked = true;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Checks if the remote side's receive window has room for another segment on this socket
+
+	Segments which have been allocated but not sent yet are assumed to be full sized. If the window is closed, the
+	persist timer is started so we find out when it opens again.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool TCPProtocol::IsSendWindowOpen(TCPTableEntry* state)
+{
+	uint32_t mss = GetMaxSegmentSize(state);
+	uint32_t pending = state->m_txSegmentsAllocated * mss;
+
+	//Wait until there's room for a full segment, or the whole window if the peer's buffer is smaller than that.
+	//Trickling out tiny segments as the window opens a few bytes at a time just wastes frames
+	uint32_t needed = mss;
+	if(state->m_remoteWindow < needed)
+		needed = state->m_remoteWindow;
+	if( (needed > 0) && (GetSendWindow(state) >= (pending + needed) ) )
+		return true;
+
+	if(!state->m_persistInterval)
 	{
-		if(state->m_unackedFrames[i].m_segment == nullptr)
+		state->m_persistInterval = TCP_RETRANSMIT_TIMEOUT_MS;
+		state->m_persistTime = GetTimeMs() + state->m_persistInterval;
+	}
+	return false;
+}
+
+/**
+	@brief Sends a TCP segment on a given socket handle
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::SendTxSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t payloadLength)
+{
+	SendDataSegment(state, segment, payloadLength, true);
+}
+
+/**
+	@brief Sends a data segment, optionally freeing the frame right away rather than keeping it for retransmits
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::SendDataSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t payloadLength, bool pin)
+{
+	//Anything buffered by Write() was written before this segment, so it has to go out first
+	if(state->m_coalesceSegment && (state->m_coalesceSegment != segment) )
+		Flush(state);
+
+	//The segment may have been allocated a while ago and other data sent since then,
+	//so fill in sequence and ACK numbers as of now
+	segment->m_sequence = state->m_localSeq;
+	segment->m_ack = state->m_remoteSeq;
+
+	//Update the socket state to expect a new ACK number in response to this segment
+	state->m_localSeq += payloadLength;
+
+	//Add the PSH flag since this segment contains data
+	segment->m_offsetAndFlags |= TCPSegment::FLAG_PSH;
+
+	//Ready to send
+	SendSegment(state, segment, payloadLength + sizeof(TCPSegment), pin);
+}
+
+void TCPProtocol::CancelTxSegment(TCPSegment* segment, TCPTableEntry* state)
+{
+	if(state->m_coalesceSegment == segment)
+		state->m_coalesceSegment = nullptr;
+
+	//Remove the segment from the list of unacked frames
+	bool found = false;
+	TCPSentSegment* prev = nullptr;
+	for(auto f = state->m_unackedHead; f; f = f->m_next)
+	{
+		if(f->m_segment == segment)
 		{
-			ok = true;
+			FreeUnackedSegment(state, prev, f, false);
+			found = true;
 			break;
 		}
+		prev = f;
+	}
+
+	//If it was never sent, release the retransmit slot reserved for it
+	if(!found && state->m_txSegmentsAllocated)
+	{
+		state->m_txSegmentsAllocated --;
+		ReleaseSegmentSlot(state);
+	}
+
+	//Cancel the packet in the network layer
+	CancelPacket(segment, state->m_isIPv6);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Large send API
+
+/**
+	@brief Sends a buffer of arbitrary size, splitting it into MSS-sized segments
+
+	As many segments as the TX buffers and retransmit slots allow are sent immediately. The rest are sent automatically
+	as ACKs come in and free up space. OnSendComplete() is called once the last byte has been copied into a frame, or
+	in unpinned mode (see SetUnpinnedSend()) once the last byte has been ACKed.
+
+	The buffer is owned by the stack until OnSendComplete() is called (or the connection closes), and must not be
+	modified or freed before then.
+
+	Only one Send() may be in progress on a socket at a time. Returns false if one is already in progress, or the socket
+	is not connected or is being closed.
+ */
+bool TCPProtocol::Send(TCPTableEntry* state, const uint8_t* data, uint32_t len)
+{
+	if(!state->m_valid || state->m_sendData || state->m_closePending ||
+		(state->m_state != TCPTableEntry::STATE_ESTABLISHED) )
+	{
+		return false;
+	}
+
+	state->m_sendData = data;
+	state->m_sendLength = len;
+	state->m_sendOffset = 0;
+
+	ContinueSend(state);
+	return true;
+}
+
+/**
+	@brief Sends as much pending Send() data on a socket as we have buffers for
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::ContinueSend(TCPTableEntry* state)
+{
+	//Nothing new may be sent once our FIN is out (but an unpinned send may still complete, below)
+	bool open = (state->m_state == TCPTableEntry::STATE_ESTABLISHED);
+	if(state->m_streaming)
+	{
+		if(open)
+			ContinueStream(state);
+		return;
+	}
+
+	auto mss = GetMaxSegmentSize(state);
+	while(open && state->m_sendData && (state->m_sendOffset < state->m_sendLength) )
+	{
+		//Stop if we're out of buffers or retransmit slots, we'll resume when an ACK comes in
+		auto segment = GetTxSegment(state);
+		if(!segment)
+			return;
+
+		uint32_t offset = state->m_sendOffset;
+		uint32_t chunk = state->m_sendLength - offset;
+		if(chunk > mss)
+			chunk = mss;
+		uint32_t window = GetSendWindow(state);
+		if(chunk > window)
+			chunk = window;
+
+		memcpy(segment->Payload(), state->m_sendData + offset, chunk);
+		state->m_sendOffset += chunk;
+		SendDataSegment(state, segment, chunk, !state->m_unpinnedSend);
+
+		//The segment we just sent is now at the tail of the unacked list.
+		//Remember where its data came from so we can regenerate it for a retransmit.
+		if(state->m_unpinnedSend)
+			state->m_unackedTail->m_dataOffset = offset;
+	}
+
+	//The application closed the socket while we were sending. Now that the last byte is out, the FIN can follow it
+	if(state->m_closePending && state->m_sendData && (state->m_sendOffset == state->m_sendLength) )
+	{
+		state->m_closePending = false;
+		CloseSocket(state);
+	}
+
+	//Unpinned segments are retransmitted from the buffer, so hold on to it until everything is ACKed
+	if(state->m_unpinnedSend && HasUnpinnedData(state))
+		return;
+
+	//Everything is segmented, release the buffer.
+	//Clear state before the callback so it can start another Send() immediately
+	if(state->m_sendData)
+	{
+		state->m_sendData = nullptr;
+		OnSendComplete(state);
+	}
+}
+
+/**
+	@brief Checks if any segments sent by an unpinned Send() are still waiting to be ACKed
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool TCPProtocol::HasUnpinnedData(TCPTableEntry* state)
+{
+	for(auto f = state->m_unackedHead; f; f = f->m_next)
+	{
+		if(!f->m_segment)
+			return true;
 	}
-	if(!ok)
+	return false;
+}
+
+/**
+	@brief Retransmits a segment sent by an unpinned Send(), copying the payload from the Send() buffer again
+
+	If no TX frame is available, the retransmit is skipped and will be retried after the next timeout.
+ */
+void TCPProtocol::RegenerateSegment(TCPTableEntry* state, TCPSentSegment* seg)
+{
+	auto segment = CreateReply(state, state->m_txClass);
+	if(!segment)
+		return;
+
+	//Same sequence number and payload as the original, but current ACK number
+	segment->m_sequence = seg->m_sequence;
+	segment->m_offsetAndFlags |= TCPSegment::FLAG_PSH;
+	memcpy(segment->Payload(), state->m_sendData + seg->m_dataOffset, seg->m_length);
+
+	TransmitSegment(state, segment, seg->m_length + sizeof(TCPSegment), true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Outbound connections
+
+/**
+	@brief Opens a connection to a remote host, over IPv4 or IPv6 depending on the address type
+
+	If localPort is zero, an ephemeral port is chosen automatically.
+
+	Returns the new socket handle, or nullptr if no socket or port could be allocated. The connection is not usable
+	until OnConnected() is called. If the remote side does not respond within TCP_CONNECT_TIMEOUT_MS, or refuses the
+	connection, OnConnectionClosed() is called instead.
+ */
+TCPTableEntry* TCPProtocol::Connect(const TCPRemoteAddress& ip, uint16_t remotePort, uint16_t localPort)
+{
+	//Pick a local port, or make sure the one we were given isn't already in use for this peer
+	if(localPort == 0)
+	{
+		localPort = AllocateEphemeralPort(ip, remotePort);
+		if(localPort == 0)
+			return nullptr;
+	}
+	else if(GetSocketState(ip, localPort, remotePort))
 		return nullptr;
 
-	//Allocate the frame and fail if we couldn't allocate one
-	auto reply = CreateReply(state);
-	if(!reply)
+	auto state = AllocateSocketHandle(ip, localPort, remotePort);
+	if(state == nullptr)
 		return nullptr;
 
-	//All good, allocate the reply
-	return reinterpret_cast<TCPSegment*>(reply->Payload());
+	//Fill out the initial table entry. We don't know anything about the remote side until it replies
+	state->m_localSeq = GenerateInitialSequenceNumber();
+	state->m_localInitialSeq = state->m_localSeq;
+	state->m_remoteSeq = 0;
+	state->m_remoteInitialSeq = 0;
+	state->m_remoteMSS = TCP_DEFAULT_MSS;
+	state->m_remoteWindow = 0;
+	state->m_sendWindowEdge = state->m_localSeq;
+	EnterState(state, TCPTableEntry::STATE_SYN_SENT);
+
+	//Send the SYN (which counts as a byte in the stream).
+	//If we're out of TX buffers, it goes out on the next aging tick
+	state->m_localSeq ++;
+	SendSYN(state);
+
+	return state;
+}
+
+/**
+	@brief Picks a local port for an outbound connection which isn't in use for the given remote endpoint
+
+	Ports are handed out sequentially from a random starting point in the ephemeral range, skipping any which would
+	create a flow owned by another shard. Returns zero if every port is taken.
+ */
+uint16_t TCPProtocol::AllocateEphemeralPort(const TCPRemoteAddress& ip, uint16_t remotePort)
+{
+	const uint32_t range = TCP_EPHEMERAL_PORT_MAX - TCP_EPHEMERAL_PORT_MIN + 1;
+	if(m_nextEphemeralPort == 0)
+		m_nextEphemeralPort = TCP_EPHEMERAL_PORT_MIN + (GenerateInitialSequenceNumber() % range);
+
+	for(uint32_t i=0; i<range; i++)
+	{
+		uint16_t port = m_nextEphemeralPort;
+		if(m_nextEphemeralPort == TCP_EPHEMERAL_PORT_MAX)
+			m_nextEphemeralPort = TCP_EPHEMERAL_PORT_MIN;
+		else
+			m_nextEphemeralPort ++;
+
+		if(GetSocketState(ip, port, remotePort))
+			continue;
+		if( (m_shardCount > 1) && (GetFlowShard(ip.m_key, port, remotePort, m_shardCount) != m_shardIndex) )
+			continue;
+		return port;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Streaming API
+
+/**
+	@brief Starts sending data pulled from the application, for uploads too big (or too open-ended) to pass to Send()
+
+	OnStreamData() is called to fill each segment as soon as the remote side's window, retransmit slots and TX buffers
+	allow, and again as ACKs come in, so the pipe stays full without the data having to be buffered up front.
+
+	If OnStreamData() returns zero because no data is ready, streaming pauses. Call StartStream() again to resume
+	once there is. To finish the upload, call CloseSocket() from OnStreamData() and return zero.
+
+	Returns false if the socket is not connected or a Send() is in progress.
+ */
+bool TCPProtocol::StartStream(TCPTableEntry* state)
+{
+	if(!state->m_valid || state->m_sendData || (state->m_state != TCPTableEntry::STATE_ESTABLISHED) )
+		return false;
+
+	state->m_streaming = true;
+	ContinueStream(state);
+	return true;
+}
+
+/**
+	@brief Fills and sends as many segments from OnStreamData() as we have buffers and window for
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::ContinueStream(TCPTableEntry* state)
+{
+	auto mss = GetMaxSegmentSize(state);
+	while(state->m_streaming)
+	{
+		//Stop if we're out of buffers, retransmit slots, or window. We'll resume when an ACK comes in
+		auto segment = GetTxSegment(state);
+		if(!segment)
+			return;
+
+		uint16_t maxLength = mss;
+		uint32_t window = GetSendWindow(state);
+		if(window < maxLength)
+			maxLength = window;
+
+		//Nothing ready (or the application closed the socket), pause until StartStream() is called again
+		auto len = OnStreamData(state, segment->Payload(), maxLength);
+		if(len == 0)
+		{
+			state->m_streaming = false;
+			CancelTxSegment(segment, state);
+			return;
+		}
+
+		SendTxSegment(state, segment, len);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Small write coalescing
+
+/**
+	@brief Writes data to a socket, merging small writes into as few segments as possible
+
+	Uses the Nagle algorithm: if nothing is in flight, the data is sent right away. Otherwise it's held in a partially
+	filled segment until either a full MSS worth of data is buffered, everything in flight has been ACKed, or Flush()
+	is called. Sockets which are only ever written to with SendTxSegment() or Send() are not affected.
+
+	Returns the number of bytes accepted, which may be less than len if we ran out of TX buffers or retransmit slots.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+uint32_t TCPProtocol::Write(TCPTableEntry* state, const uint8_t* data, uint32_t len)
+{
+	if(!state->m_valid)
+		return 0;
+
+	auto mss = GetMaxSegmentSize(state);
+	uint32_t done = 0;
+	while(done < len)
+	{
+		//Start a new segment if we don't have one
+		if(!state->m_coalesceSegment)
+		{
+			state->m_coalesceSegment = GetTxSegment(state);
+			if(!state->m_coalesceSegment)
+				break;
+			state->m_coalesceLength = 0;
+		}
+
+		//Append as much as will fit
+		uint32_t chunk = len - done;
+		if(chunk > (uint32_t)(mss - state->m_coalesceLength))
+			chunk = mss - state->m_coalesceLength;
+		memcpy(state->m_coalesceSegment->Payload() + state->m_coalesceLength, data + done, chunk);
+		state->m_coalesceLength += chunk;
+		done += chunk;
+
+		//Full segments always go out immediately
+		if(state->m_coalesceLength >= mss)
+			Flush(state);
+	}
+
+	//Nothing in flight? No point in waiting
+	if(!HasUnackedData(state))
+		Flush(state);
+
+	return done;
+}
+
+/**
+	@brief Sends any data buffered by Write() immediately
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::Flush(TCPTableEntry* state)
+{
+	auto segment = state->m_coalesceSegment;
+	if(!segment)
+		return;
+
+	//Clear state first since SendTxSegment() flushes anything pending
+	state->m_coalesceSegment = nullptr;
+	SendTxSegment(state, segment, state->m_coalesceLength);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Retransmit slot pool
+
+/**
+	@brief Changes how many retransmit slots a socket is guaranteed, and how many it may use at most
+
+	For example, a bulk transfer can be allowed to use a large share of the pool while interactive sessions keep
+	the default. Returns false (and changes nothing) if the pool doesn't have enough unreserved slots left.
+ */
+bool TCPProtocol::SetSegmentLimits(TCPTableEntry* state, uint8_t minSegments, uint8_t maxSegments)
+{
+	if(minSegments > maxSegments)
+		return false;
+
+	//Figure out how much of the socket's reservation is not currently in use, before and after
+	size_t inUse = state->m_txSegmentsAllocated + state->m_unackedCount;
+	size_t oldReserve = (state->m_minSegments > inUse) ? (state->m_minSegments - inUse) : 0;
+	size_t newReserve = (minSegments > inUse) ? (minSegments - inUse) : 0;
+	size_t unreserved = m_segmentSlotsFree - m_segmentSlotsReserved;
+	if( (newReserve > oldReserve) && (unreserved < (newReserve - oldReserve) ) )
+		return false;
+
+	m_segmentSlotsReserved = m_segmentSlotsReserved - oldReserve + newReserve;
+	state->m_minSegments = minSegments;
+	state->m_maxSegments = maxSegments;
+	return true;
+}
+
+/**
+	@brief Claims a retransmit slot for a segment about to be allocated on a socket
+
+	Sockets below their minimum use their own reservation, anything beyond that comes from the unreserved part of the
+	pool, up to the socket's maximum.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool TCPProtocol::ClaimSegmentSlot(TCPTableEntry* state)
+{
+	size_t inUse = state->m_txSegmentsAllocated + state->m_unackedCount;
+	if(inUse >= state->m_maxSegments)
+		return false;
+
+	if(inUse < state->m_minSegments)
+		m_segmentSlotsReserved --;
+	else if(m_segmentSlotsFree <= m_segmentSlotsReserved)
+		return false;
+
+	m_segmentSlotsFree --;
+	state->m_txSegmentsAllocated ++;
+	return true;
+}
+
+/**
+	@brief Releases a slot claimed by ClaimSegmentSlot(), after the caller has decremented the socket's usage count
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::ReleaseSegmentSlot(TCPTableEntry* state)
+{
+	m_segmentSlotsFree ++;
+
+	size_t inUse = state->m_txSegmentsAllocated + state->m_unackedCount;
+	if(inUse < state->m_minSegments)
+		m_segmentSlotsReserved ++;
+}
+
+/**
+	@brief Removes a segment from a socket's list of un-ACKed segments and returns it to the pool
+
+	@param state		The socket
+	@param prev			The entry before seg in the list, or null if seg is the head
+	@param seg			The entry to remove
+	@param freeFrame	If true, free the frame as well (if the segment still has one)
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::FreeUnackedSegment(TCPTableEntry* state, TCPSentSegment* prev, TCPSentSegment* seg, bool freeFrame)
+{
+	if(prev)
+		prev->m_next = seg->m_next;
+	else
+		state->m_unackedHead = seg->m_next;
+	if(state->m_unackedTail == seg)
+		state->m_unackedTail = prev;
+
+	if(freeFrame && seg->m_segment)
+		CancelPacket(seg->m_segment, state->m_isIPv6);
+
+	seg->m_segment = nullptr;
+	seg->m_next = m_segmentFreeList;
+	m_segmentFreeList = seg;
+
+	state->m_unackedCount --;
+	ReleaseSegmentSlot(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handle aging of packets
+
+/**
+	@brief Called at 1 Hz to handle keepalives, idle timeouts, and connections which are being closed
+
+	Sockets whose peer has vanished are aborted, so their table entries, retransmit slots and upper layer state can be
+	reused.
+ */
+void TCPProtocol::OnAgingTick()
+{
+	auto now = GetTimeMs();
+
+	for(size_t line=0; line<TCP_TABLE_LINES; line++)
+	{
+		for(size_t way=0; way<TCP_TABLE_WAYS; way++)
+		{
+			auto& sock = m_socketState[line][way];
+			if(!sock.m_valid)
+				continue;
+
+			switch(sock.m_state)
+			{
+				//Waiting for the remote side to accept our connection. Resend the SYN until it does, or give up
+				case TCPTableEntry::STATE_SYN_SENT:
+					if(MonotonicClock::IsExpired(now, sock.m_stateTime + TCP_CONNECT_TIMEOUT_MS))
+						AbortSocket(&sock);
+					else
+						SendSYN(&sock);
+					break;
+
+				case TCPTableEntry::STATE_ESTABLISHED:
+					{
+						uint32_t idle = now - sock.m_lastRxTime;
+
+						//Peer is alive but hasn't sent anything in too long
+						if(sock.m_idleTimeout && (idle >= sock.m_idleTimeout) )
+						{
+							AbortSocket(&sock);
+							break;
+						}
+
+						//Probe the peer if we haven't heard from it in a while, and give up if it doesn't answer.
+						//If there's data in flight the retransmits act as probes, so no need to send one
+						if(!TCP_KEEPALIVE_IDLE_MS)
+							break;
+						uint32_t nextProbe = TCP_KEEPALIVE_IDLE_MS + sock.m_keepalivesSent * TCP_KEEPALIVE_INTERVAL_MS;
+						if(idle >= nextProbe)
+						{
+							if(sock.m_keepalivesSent >= TCP_KEEPALIVE_PROBES)
+							{
+								AbortSocket(&sock);
+								break;
+							}
+
+							if(!HasUnackedData(&sock))
+								SendProbe(&sock);
+							sock.m_keepalivesSent ++;
+						}
+					}
+					break;
+
+				//Waiting on the peer to ACK our FIN. Resend it if it was lost
+				case TCPTableEntry::STATE_FIN_WAIT_1:
+				case TCPTableEntry::STATE_LAST_ACK:
+					if(MonotonicClock::IsExpired(now, sock.m_stateTime + TCP_FIN_TIMEOUT_MS))
+						AbortSocket(&sock);
+					else
+						SendFIN(&sock);
+					break;
+
+				//Waiting on the peer to close its side. It may still be sending data, so only time out if it goes quiet
+				case TCPTableEntry::STATE_FIN_WAIT_2:
+					if(MonotonicClock::IsExpired(now, sock.m_lastRxTime + TCP_FIN_TIMEOUT_MS))
+						AbortSocket(&sock);
+					break;
+
+				//Done lingering
+				case TCPTableEntry::STATE_TIME_WAIT:
+					if(MonotonicClock::IsExpired(now, sock.m_stateTime + TCP_TIME_WAIT_MS))
+						FreeSocketHandle(&sock);
+					break;
+			}
+		}
+	}
+}
+
+/**
+	@brief Called at 10 Hz to determine if we need to retransmit anything
+
+	The default implementation calls OnTimer(). EthernetProtocol::OnTimer() still calls this every 100ms when running
+	tickless, so overrides must call the base class implementation to keep retransmits working.
+ */
+void TCPProtocol::OnAgingTick10x()
+{
+	OnTimer();
+}
+
+/**
+	@brief Checks for segments whose retransmit deadline has passed and resends them
+ */
+void TCPProtocol::OnTimer()
+{
+	auto now = GetTimeMs();
+
+	//Go through all open sockets and look to see if we have anything due to retransmit
+	for(size_t line=0; line<TCP_TABLE_LINES; line++)
+	{
+		for(size_t way=0; way<TCP_TABLE_WAYS; way++)
+		{
+			auto& sock = m_socketState[line][way];
+			if(!sock.m_valid)
+				continue;
+
+			//The peer's receive window is closed and we have data waiting. Probe it so we hear about the window
+			//opening even if the window update is lost, backing off while it stays closed.
+			//If data is in flight, its retransmits do the job instead
+			if(sock.m_persistInterval && MonotonicClock::IsExpired(now, sock.m_persistTime))
+			{
+				if(IsSendWindowOpen(&sock))
+				{
+					sock.m_persistInterval = 0;
+					OnTxSpaceAvailable(&sock);
+				}
+				else
+				{
+					if(!HasUnackedData(&sock))
+						SendProbe(&sock);
+
+					sock.m_persistInterval *= 2;
+					if(sock.m_persistInterval > TCP_RETRANSMIT_TIMEOUT_MAX_MS)
+						sock.m_persistInterval = TCP_RETRANSMIT_TIMEOUT_MAX_MS;
+					sock.m_persistTime = now + sock.m_persistInterval;
+				}
+			}
+
+			//If a large send or stream stalled because we ran out of TX buffers (rather than waiting for ACKs), retry it
+			if(sock.m_sendData || sock.m_streaming)
+				ContinueSend(&sock);
+
+			bool retransmitted = false;
+			for(auto f = sock.m_unackedHead; f; f = f->m_next)
+			{
+				//Segment has aged out, resend it
+				if(MonotonicClock::IsExpired(now, f->m_sendTime + sock.m_rto))
+				{
+					retransmitted = true;
+					f->m_sendTime = now;
+					if(f->m_segment)
+						ResendPacket(f->m_segment, sock.m_isIPv6);
+					else
+						RegenerateSegment(&sock, f);
+				}
+			}
+
+			//Back off until we get an ACK, so a slow or unreachable peer doesn't get flooded with retransmits
+			if(retransmitted)
+			{
+				sock.m_rto *= 2;
+				if(sock.m_rto > TCP_RETRANSMIT_TIMEOUT_MAX_MS)
+					sock.m_rto = TCP_RETRANSMIT_TIMEOUT_MAX_MS;
+			}
+		}
+	}
 }
 
-void TCPProtocol::CancelTxSegment(TCPSegment* segment, TCPTableEntry* state)
+/**
+	@brief Called when TX frames have been freed, to wake up any sockets which ran out of buffers
+ */
+void TCPProtocol::OnTxSpaceAvailable()
 {
-	//Remove the segment from the list of unacked frames
-	for(size_t i=0; i<TCP_MAX_UNACKED; i++)
+	for(size_t line=0; line<TCP_TABLE_LINES; line++)
 	{
-		if(state->m_unackedFrames[i].m_segment == segment)
+		for(size_t way=0; way<TCP_TABLE_WAYS; way++)
 		{
-			//Clear it
-			state->m_unackedFrames[i].m_segment = nullptr;
+			auto& sock = m_socketState[line][way];
+			if(!sock.m_valid || !sock.m_txBlocked)
+				continue;
 
-			//For now, don't check for subsequent unacked frames
-			//We can only cancel the most recently allocated frame
-			break;
+			//Clear the flag first, if the socket fails to send again it'll get set again
+			sock.m_txBlocked = false;
+
+			if(sock.m_sendData || sock.m_streaming)
+				ContinueSend(&sock);
+			OnTxSpaceAvailable(&sock);
+
+			//Stop early if we're out of frames again, the next free will wake up the rest
+			if(!m_eth->IsTxBufferAvailable())
+				return;
 		}
 	}
-
-	//Cancel the packet in the upper layer
-	m_ipv4->CancelTxPacket(reinterpret_cast<IPv4Packet*>(reinterpret_cast<uint8_t*>(segment) - sizeof(IPv4Packet)));
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Handle aging of packets
-
 /**
-	@brief Called at 10 Hz to determine if we need to retransmit anything
+	@brief Returns the number of milliseconds until the next retransmit or zero-window probe is due
  */
-void TCPProtocol::OnAgingTick10x()
+uint32_t TCPProtocol::GetNextDeadline()
 {
-	//Go through all open sockets and look to see if we have anything due to retransmit
-	for(size_t way=0; way<TCP_TABLE_WAYS; way++)
+	auto now = GetTimeMs();
+
+	uint32_t next = TIMER_NO_DEADLINE;
+	for(size_t line=0; line<TCP_TABLE_LINES; line++)
 	{
-		for(size_t line=0; line<TCP_TABLE_LINES; line++)
+		for(size_t way=0; way<TCP_TABLE_WAYS; way++)
 		{
-			auto& sock = m_socketTable[way].m_lines[line];
+			auto& sock = m_socketState[line][way];
+			if(!sock.m_valid)
+				continue;
 
-			//Age all of our queued frames
-			for(size_t i=0; i<TCP_MAX_UNACKED; i++)
+			for(auto f = sock.m_unackedHead; f; f = f->m_next)
 			{
-				auto& f = sock.m_unackedFrames[i];
-				if(!f.m_segment)
-					continue;
-
-				//Valid frame, age it
-				f.m_agingTicks ++;
+				auto delta = MonotonicClock::TimeUntil(now, f->m_sendTime + sock.m_rto);
+				if(delta < next)
+					next = delta;
+			}
 
-				//Segment has aged out, resend it
-				if(f.m_agingTicks >= TCP_RETRANSMIT_TIMEOUT)
-				{
-					f.m_agingTicks = 0;
-					m_ipv4->ResendTxPacket(reinterpret_cast<IPv4Packet*>(
-						reinterpret_cast<uint8_t*>(f.m_segment) - sizeof(IPv4Packet)));
-				}
+			if(sock.m_persistInterval)
+			{
+				auto delta = MonotonicClock::TimeUntil(now, sock.m_persistTime);
+				if(delta < next)
+					next = delta;
 			}
 		}
 	}
+
+	return next;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -137,7 +899,7 @@ __attribute__((section(".tcmtext")))
 void TCPProtocol::OnRxPacket(
 	TCPSegment* segment,
 	uint16_t ipPayloadLength,
-	IPv4Address sourceAddress,
+	const TCPRemoteAddress& sourceAddress,
 	uint16_t pseudoHeaderChecksum)
 {
 	//Drop any packets too small for a complete TCP header
@@ -152,7 +914,6 @@ void TCPProtocol::OnRxPacket(
 	{
 		return;
 	}
-	segment->ByteSwap();
 
 	//Sanity check that the data offset points within the segment and not after the end
 	uint16_t off = segment->GetDataOffsetBytes();
@@ -163,9 +924,11 @@ void TCPProtocol::OnRxPacket(
 	//Check flags to see what it is
 	if(segment->m_offsetAndFlags & TCPSegment::FLAG_SYN)
 	{
-		//TODO: check for SYN+ACK (we can only ever see this if we're a client)
-		//For now we only support the server use case, so any SYN is a connection request
-		OnRxSYN(segment, sourceAddress);
+		//SYN+ACK is the response to an outbound connection request, a bare SYN is a new inbound connection
+		if(segment->m_offsetAndFlags & TCPSegment::FLAG_ACK)
+			OnRxSYNACK(segment, sourceAddress);
+		else
+			OnRxSYN(segment, sourceAddress);
 	}
 
 	else if(segment->m_offsetAndFlags & TCPSegment::FLAG_RST)
@@ -178,36 +941,68 @@ void TCPProtocol::OnRxPacket(
 /**
 	@brief Handles an incoming SYN
  */
-void TCPProtocol::OnRxSYN(TCPSegment* segment, IPv4Address sourceAddress)
+void TCPProtocol::OnRxSYN(TCPSegment* segment, const TCPRemoteAddress& sourceAddress)
 {
 	//If port is not open, send a RST
 	if(!IsPortOpen(segment->m_destPort))
 	{
-		//Get ready to send a reply, if no free buffers give up
-		auto reply = m_ipv4->GetTxPacket(sourceAddress, IP_PROTO_TCP);
-		if(reply == nullptr)
+		//Save what we need from the SYN, since the reply may be formatted over the top of it
+		uint16_t sport = segment->m_sourcePort;
+		uint16_t dport = segment->m_destPort;
+		uint32_t seq = segment->m_sequence;
+
+		//Get ready to send a reply: turn the SYN around if we can, otherwise allocate.
+		//If no free buffers give up
+		TCPSegment* payload = nullptr;
+		if(!sourceAddress.m_ipv6 && m_ipv4)
+		{
+			auto packet = m_ipv4->TurnaroundRxPacket(TX_CLASS_CONTROL);
+			if(packet)
+				payload = reinterpret_cast<TCPSegment*>(packet->Payload());
+		}
+		if(payload == nullptr)
+			payload = AllocatePacket(sourceAddress, TX_CLASS_CONTROL);
+		if(payload == nullptr)
 			return;
 
 		//Format the reply
-		auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
-		payload->m_sourcePort = segment->m_destPort;
-		payload->m_destPort = segment->m_sourcePort;
+		payload->m_sourcePort = dport;
+		payload->m_destPort = sport;
 		payload->m_sequence = 0;
-		payload->m_ack = segment->m_sequence + 1;
+		payload->m_ack = seq + 1;
 		payload->m_offsetAndFlags = (5 << 12) | TCPSegment::FLAG_RST | TCPSegment::FLAG_ACK;
 		payload->m_windowSize = 1;
+		payload->m_checksum = 0;
 		payload->m_urgent = 0;
 
 		//Done
-		SendSegment(nullptr, payload, reply);
+		SendPacket(payload, sizeof(TCPSegment), sourceAddress.m_ipv6 != nullptr, true);
 		return;
 	}
 
-	//TODO: See if we already have open state for this hash.
-	//If so, this is a repeated SYN for an open socket (our ACK didn't make it)
+	//See if we already have state for this 4-tuple
+	auto old = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
+	if(old)
+	{
+		//A new connection may reuse the 4-tuple of one that's lingering in TIME-WAIT
+		if(old->m_state == TCPTableEntry::STATE_TIME_WAIT)
+			FreeSocketHandle(old);
+
+		//Otherwise, it's a repeated SYN for an open socket (our SYN-ACK didn't make it).
+		//Resend the SYN-ACK as long as we haven't sent anything after it
+		else
+		{
+			if( (old->m_remoteInitialSeq == segment->m_sequence) &&
+				(old->m_localSeq == old->m_localInitialSeq + 1) )
+			{
+				SendSYN(old);
+			}
+			return;
+		}
+	}
 
 	//Figure out which socket table entry to use
-	auto state = AllocateSocketHandle(Hash(sourceAddress, segment->m_destPort, segment->m_sourcePort));
+	auto state = AllocateSocketHandle(sourceAddress, segment->m_destPort, segment->m_sourcePort);
 	if(state == nullptr)
 	{
 		//No free socket handles available.
@@ -216,306 +1011,738 @@ void TCPProtocol::OnRxSYN(TCPSegment* segment, IPv4Address sourceAddress)
 	}
 
 	//Fill out the initial table entry
-	state->m_remoteIP = sourceAddress;
-	state->m_localPort = segment->m_destPort;
-	state->m_remotePort = segment->m_sourcePort;
 	state->m_remoteSeq = segment->m_sequence + 1;
 	state->m_localSeq = GenerateInitialSequenceNumber();
 	state->m_remoteInitialSeq = segment->m_sequence;
 	state->m_localInitialSeq = state->m_localSeq;
+	state->m_remoteMSS = segment->GetMSSOption();
+
+	//The peer's receive window starts after our SYN
+	state->m_remoteWindow = segment->m_windowSize;
+	state->m_sendWindowEdge = state->m_localSeq + 1 + segment->m_windowSize;
+
+	//Send the SYN-ACK.
+	//The SYN flag counts as a byte in the stream, so we expect the next ACK to be one greater than what we sent
+	state->m_localSeq ++;
+	SendSYN(state);
+
+	//Notify upper layer stuff
+	OnConnectionAccepted(state);
+}
+
+/**
+	@brief Handles an incoming SYN+ACK, completing an outbound connection
+ */
+void TCPProtocol::OnRxSYNACK(TCPSegment* segment, const TCPRemoteAddress& sourceAddress)
+{
+	auto state = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
+	if(state == nullptr)
+		return;
+
+	//Not waiting for this? If we're already connected, our ACK was probably lost so send it again
+	if( (state->m_state != TCPTableEntry::STATE_SYN_SENT) || (segment->m_ack != state->m_localSeq) )
+	{
+		if(state->m_state == TCPTableEntry::STATE_ESTABLISHED)
+		{
+			auto reply = CreateReply(state);
+			if(reply)
+				SendSegment(state, reply);
+		}
+		return;
+	}
 
-	//Prepare the reply
+	//Fill out the rest of the table entry now that we know about the remote side
+	state->m_remoteSeq = segment->m_sequence + 1;
+	state->m_remoteInitialSeq = segment->m_sequence;
+	state->m_remoteMSS = segment->GetMSSOption();
+	state->m_remoteWindow = segment->m_windowSize;
+	state->m_sendWindowEdge = segment->m_ack + segment->m_windowSize;
+	state->m_lastRxTime = GetTimeMs();
+	EnterState(state, TCPTableEntry::STATE_ESTABLISHED);
+
+	//ACK it
 	auto reply = CreateReply(state);
-	if(!reply)
+	if(reply)
+		SendSegment(state, reply);
+
+	//Notify upper layer stuff
+	OnConnected(state);
+}
+
+/**
+	@brief Handles an incoming RST
+ */
+void TCPProtocol::OnRxRST(TCPSegment* segment, const TCPRemoteAddress& sourceAddress)
+{
+	//Look up the socket handle for this segment. Drop silently if not a valid segment
+	//TODO: should we send a RST?
+	auto state = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
+	if(state == nullptr)
 		return;
-	auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
-	payload->m_offsetAndFlags |= TCPSegment::FLAG_SYN;
 
-	//Send it
-	SendSegment(state, payload, reply);
+	//Notify the upper layer protocol, unless it already knows
+	if(state->m_state < TCPTableEntry::STATE_TIME_WAIT)
+		OnConnectionClosed(state);
 
-	//The SYN flag counts as a byte in the stream, so we expect the next ACK to be one greater than what we sent
-	state->m_localSeq ++;
+	//Connection is getting torn down, so close our socket state.
+	//A reset connection doesn't need TIME-WAIT, so free the table entry right away.
+	FreeSocketHandle(state);
+}
+
+/**
+	@brief Handles an incoming frame during a connection
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::OnRxACK(TCPSegment* segment, const TCPRemoteAddress& sourceAddress, uint16_t payloadLen)
+{
+	//Look up the socket handle for this segment. Drop silently if not a valid segment
+	//TODO: should we send a RST?
+	auto state = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
+	if(state == nullptr)
+		return;
+
+	//Nothing but a SYN+ACK (or RST) makes sense until the connection is open
+	if(state->m_state == TCPTableEntry::STATE_SYN_SENT)
+		return;
+
+	//The peer is alive
+	state->m_lastRxTime = GetTimeMs();
+	state->m_keepalivesSent = 0;
+
+	bool isFin = (segment->m_offsetAndFlags & TCPSegment::FLAG_FIN) == TCPSegment::FLAG_FIN;
+
+	//If incoming sequence number is too BIG: we missed a packet, this is the next one in line.
+	//If too SMALL: this is a duplicate packet.
+	//Send an ACK for the last packet we *did* get
+	if(state->m_remoteSeq != segment->m_sequence)
+	{
+		auto payload = CreateReply(state);
+		if(!payload)
+			return;
+		SendSegment(state, payload);
+		return;
+	}
+
+	//If we get here, it's the next packet in line.
+
+	//Both sides are closed, nothing left to do but ACK retransmitted FINs (handled above)
+	if(state->m_state == TCPTableEntry::STATE_TIME_WAIT)
+		return;
+
+	//Waiting for the ACK of our FIN, then we're done
+	if(state->m_state == TCPTableEntry::STATE_LAST_ACK)
+	{
+		if(segment->m_ack == state->m_localSeq)
+			FreeSocketHandle(state);
+		return;
+	}
+
+	//Track the remote side's receive window
+	state->m_remoteWindow = segment->m_windowSize;
+	state->m_sendWindowEdge = segment->m_ack + segment->m_windowSize;
+
+	//Remove fully ACKed segments from the list of unacked frames.
+	//The list is in order of sequence number, so stop at the first one that's not ACKed
+	bool slotsFreed = false;
+	while(state->m_unackedHead)
+	{
+		auto endSeq = state->m_unackedHead->m_sequence + state->m_unackedHead->m_length;
+
+		//If ACK number is >= the end of the frame, we can clear it and free it in the upper layer
+		if(segment->m_ack >= endSeq)
+		{
+			FreeUnackedSegment(state, nullptr, state->m_unackedHead, true);
+			slotsFreed = true;
+		}
+		else
+			break;
+	}
+
+	//The peer is making progress, so go back to the normal retransmit timeout
+	if(slotsFreed)
+		state->m_rto = TCP_RETRANSMIT_TIMEOUT_MS;
+
+	//If we were waiting for the window to open, stop probing
+	bool windowOpened = false;
+	if(state->m_persistInterval && IsSendWindowOpen(state))
+	{
+		state->m_persistInterval = 0;
+		windowOpened = true;
+	}
+
+	//If we freed up space, continue any large send or stream that was waiting on it (or complete an unpinned send)
+	if(state->m_sendData || state->m_streaming)
+		ContinueSend(state);
+
+	//Once everything in flight is ACKed, send any small writes we were holding back
+	if(state->m_coalesceSegment && !HasUnackedData(state))
+		Flush(state);
+
+	//Let the application know it can send more
+	if(slotsFreed || windowOpened)
+	{
+		state->m_txBlocked = false;
+		OnTxSpaceAvailable(state);
+	}
+
+	//Our FIN has been ACKed, wait for the peer to close its side
+	if( (state->m_state == TCPTableEntry::STATE_FIN_WAIT_1) && (segment->m_ack == state->m_localSeq) )
+		EnterState(state, TCPTableEntry::STATE_FIN_WAIT_2);
+
+	//Process the data
+	if(payloadLen > 0)
+	{
+		//Update our ACK number to the end of this segment
+		state->m_remoteSeq += payloadLen;
+
+		//Call the RX data handler
+		OnRxData(state, segment->Payload(), payloadLen);
+
+		//The handler may have aborted the connection
+		if(!state->m_valid)
+			return;
+	}
+
+	//If no data, and not a FIN, no action needed (duplicate ACK?)
+	else if(!isFin)
+		return;
+
+	//The peer is done sending. Our reply to the FIN ACKs any data as well
+	if(isFin)
+	{
+		OnRxFIN(state);
+		return;
+	}
+
+	//At this point we had data and should send an ACK.
+	//But if OnRxData() sent payload data, we might have already sent the new ACK number in that segment.
+	//Don't send an ACK-only segment in that case.
+	if(state->m_remoteSeq == state->m_remoteSeqSent)
+		return;
+
+	//If the caller is processing a batch of frames, one ACK at the end of the batch can cover all of them
+	if(m_deferAcks && DeferAck(state))
+		return;
+
+	//Send our reply
+	auto payload = CreateReply(state);
+	if(!payload)
+		return;
+	SendSegment(state, payload);
+}
+
+/**
+	@brief Handles the peer closing its side of a connection
+ */
+void TCPProtocol::OnRxFIN(TCPTableEntry* state)
+{
+	//FIN counts as a data byte so increment our ACK number
+	state->m_remoteSeq ++;
+
+	//Anything the application was still sending is abandoned: nothing may follow our FIN, and the buffer goes back
+	//to the application when we call OnConnectionClosed() below
+	state->m_sendData = nullptr;
+	state->m_streaming = false;
+	state->m_closePending = false;
+
+	//Passive close: we have nothing more to say either, so send our own FIN along with the ACK
+	//and wait for it to be ACKed
+	if(state->m_state == TCPTableEntry::STATE_ESTABLISHED)
+	{
+		state->m_localSeq ++;
+		EnterState(state, TCPTableEntry::STATE_LAST_ACK);
+		SendFIN(state);
+	}
+
+	//Active close: we already sent our FIN, so just ACK theirs.
+	//Linger for a bit in case our ACK is lost and they retransmit the FIN
+	else
+	{
+		EnterState(state, TCPTableEntry::STATE_TIME_WAIT);
+		auto reply = CreateReply(state);
+		if(reply)
+			SendSegment(state, reply);
+	}
+
+	//Notify the upper layer protocol
+	OnConnectionClosed(state);
+}
+
+/**
+	@brief Adds a socket to the deferred ACK list
+
+	Returns false if the list is full, in which case the ACK should be sent right away.
+ */
+bool TCPProtocol::DeferAck(TCPTableEntry* state)
+{
+	if(state->m_ackPending)
+		return true;
+	if(m_deferredAckCount >= TCP_MAX_DEFERRED_ACKS)
+		return false;
+
+	state->m_ackPending = true;
+	m_deferredAcks[m_deferredAckCount] = state;
+	m_deferredAckCount ++;
+	return true;
+}
+
+/**
+	@brief Enables or disables deferral of ACKs for received data
+
+	While enabled, data segments are not ACKed as they arrive. Instead a single ACK per socket is sent by the next call
+	to FlushDeferredAcks(), which must be called once the current batch of received frames has been processed (see
+	StackRunner). Data sent by the application in the meantime carries the new ACK number, and the separate ACK is
+	skipped. Duplicate and out of order segments, and FINs, are still ACKed immediately.
+
+	Disabling deferral flushes anything still pending.
+ */
+void TCPProtocol::SetAckDeferral(bool defer)
+{
+	m_deferAcks = defer;
+	if(!defer)
+		FlushDeferredAcks();
+}
+
+/**
+	@brief Sends the ACKs deferred since the last call
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::FlushDeferredAcks()
+{
+	for(uint8_t i=0; i<m_deferredAckCount; i++)
+	{
+		//Skip sockets which have been closed (and maybe reused) since
+		auto state = m_deferredAcks[i];
+		if(!state->m_valid || !state->m_ackPending)
+			continue;
+		state->m_ackPending = false;
+
+		//Already sent the new ACK number along with data
+		if(state->m_remoteSeq == state->m_remoteSeqSent)
+			continue;
+
+		auto payload = CreateReply(state);
+		if(payload)
+			SendSegment(state, payload);
+	}
+	m_deferredAckCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Outbound traffic
+
+/**
+	@brief Sends a TCP segment, adding it to the retransmit queue if it carries data
+
+	If pin is false, the segment's sequence range is queued but the frame is freed as soon as it's sent.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::SendSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t length, bool pin)
+{
+	//Put it in the transmit queue if the frame has content (don't worry about retransmitting ACKs).
+	//GetTxSegment() already claimed a slot for it, so the pool can't be empty.
+	bool inQueue = false;
+	if( (length > sizeof(TCPSegment)) && state->m_txSegmentsAllocated && m_segmentFreeList)
+	{
+		auto f = m_segmentFreeList;
+		m_segmentFreeList = f->m_next;
+
+		f->m_segment = pin ? segment : nullptr;
+		f->m_sendTime = GetTimeMs();
+		f->m_sequence = segment->m_sequence;
+		f->m_length = length - sizeof(TCPSegment);
+		f->m_next = nullptr;
+		if(state->m_unackedTail)
+			state->m_unackedTail->m_next = f;
+		else
+			state->m_unackedHead = f;
+		state->m_unackedTail = f;
+
+		//Move the slot from allocated to in flight
+		state->m_txSegmentsAllocated --;
+		state->m_unackedCount ++;
+		inQueue = pin;
+	}
+
+	TransmitSegment(state, segment, length, !inQueue);
+}
+
+/**
+	@brief Does final prep and sends a TCP segment, without touching the retransmit queue
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::TransmitSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t length, bool markFree)
+{
+	//Make an note of what ACK number we just sent
+	state->m_remoteSeqSent = state->m_remoteSeq;
+
+	SendPacket(segment, length, state->m_isIPv6, markFree, state->GetTxTemplate());
+}
+
+/**
+	@brief Create a reply segment for a given socket state
+
+	Pure ACKs, SYNs and FINs default to TX_CLASS_CONTROL, so they still get out when bulk data has used up the normal
+	TX buffers.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+TCPSegment* TCPProtocol::CreateReply(TCPTableEntry* state, txclass_t txclass)
+{
+	//Get ready to send a reply, if no free buffers give up
+	auto payload = AllocatePacket(state->GetRemoteAddress(), txclass, state->GetTxTemplate());
+	if(payload == nullptr)
+		return nullptr;
+
+	//Format the reply
+	payload->m_sourcePort = state->m_localPort;
+	payload->m_destPort = state->m_remotePort;
+	payload->m_sequence = state->m_localSeq;
+	payload->m_ack = state->m_remoteSeq;
+	payload->m_offsetAndFlags = (5 << 12) | TCPSegment::FLAG_ACK;
+	payload->m_windowSize = TCP_IPV4_PAYLOAD_MTU;	//TODO: support variable window size
+	payload->m_urgent = 0;
+	payload->m_checksum = 0;
 
-	//Notify upper layer stuff
-	OnConnectionAccepted(state);
+	return payload;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Network layer glue
+
 /**
-	@brief Handles an incoming RST
+	@brief Allocates a packet for a segment to the given address, over IPv4 or IPv6 as appropriate
+
+	If a header template is provided (IPv4 only), the headers are copied from it when possible.
+
+	Returns a pointer to the TCP header within the packet, or nullptr if no frame is available or the destination
+	can't be resolved yet.
  */
-void TCPProtocol::OnRxRST(TCPSegment* segment, IPv4Address sourceAddress)
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+TCPSegment* TCPProtocol::AllocatePacket(const TCPRemoteAddress& dest, txclass_t txclass, IPv4TxTemplate* tmpl)
 {
-	//Look up the socket handle for this segment. Drop silently if not a valid segment
-	//TODO: should we send a RST?
-	auto state = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
-	if(state == nullptr)
-		return;
-
-	//Notify the upper layer protocol
-	OnConnectionClosed(state);
+	if(dest.m_ipv6)
+	{
+		if(!m_ipv6)
+			return nullptr;
+		auto packet = m_ipv6->GetTxPacket(*dest.m_ipv6, IP_PROTO_TCP, txclass);
+		if(!packet)
+			return nullptr;
+		return reinterpret_cast<TCPSegment*>(packet->Payload());
+	}
 
-	//Connection is getting torn down, so close our socket state.
-	//Normally we'd go to TIME-WAIT but just close it right away so we can reuse the table entry.
-	state->m_valid = false;
+	if(!m_ipv4)
+		return nullptr;
+	auto packet = tmpl ?
+		m_ipv4->GetTxPacket(*tmpl, dest.m_key, IP_PROTO_TCP, txclass) :
+		m_ipv4->GetTxPacket(dest.m_key, IP_PROTO_TCP, txclass);
+	if(!packet)
+		return nullptr;
+	return reinterpret_cast<TCPSegment*>(packet->Payload());
 }
 
 /**
-	@brief Handles an incoming frame during a connection
+	@brief Calculates the checksum of a segment allocated by AllocatePacket(), and sends it
+
+	The template, if any, must be the same one the segment was allocated with.
  */
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-void TCPProtocol::OnRxACK(TCPSegment* segment, IPv4Address sourceAddress, uint16_t payloadLen)
+void TCPProtocol::SendPacket(TCPSegment* segment, uint16_t length, bool ipv6, bool markFree, IPv4TxTemplate* tmpl)
 {
-	//Look up the socket handle for this segment. Drop silently if not a valid segment
-	//TODO: should we send a RST?
-	auto state = GetSocketState(sourceAddress, segment->m_destPort, segment->m_sourcePort);
-	if(state == nullptr)
-		return;
+	if(ipv6)
+	{
+		auto packet = GetIPv6Packet(segment);
+		auto pseudoHeaderChecksum = m_ipv6->PseudoHeaderChecksum(packet, length);
 
-	bool isFin = (segment->m_offsetAndFlags & TCPSegment::FLAG_FIN) == TCPSegment::FLAG_FIN;
+		segment->m_checksum = ~__builtin_bswap16(
+			IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(segment), length, pseudoHeaderChecksum));
 
-	//If incoming sequence number is too BIG: we missed a packet, this is the next one in line.
-	//If too SMALL: this is a duplicate packet.
-	//Send an ACK for the last packet we *did* get
-	if(state->m_remoteSeq != segment->m_sequence)
-	{
-		auto reply = CreateReply(state);
-		if(!reply)
-			return;
-		auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
-		SendSegment(state, payload, reply);
+		m_ipv6->SendTxPacket(packet, length, markFree);
 		return;
 	}
 
-	//If we get here, it's the next packet in line.
+	auto packet = GetIPv4Packet(segment);
 
-	//Remove the segment from the list of unacked frames
-	for(size_t i=0; i<TCP_MAX_UNACKED; i++)
-	{
-		auto frame = state->m_unackedFrames[i].m_segment;
-		if(!frame)
-			continue;
+	//Calculate the pseudoheader checksum (precomputed, if we have an up to date template)
+	#ifndef HAVE_TCP_V4_CHECKSUM_OFFLOAD
+	uint16_t pseudoHeaderChecksum;
+	if(tmpl && tmpl->Matches(packet))
+		pseudoHeaderChecksum = tmpl->PseudoHeaderChecksum(length);
+	else
+		pseudoHeaderChecksum = m_ipv4->PseudoHeaderChecksum(packet, length);
+	#endif
 
-		//Get the sequence number of the frame (already in network byte order so have to munge a bit)
-		auto seq = __builtin_bswap32(frame->m_sequence);
-		//auto end = ack + __builtin_bswap32(frame->m_sequence);
-		auto v4 = reinterpret_cast<IPv4Packet*>(reinterpret_cast<uint8_t*>(frame) - sizeof(IPv4Packet));
-		auto ipPayloadLength = __builtin_bswap16(v4->m_totalLength) - 20;
-		auto segmentLength = ipPayloadLength - 20;
-		auto endSeq = seq + segmentLength;
+	#ifdef HAVE_TCP_V4_CHECKSUM_OFFLOAD
+		segment->m_checksum = 0x0000;	//will be filled in by hardware, but don't leave uninitialized
+	#else
+		segment->m_checksum = ~__builtin_bswap16(
+			IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(segment), length, pseudoHeaderChecksum));
+	#endif
 
-		//If ACK number is >= the end of the frame, we can clear it
-		if(segment->m_ack >= endSeq)
-		{
-			//Remove the segment from the list of unacked frames
-			state->m_unackedFrames[i].m_segment = nullptr;
+	if(tmpl)
+		m_ipv4->SendTxPacket(*tmpl, packet, length, markFree);
+	else
+		m_ipv4->SendTxPacket(packet, length, markFree);
+}
 
-			//Free it in the upper layer
-			m_ipv4->CancelTxPacket(v4);
-		}
-		else
-			break;
-	}
+/**
+	@brief Re-sends a segment previously sent by SendPacket() as-is
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+void TCPProtocol::ResendPacket(TCPSegment* segment, bool ipv6)
+{
+	if(ipv6)
+		m_ipv6->ResendTxPacket(GetIPv6Packet(segment));
+	else
+		m_ipv4->ResendTxPacket(GetIPv4Packet(segment));
+}
 
-	//Clear empty slots in the list of unacked frames
-	size_t iwrite = 0;
-	for(size_t i=0; i<TCP_MAX_UNACKED; i++)
-	{
-		auto frame = state->m_unackedFrames[i];
-		if(!frame.m_segment)
-			continue;
+/**
+	@brief Frees the frame containing a segment allocated by AllocatePacket()
+ */
+void TCPProtocol::CancelPacket(TCPSegment* segment, bool ipv6)
+{
+	if(ipv6)
+		m_ipv6->CancelTxPacket(GetIPv6Packet(segment));
+	else
+		m_ipv4->CancelTxPacket(GetIPv4Packet(segment));
+}
 
-		//Move the frame to the earliest unused slot in the list
-		state->m_unackedFrames[i] = nullptr;
-		state->m_unackedFrames[iwrite] = frame;
-		iwrite ++;
-	}
+/**
+	@brief Close a socket
 
-	//Process the data
-	if(payloadLen > 0)
+	Sends a FIN once any buffered data has gone out, including the rest of a Send() in progress. The socket stays valid
+	until the peer closes its side as well, at which point OnConnectionClosed() is called.
+ */
+void TCPProtocol::CloseSocket(TCPTableEntry* state)
+{
+	//Connection isn't open yet, just give up on it
+	if(state->m_state == TCPTableEntry::STATE_SYN_SENT)
 	{
-		//Update our ACK number to the end of this segment
-		state->m_remoteSeq += payloadLen;
-
-		//Call the RX data handler
-		OnRxData(state, segment->Payload(), payloadLen);
+		AbortSocket(state);
+		return;
 	}
 
-	//If no data, and not a FIN, no action needed (duplicate ACK?)
-	else if(!isFin)
+	//Already closing
+	if(state->m_state != TCPTableEntry::STATE_ESTABLISHED)
 		return;
+	state->m_streaming = false;
 
-	//At this point we had data and should send an ACK.
-	//But if OnRxData() sent payload data, we might have already sent the new ACK number in that segment.
-	//Don't send an ACK-only segment in that case.
-	if( (state->m_remoteSeq == state->m_remoteSeqSent) && !isFin)
+	//Part of a Send() hasn't been segmented yet. ContinueSend() will call us again once it has
+	if(state->m_sendData && (state->m_sendOffset < state->m_sendLength) )
+	{
+		state->m_closePending = true;
 		return;
+	}
 
-	//Send our reply
-	auto reply = CreateReply(state);
-	if(!reply)
-		return;
-	auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
-	if(segment->m_offsetAndFlags & TCPSegment::FLAG_FIN)
-	{
-		//Set the FIN flag on the outgoing packet.
-		//FIN counts as a data byte so increment our ACK number
-		payload->m_offsetAndFlags |= TCPSegment::FLAG_FIN;
-		payload->m_ack ++;
+	//Buffered data has to go out before the FIN
+	Flush(state);
 
-		//Notify the upper layer protocol
-		OnConnectionClosed(state);
+	//The FIN flag counts as a byte in the stream, so we expect the next ACK to be one greater than what we sent
+	state->m_localSeq ++;
+	EnterState(state, TCPTableEntry::STATE_FIN_WAIT_1);
 
-		//Connection is getting torn down, so close our socket state.
-		//Normally we'd go to TIME-WAIT but just close it right away so we can reuse the table entry.
-		state->m_valid = false;
-	}
-	SendSegment(state, payload, reply);
+	//Send it. If we're out of buffers, the aging tick will retry.
+	//Don't close the socket state on our end until we get the FIN+ACK
+	SendFIN(state);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Outbound traffic
-
 /**
-	@brief Does final prep and sends a TCP segment
+	@brief Abruptly terminates a connection, sending a RST and freeing the socket immediately
+
+	OnConnectionClosed() is called first if the upper layer hasn't been notified yet.
  */
-#ifdef HAVE_ITCM
-__attribute__((section(".tcmtext")))
-#endif
-void TCPProtocol::SendSegment(TCPTableEntry* state, TCPSegment* segment, IPv4Packet* packet, uint16_t length)
+void TCPProtocol::AbortSocket(TCPTableEntry* state)
 {
-	//Calculate the pseudoheader checksum
-	#ifndef HAVE_TCP_V4_CHECKSUM_OFFLOAD
-	auto pseudoHeaderChecksum = m_ipv4->PseudoHeaderChecksum(packet, length);
-	#endif
-
-	//Make an note of what ACK number we just sent
-	if(state)
-		state->m_remoteSeqSent = state->m_remoteSeq;
-
-	//Need to be in network byte order before we send
-	segment->ByteSwap();
-	#ifdef HAVE_TCP_V4_CHECKSUM_OFFLOAD
-		segment->m_checksum = 0x0000;	//will be filled in by hardware, but don't leave uninitialized
-	#else
-		segment->m_checksum = ~__builtin_bswap16(
-			IPv4Protocol::InternetChecksum(reinterpret_cast<uint8_t*>(segment), length, pseudoHeaderChecksum));
-	#endif
-
-	//Put it in the transmit queue if the frame has content (don't worry about retransmitting ACKs)
-	//Find first free spot in the list of unacked frames
-	//(state may be null if we're sending a RST in response to a closed port)
-	bool inQueue = false;
-	if(state && (length > sizeof(TCPSegment) ))
+	//No need for a RST if the remote side never accepted the connection
+	auto payload = (state->m_state == TCPTableEntry::STATE_SYN_SENT) ? nullptr : CreateReply(state);
+	if(payload)
 	{
-		for(size_t i=0; i<TCP_MAX_UNACKED; i++)
-		{
-			if(state->m_unackedFrames[i].m_segment == nullptr)
-			{
-				state->m_unackedFrames[i] = TCPSentSegment(segment);
-				inQueue = true;
-				break;
-			}
-			//TODO: don't allow sending the frame if no space to queue it?
-		}
+		payload->m_offsetAndFlags = (5 << 12) | TCPSegment::FLAG_RST | TCPSegment::FLAG_ACK;
+		SendSegment(state, payload);
 	}
 
-	m_ipv4->SendTxPacket(packet, length, !inQueue);
+	if(state->m_state < TCPTableEntry::STATE_TIME_WAIT)
+		OnConnectionClosed(state);
+	FreeSocketHandle(state);
 }
 
 /**
-	@brief Create a reply segment for a given socket state
+	@brief Sends (or resends) our SYN or SYN-ACK, which has already been counted in m_localSeq
  */
-#ifdef HAVE_ITCM
-__attribute__((section(".tcmtext")))
-#endif
-IPv4Packet* TCPProtocol::CreateReply(TCPTableEntry* state)
+void TCPProtocol::SendSYN(TCPTableEntry* state)
 {
-	//Get ready to send a reply, if no free buffers give up
-	auto reply = m_ipv4->GetTxPacket(state->m_remoteIP, IP_PROTO_TCP);
-	if(reply == nullptr)
-		return nullptr;
+	auto payload = CreateReply(state);
+	if(!payload)
+		return;
+	payload->m_sequence = state->m_localSeq - 1;
+	payload->m_offsetAndFlags |= TCPSegment::FLAG_SYN;
 
-	//Format the reply
-	auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
-	payload->m_sourcePort = state->m_localPort;
-	payload->m_destPort = state->m_remotePort;
-	payload->m_sequence = state->m_localSeq;
-	payload->m_ack = state->m_remoteSeq;
-	payload->m_offsetAndFlags = (5 << 12) | TCPSegment::FLAG_ACK;
-	payload->m_windowSize = TCP_IPV4_PAYLOAD_MTU;	//TODO: support variable window size
-	payload->m_urgent = 0;
-	payload->m_checksum = 0;
+	//Nothing to ACK yet if we're the one opening the connection
+	if(state->m_state == TCPTableEntry::STATE_SYN_SENT)
+	{
+		payload->m_offsetAndFlags &= ~TCPSegment::FLAG_ACK;
+		payload->m_ack = 0;
+	}
 
-	return reply;
+	//Let the remote side know how big a segment we can take
+	auto len = payload->SetMSSOption(GetLocalMSS(state));
+	SendSegment(state, payload, len);
 }
 
 /**
-	@brief Close a socket
+	@brief Sends (or resends) our FIN, which has already been counted in m_localSeq
  */
-void TCPProtocol::CloseSocket(TCPTableEntry* state)
+void TCPProtocol::SendFIN(TCPTableEntry* state)
 {
-	//Prepare the reply
-	auto reply = CreateReply(state);
-	auto payload = reinterpret_cast<TCPSegment*>(reply->Payload());
+	auto payload = CreateReply(state);
+	if(!payload)
+		return;
+	payload->m_sequence = state->m_localSeq - 1;
 	payload->m_offsetAndFlags |= TCPSegment::FLAG_FIN;
+	SendSegment(state, payload);
+}
 
-	//Send it
-	SendSegment(state, payload, reply);
-
-	//The FIN flag counts as a byte in the stream, so we expect the next ACK to be one greater than what we sent
-	state->m_localSeq ++;
+/**
+	@brief Sends a keepalive or zero-window probe
 
-	//Don't close the socket state on our end until we get the FIN+ACK
+	This is an ACK for one byte before our current sequence number, which the peer has already ACKed, so it has to
+	respond with an ACK of its own (including its current window size).
+ */
+void TCPProtocol::SendProbe(TCPTableEntry* state)
+{
+	auto payload = CreateReply(state);
+	if(!payload)
+		return;
+	payload->m_sequence = state->m_localSeq - 1;
+	SendSegment(state, payload);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Socket table stuff
 
 /**
-	@brief Hashes an IP address and returns a row index
+	@brief Hashes a connection 4-tuple and returns the primary row index
+
+	Uses the hardware CRC32 instruction if the target has one. Otherwise, multiply-shift on the packed 4-tuple: a
+	single 64-bit multiply, keeping the well mixed high half of the product.
 
-	32-bit FNV-1 for now. Simple and good mixing, but uses a bunch of multiplies so might be slow?
+	The 32-bit hash is then mapped onto the table by a multiply rather than a modulo, so TCP_TABLE_LINES does not need
+	to be a power of two.
  */
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
 uint16_t TCPProtocol::Hash(IPv4Address ip, uint16_t localPort, uint16_t remotePort)
 {
-	size_t hash = FNV_INITIAL;
-	for(size_t i=0; i<4; i++)
-		hash = (hash * FNV_MULT) ^ ip.m_octets[i];
-	hash = (hash * FNV_MULT) ^ (localPort >> 8);
-	hash = (hash * FNV_MULT) ^ (localPort & 0xff);
-	hash = (hash * FNV_MULT) ^ (remotePort >> 8);
-	hash = (hash * FNV_MULT) ^ (remotePort & 0xff);
+	uint32_t ports = (static_cast<uint32_t>(localPort) << 16) | remotePort;
+
+	#if defined(__ARM_FEATURE_CRC32)
+		uint32_t hash = __crc32cw(__crc32cw(0xffffffff, ip.m_word), ports);
+	#elif defined(__SSE4_2__)
+		uint32_t hash = __builtin_ia32_crc32si(__builtin_ia32_crc32si(0xffffffff, ip.m_word), ports);
+	#else
+		uint64_t key = (static_cast<uint64_t>(ip.m_word) << 32) | ports;
+		uint32_t hash = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+	#endif
+
+	return (static_cast<uint64_t>(hash) * TCP_TABLE_LINES) >> 32;
+}
+
+/**
+	@brief Hashes a connection 4-tuple and returns the secondary row index
+
+	Same as Hash() but with a different seed/multiplier, so a flow whose primary row is full can still be placed.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+uint16_t TCPProtocol::AlternateHash(IPv4Address ip, uint16_t localPort, uint16_t remotePort)
+{
+	uint32_t ports = (static_cast<uint32_t>(localPort) << 16) | remotePort;
+
+	#if defined(__ARM_FEATURE_CRC32)
+		uint32_t hash = __crc32cw(__crc32cw(0x5bd1e995, ports), ip.m_word);
+	#elif defined(__SSE4_2__)
+		uint32_t hash = __builtin_ia32_crc32si(__builtin_ia32_crc32si(0x5bd1e995, ports), ip.m_word);
+	#else
+		uint64_t key = (static_cast<uint64_t>(ip.m_word) << 32) | ports;
+		uint32_t hash = (key * 0xc2b2ae3d27d4eb4fULL) >> 32;
+	#endif
+
+	return (static_cast<uint64_t>(hash) * TCP_TABLE_LINES) >> 32;
+}
 
-	return hash % TCP_TABLE_LINES;
+/**
+	@brief Determines which shard of a sharded stack owns a connection
+
+	Uses a different multiplier from Hash() and AlternateHash(), so that the flows owned by each shard are still spread
+	across the whole socket table.
+
+	@param key			Remote address, as in TCPRemoteAddress::m_key
+	@param localPort	Our port number
+	@param remotePort	Remote port number
+	@param count		Number of shards
+ */
+uint32_t TCPProtocol::GetFlowShard(IPv4Address key, uint16_t localPort, uint16_t remotePort, uint32_t count)
+{
+	uint32_t ports = (static_cast<uint32_t>(localPort) << 16) | remotePort;
+	uint64_t flow = (static_cast<uint64_t>(key.m_word) << 32) | ports;
+	uint32_t hash = (flow * 0xff51afd7ed558ccdULL) >> 32;
+	return (static_cast<uint64_t>(hash) * count) >> 32;
 }
 
 /**
 	@brief Looks up the socket state for the given connection
+
+	Back-to-back segments usually belong to the same flow, so check the last hit first. Otherwise, a flow may live in
+	any way of either its primary or secondary row, so we probe at most 2*TCP_TABLE_WAYS keys.
  */
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-TCPTableEntry* TCPProtocol::GetSocketState(IPv4Address ip, uint16_t localPort, uint16_t remotePort)
+TCPTableEntry* TCPProtocol::GetSocketState(const TCPRemoteAddress& ip, uint16_t localPort, uint16_t remotePort)
 {
-	auto hash = Hash(ip, localPort, remotePort);
+	//Port zero marks unused keys, so it can never match a real socket
+	if(localPort == 0)
+		return nullptr;
 
-	for(size_t way=0; way < TCP_TABLE_WAYS; way ++)
-	{
-		auto& row = m_socketTable[way].m_lines[hash];
+	if(m_lastHitState && m_lastHitKey.Matches(ip.m_key, localPort, remotePort) && m_lastHitState->MatchesAddress(ip))
+		return m_lastHitState;
 
-		//Nothing there? No match
-		if(!row.m_valid)
-			continue;
+	auto hash = Hash(ip.m_key, localPort, remotePort);
+	for(int pass=0; pass<2; pass++)
+	{
+		auto& keys = m_socketKeys[hash];
+		for(size_t way=0; way < TCP_TABLE_WAYS; way ++)
+		{
+			//The key only has a fold of IPv6 addresses, so check the full address on a match
+			if(keys.m_ways[way].Matches(ip.m_key, localPort, remotePort) &&
+				m_socketState[hash][way].MatchesAddress(ip))
+			{
+				m_lastHitKey = keys.m_ways[way];
+				m_lastHitState = &m_socketState[hash][way];
+				return m_lastHitState;
+			}
+		}
 
-		//Check table info
-		if( (row.m_remoteIP == ip) && (row.m_localPort == localPort) && (row.m_remotePort == remotePort) )
-			return &m_socketTable[way].m_lines[hash];
+		//Not in the primary row, try the secondary
+		hash = AlternateHash(ip.m_key, localPort, remotePort);
 	}
 
 	//Not a valid socket
@@ -523,29 +1750,126 @@ TCPTableEntry* TCPProtocol::GetSocketState(IPv4Address ip, uint16_t localPort, u
 }
 
 /**
-	@brief Finds a free space in the socket table for the given hash, then marks it as in use and returns the
+	@brief Finds a free space in the socket table for the given connection, then marks it as in use and returns the
 	socket state object
+
+	Two-choice insertion: the new entry goes in whichever of its primary and secondary rows has more free ways. This
+	keeps the load across rows much more even than a single hash, so bursts of connections don't fail while most of the
+	table is still empty.
+
+	We don't do full cuckoo relocation of existing entries, since upper layers hold TCPTableEntry pointers as socket
+	handles and entries must never move once allocated.
  */
-TCPTableEntry* TCPProtocol::AllocateSocketHandle(uint16_t hash)
+TCPTableEntry* TCPProtocol::AllocateSocketHandle(const TCPRemoteAddress& ip, uint16_t localPort, uint16_t remotePort)
 {
-	for(size_t way=0; way < TCP_TABLE_WAYS; way ++)
+	uint16_t rows[2] =
 	{
-		auto& row = m_socketTable[way].m_lines[hash];
-
-		//There's something in the row. We can't insert here.
-		if(row.m_valid)
-			continue;
-
-		//It's free, all good
-		else
+		Hash(ip.m_key, localPort, remotePort),
+		AlternateHash(ip.m_key, localPort, remotePort)
+	};
+
+	//Find the first free way in each row, and count how many are free
+	int firstFree[2] = {-1, -1};
+	size_t numFree[2] = {0, 0};
+	for(int i=0; i<2; i++)
+	{
+		auto& keys = m_socketKeys[rows[i]];
+		for(size_t way=0; way < TCP_TABLE_WAYS; way ++)
 		{
-			row.m_valid = true;
-			return &m_socketTable[way].m_lines[hash];
+			if(keys.m_ways[way].m_localPort != 0)
+				continue;
+
+			if(firstFree[i] < 0)
+				firstFree[i] = way;
+			numFree[i] ++;
 		}
 	}
 
+	//Pick the less loaded row (primary wins ties)
+	int i = 0;
+	if(numFree[1] > numFree[0])
+		i = 1;
+
 	//No free entries found
-	return nullptr;
+	if(firstFree[i] < 0)
+		return nullptr;
+
+	//Make sure we can guarantee the new socket its minimum number of retransmit slots
+	if( (m_segmentSlotsFree - m_segmentSlotsReserved) < TCP_MIN_UNACKED)
+		return nullptr;
+	m_segmentSlotsReserved += TCP_MIN_UNACKED;
+
+	//Fill out the key and mark the entry as in use
+	auto& key = m_socketKeys[rows[i]].m_ways[firstFree[i]];
+	key.m_remoteIP = ip.m_key;
+	key.m_localPort = localPort;
+	key.m_remotePort = remotePort;
+
+	auto entry = &m_socketState[rows[i]][firstFree[i]];
+	entry->m_valid = true;
+	entry->m_remoteIP = ip.m_key;
+	entry->m_isIPv6 = (ip.m_ipv6 != nullptr);
+	if(ip.m_ipv6)
+		entry->m_remoteIPv6 = *ip.m_ipv6;
+	entry->m_localPort = localPort;
+	entry->m_remotePort = remotePort;
+	EnterState(entry, TCPTableEntry::STATE_ESTABLISHED);
+	entry->m_lastRxTime = entry->m_stateTime;
+	entry->m_idleTimeout = TCP_IDLE_TIMEOUT_MS;
+	entry->m_keepalivesSent = 0;
+	entry->m_rto = TCP_RETRANSMIT_TIMEOUT_MS;
+	entry->m_persistInterval = 0;
+	entry->m_sendData = nullptr;
+	entry->m_streaming = false;
+	entry->m_closePending = false;
+	entry->m_txSegmentsAllocated = 0;
+	entry->m_unackedCount = 0;
+	entry->m_minSegments = TCP_MIN_UNACKED;
+	entry->m_maxSegments = TCP_MAX_UNACKED;
+	entry->m_unackedHead = nullptr;
+	entry->m_unackedTail = nullptr;
+	entry->m_coalesceSegment = nullptr;
+	entry->m_txBlocked = false;
+	entry->m_txClass = TX_CLASS_NORMAL;
+	entry->m_unpinnedSend = false;
+	entry->m_ackPending = false;
+	entry->m_appContext = -1;
+	return entry;
+}
+
+/**
+	@brief Marks a socket table entry as no longer in use
+ */
+void TCPProtocol::FreeSocketHandle(TCPTableEntry* state)
+{
+	size_t index = state - &m_socketState[0][0];
+	m_socketKeys[index / TCP_TABLE_WAYS].m_ways[index % TCP_TABLE_WAYS].m_localPort = 0;
+	state->m_valid = false;
+	state->m_sendData = nullptr;
+	state->m_streaming = false;
+
+	//Release the unused part of its reservation
+	size_t inUse = state->m_txSegmentsAllocated + state->m_unackedCount;
+	if(inUse < state->m_minSegments)
+		m_segmentSlotsReserved -= state->m_minSegments - inUse;
+
+	//Return any retransmit slots still held to the pool.
+	//The frames themselves should have been freed by OnConnectionClosed() already
+	while(state->m_unackedHead)
+	{
+		auto f = state->m_unackedHead;
+		state->m_unackedHead = f->m_next;
+		f->m_segment = nullptr;
+		f->m_next = m_segmentFreeList;
+		m_segmentFreeList = f;
+	}
+	state->m_unackedTail = nullptr;
+	m_segmentSlotsFree += inUse;
+	state->m_txSegmentsAllocated = 0;
+	state->m_unackedCount = 0;
+
+	if(m_lastHitState == state)
+		m_lastHitState = nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -562,28 +1886,72 @@ void TCPProtocol::OnConnectionAccepted(TCPTableEntry* /*state*/)
 {
 }
 
+/**
+	@brief Handler for completion of an outbound connection started by Connect()
+
+	The default implementation does nothing.
+ */
+void TCPProtocol::OnConnected(TCPTableEntry* /*state*/)
+{
+}
+
 /**
 	@brief Handler for the end of a connection
 
 	Override to destroy application-layer state when a connection is no longer active.
 
-	The default implementation frees all un-ACKed socket buffers and must be called by any overrides.
+	The default implementation frees all un-ACKed socket buffers, as well as any data buffered by Write(), and must be
+	called by any overrides. The stack no longer touches the buffer of any unfinished Send() after this.
  */
 void TCPProtocol::OnConnectionClosed(TCPTableEntry* state)
 {
-	for(size_t i=0; i<TCP_MAX_UNACKED; i++)
-	{
-		auto frame = state->m_unackedFrames[i].m_segment;
-		if(!frame)
-			continue;
+	state->m_sendData = nullptr;
+	state->m_streaming = false;
+	state->m_closePending = false;
 
-		//Free the frame
-		auto v4 = reinterpret_cast<IPv4Packet*>(reinterpret_cast<uint8_t*>(frame) - sizeof(IPv4Packet));
-		m_ipv4->CancelTxPacket(v4);
+	if(state->m_coalesceSegment)
+		CancelTxSegment(state->m_coalesceSegment, state);
 
-		//It's no longer in the list of un-acked frames
-		state->m_unackedFrames[i].m_segment = nullptr;
-	}
+	while(state->m_unackedHead)
+		FreeUnackedSegment(state, nullptr, state->m_unackedHead, true);
+}
+
+/**
+	@brief Handler for completion of a Send() call
+
+	Called once all of the data passed to Send() has been copied into frames, and the buffer can be reused. Data
+	may not have been ACKed yet (but will be retransmitted by the stack if necessary). In unpinned mode, it's called
+	once all of the data has been ACKed.
+
+	The default implementation does nothing.
+ */
+void TCPProtocol::OnSendComplete(TCPTableEntry* /*state*/)
+{
+}
+
+/**
+	@brief Supplies data for a stream started by StartStream()
+
+	Copy up to maxLength bytes into payload and return the number of bytes written. Returning zero pauses the stream.
+
+	The default implementation returns zero.
+ */
+uint16_t TCPProtocol::OnStreamData(TCPTableEntry* /*state*/, uint8_t* /*payload*/, uint16_t /*maxLength*/)
+{
+	return 0;
+}
+
+/**
+	@brief Handler for TX space becoming available on a socket
+
+	Called when an ACK frees up retransmit slots on this socket, or when TX frames are freed after an earlier send on
+	this socket failed (or IsTxBufferAvailable() returned false) for lack of buffers. Override to resume sending
+	without waiting for the next timer tick.
+
+	The default implementation does nothing.
+ */
+void TCPProtocol::OnTxSpaceAvailable(TCPTableEntry* /*state*/)
+{
 }
 
 /**
@@ -599,6 +1967,9 @@ bool TCPProtocol::IsPortOpen(uint16_t /*port*/)
 /**
 	@brief Handles incoming packet data.
 
+	The payload points directly into the received frame, and may be modified in place (e.g. decrypted). It is only
+	valid until this function returns, unless the handler calls RetainRxFrame() to keep the frame.
+
 	The default implementation does nothing.
  */
 void TCPProtocol::OnRxData(TCPTableEntry* /*state*/, uint8_t* /*payload*/, uint16_t /*payloadLen*/)
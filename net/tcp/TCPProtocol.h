@@ -37,25 +37,149 @@
 
 #include "TCPSegment.h"
 
-//Default of 4 pending TCP segments allowed in flight
+//Default of 4 pending TCP segments allowed in flight per socket (can be changed per socket with SetSegmentLimits())
 #ifndef TCP_MAX_UNACKED
 #define TCP_MAX_UNACKED 4
 #endif
 
+//Default number of in-flight segments guaranteed to each socket, regardless of what other sockets are doing
+#ifndef TCP_MIN_UNACKED
+#define TCP_MIN_UNACKED 1
+#endif
+
+//Total number of in-flight segments tracked across all sockets
+#ifndef TCP_SEGMENT_POOL_SIZE
+#define TCP_SEGMENT_POOL_SIZE (TCP_TABLE_LINES * TCP_TABLE_WAYS * 2)
+#endif
+
+//Max number of sockets which can have an ACK deferred at once (see SetAckDeferral()).
+//Further sockets ACK immediately.
+#ifndef TCP_MAX_DEFERRED_ACKS
+#define TCP_MAX_DEFERRED_ACKS 4
+#endif
+
+//Retransmit timeout in units of 10 Hz aging ticks (legacy setting, use TCP_RETRANSMIT_TIMEOUT_MS instead)
 #ifndef TCP_RETRANSMIT_TIMEOUT
 #define TCP_RETRANSMIT_TIMEOUT 2
 #endif
 
+//Retransmit timeout in milliseconds
+#ifndef TCP_RETRANSMIT_TIMEOUT_MS
+#define TCP_RETRANSMIT_TIMEOUT_MS (TCP_RETRANSMIT_TIMEOUT * 100)
+#endif
+
+//Upper limit for exponential backoff of the retransmit timeout and zero-window probe interval
+#ifndef TCP_RETRANSMIT_TIMEOUT_MAX_MS
+#define TCP_RETRANSMIT_TIMEOUT_MAX_MS 10000
+#endif
+
+//Send keepalive probes once a connection has been idle this long (zero disables keepalives)
+#ifndef TCP_KEEPALIVE_IDLE_MS
+#define TCP_KEEPALIVE_IDLE_MS 60000
+#endif
+
+//Time between unanswered keepalive probes
+#ifndef TCP_KEEPALIVE_INTERVAL_MS
+#define TCP_KEEPALIVE_INTERVAL_MS 10000
+#endif
+
+//Number of unanswered keepalive probes before the connection is considered dead and aborted
+#ifndef TCP_KEEPALIVE_PROBES
+#define TCP_KEEPALIVE_PROBES 5
+#endif
+
+//Default for aborting connections which have received nothing for this long, even if the peer is alive (zero disables)
+#ifndef TCP_IDLE_TIMEOUT_MS
+#define TCP_IDLE_TIMEOUT_MS 0
+#endif
+
+//Max time to wait for the peer to finish closing a connection (FIN-WAIT and LAST-ACK states)
+#ifndef TCP_FIN_TIMEOUT_MS
+#define TCP_FIN_TIMEOUT_MS 10000
+#endif
+
+//Time to linger in TIME-WAIT after both sides have closed, to ACK retransmitted FINs
+#ifndef TCP_TIME_WAIT_MS
+#define TCP_TIME_WAIT_MS 2000
+#endif
+
+//Max time to wait for the remote side to answer an outbound connection request
+#ifndef TCP_CONNECT_TIMEOUT_MS
+#define TCP_CONNECT_TIMEOUT_MS 10000
+#endif
+
+//Range of local port numbers used for outbound connections (RFC 6335 dynamic port range by default)
+#ifndef TCP_EPHEMERAL_PORT_MIN
+#define TCP_EPHEMERAL_PORT_MIN 49152
+#endif
+#ifndef TCP_EPHEMERAL_PORT_MAX
+#define TCP_EPHEMERAL_PORT_MAX 65535
+#endif
+
+/**
+	@brief Remote address of a TCP connection, which may be IPv4 or IPv6
+
+	The socket table is keyed on a 32-bit address, so IPv4 lookups stay as cheap as before. IPv6 peers use a fold of
+	the full address in its place, and the full address is checked once the key matches.
+ */
+class TCPRemoteAddress
+{
+public:
+	TCPRemoteAddress(IPv4Address ip)
+	: m_key(ip)
+	, m_ipv6(nullptr)
+	{}
+
+	TCPRemoteAddress(const IPv6Address& ip)
+	: m_ipv6(&ip)
+	{ m_key.m_word = ip.m_words[0] ^ ip.m_words[1] ^ ip.m_words[2] ^ ip.m_words[3]; }
+
+	///@brief The IPv4 address, or fold of the IPv6 address, used in the socket table keys
+	IPv4Address m_key;
+
+	///@brief The full IPv6 address (null for IPv4)
+	const IPv6Address* m_ipv6;
+};
+
+/**
+	@brief A segment which has been sent but not ACKed
+
+	These are allocated from a pool shared by all sockets, and kept in a singly linked list per socket in order of
+	sequence number.
+ */
 class TCPSentSegment
 {
 public:
-	TCPSentSegment(TCPSegment* seg = nullptr)
-	: m_segment(seg)
-	, m_agingTicks(0)
+	TCPSentSegment()
+	: m_segment(nullptr)
+	, m_sendTime(0)
+	, m_sequence(0)
+	, m_dataOffset(0)
+	, m_length(0)
+	, m_next(nullptr)
 	{}
 
+	/**
+		@brief The frame holding the segment, kept for retransmits
+
+		Null for segments sent by an unpinned Send(), which are regenerated from the application buffer instead.
+	 */
 	TCPSegment* m_segment;
-	uint32_t m_agingTicks;
+
+	///@brief Timestamp (in ms) at which the segment was most recently sent
+	uint32_t m_sendTime;
+
+	///@brief Sequence number of the first payload byte
+	uint32_t m_sequence;
+
+	///@brief Offset of the payload within the Send() buffer (unpinned segments only)
+	uint32_t m_dataOffset;
+
+	///@brief Payload length, in bytes
+	uint16_t m_length;
+
+	///@brief Next segment on the same socket (or next free entry in the pool)
+	TCPSentSegment* m_next;
 };
 
 /**
@@ -66,7 +190,37 @@ class TCPTableEntry
 public:
 	TCPTableEntry()
 	: m_valid(false)
+	, m_isIPv6(false)
+	, m_state(STATE_ESTABLISHED)
+	, m_stateTime(0)
+	, m_lastRxTime(0)
+	, m_idleTimeout(TCP_IDLE_TIMEOUT_MS)
+	, m_keepalivesSent(0)
 	, m_remoteSeqSent(0)
+	, m_remoteMSS(TCP_DEFAULT_MSS)
+	, m_remoteWindow(0)
+	, m_sendWindowEdge(0)
+	, m_rto(TCP_RETRANSMIT_TIMEOUT_MS)
+	, m_persistTime(0)
+	, m_persistInterval(0)
+	, m_sendData(nullptr)
+	, m_sendLength(0)
+	, m_sendOffset(0)
+	, m_streaming(false)
+	, m_closePending(false)
+	, m_txSegmentsAllocated(0)
+	, m_unackedCount(0)
+	, m_minSegments(TCP_MIN_UNACKED)
+	, m_maxSegments(TCP_MAX_UNACKED)
+	, m_unackedHead(nullptr)
+	, m_unackedTail(nullptr)
+	, m_coalesceSegment(nullptr)
+	, m_coalesceLength(0)
+	, m_txBlocked(false)
+	, m_txClass(TX_CLASS_NORMAL)
+	, m_unpinnedSend(false)
+	, m_ackPending(false)
+	, m_appContext(-1)
 	{
 	}
 
@@ -75,6 +229,65 @@ public:
 	uint16_t m_localPort;
 	uint16_t m_remotePort;
 
+	///@brief True if the connection runs over IPv6 (m_remoteIP then holds the lookup key fold of m_remoteIPv6)
+	bool m_isIPv6;
+
+	///@brief Remote address of an IPv6 connection
+	IPv6Address m_remoteIPv6;
+
+	///@brief Checks the parts of the remote address not covered by the socket table key
+	bool MatchesAddress(const TCPRemoteAddress& addr) const
+	{
+		if(addr.m_ipv6)
+			return m_isIPv6 && (m_remoteIPv6 == *addr.m_ipv6);
+		return !m_isIPv6;
+	}
+
+	///@brief Cached Ethernet and IPv4 headers for segments sent on an IPv4 connection
+	IPv4TxTemplate m_txTemplate;
+
+	///@brief Returns the header template for the connection, if it has one
+	IPv4TxTemplate* GetTxTemplate()
+	{ return m_isIPv6 ? nullptr : &m_txTemplate; }
+
+	///@brief Gets the remote address of the connection
+	TCPRemoteAddress GetRemoteAddress() const
+	{
+		if(m_isIPv6)
+			return TCPRemoteAddress(m_remoteIPv6);
+		return TCPRemoteAddress(m_remoteIP);
+	}
+
+	///@brief Position in the connection state machine
+	enum state_t
+	{
+		STATE_SYN_SENT,			//Outbound connection, we sent a SYN and are waiting for the SYN-ACK
+
+		STATE_ESTABLISHED,		//Connection is open (for inbound connections, as soon as we send the SYN-ACK)
+
+		//Active close
+		STATE_FIN_WAIT_1,		//We sent a FIN, it hasn't been ACKed yet
+		STATE_FIN_WAIT_2,		//Our FIN was ACKed, waiting for the peer's FIN
+
+		//here and beyond, OnConnectionClosed() has already been called
+		STATE_TIME_WAIT,		//Both sides have closed, lingering to ACK retransmitted FINs
+
+		//Passive close
+		STATE_LAST_ACK			//Peer sent a FIN and we sent ours, waiting for it to be ACKed
+	} m_state;
+
+	///@brief Timestamp (in ms) at which we entered the current state
+	uint32_t m_stateTime;
+
+	///@brief Timestamp (in ms) of the most recent segment received on this socket
+	uint32_t m_lastRxTime;
+
+	///@brief Abort the connection after this many ms without receiving anything (zero to disable)
+	uint32_t m_idleTimeout;
+
+	///@brief Number of keepalive probes sent since we last heard from the peer
+	uint8_t m_keepalivesSent;
+
 	/**
 		@brief Expected sequence number of the next incoming packet.
 
@@ -96,22 +309,118 @@ public:
 	///@brief Initial sequence number sent by remote side
 	uint32_t m_remoteInitialSeq;
 
-	//TODO: aging for session idle closure
+	///@brief Maximum segment size the remote side is willing to accept
+	uint16_t m_remoteMSS;
+
+	///@brief Receive window most recently advertised by the remote side
+	uint16_t m_remoteWindow;
+
+	///@brief Sequence number just past the end of the remote side's receive window
+	uint32_t m_sendWindowEdge;
+
+	///@brief Current retransmit timeout, in ms (backs off exponentially while segments go unACKed)
+	uint32_t m_rto;
+
+	///@brief Timestamp (in ms) at which the next zero-window probe is due
+	uint32_t m_persistTime;
+
+	///@brief Interval between zero-window probes, in ms (zero if the persist timer isn't running)
+	uint32_t m_persistInterval;
+
+	///@brief Application buffer being transmitted by TCPProtocol::Send() (null if no send is in progress)
+	const uint8_t* m_sendData;
+
+	///@brief Length of m_sendData, in bytes
+	uint32_t m_sendLength;
+
+	///@brief Number of bytes of m_sendData which have been segmented and sent so far
+	uint32_t m_sendOffset;
+
+	///@brief True if TCPProtocol::StartStream() is pulling data from the application via OnStreamData()
+	bool m_streaming;
+
+	///@brief True if TCPProtocol::CloseSocket() was called, but the FIN has to wait for m_sendData to be segmented
+	bool m_closePending;
+
+	/**
+		@brief Number of segments returned by TCPProtocol::GetTxSegment() which have not yet been sent or cancelled
+
+		Each of these has a retransmit slot reserved for it, so a segment held by the application for a while can't
+		end up being sent without retransmit protection.
+	 */
+	uint8_t m_txSegmentsAllocated;
+
+	///@brief Number of segments in the m_unackedHead list
+	uint8_t m_unackedCount;
+
+	///@brief Number of retransmit slots in the shared pool reserved for this socket
+	uint8_t m_minSegments;
+
+	///@brief Max number of retransmit slots this socket may use
+	uint8_t m_maxSegments;
+
+	///@brief Oldest segment that has been sent but not ACKed (null if none)
+	TCPSentSegment* m_unackedHead;
 
-	///@brief List of frames that have been sent but not ACKed
-	TCPSentSegment m_unackedFrames[TCP_MAX_UNACKED];
+	///@brief Newest segment that has been sent but not ACKed (null if none)
+	TCPSentSegment* m_unackedTail;
+
+	///@brief Partially filled segment holding data from TCPProtocol::Write() (null if none)
+	TCPSegment* m_coalesceSegment;
+
+	///@brief Number of payload bytes in m_coalesceSegment
+	uint16_t m_coalesceLength;
+
+	///@brief True if a send on this socket failed for lack of buffers, and OnTxSpaceAvailable() should be called
+	bool m_txBlocked;
+
+	///@brief Priority class for data segments on this socket (ACKs and other control segments always use CONTROL)
+	txclass_t m_txClass;
+
+	///@brief True if Send() should free frames right after sending, and regenerate them from its buffer if needed
+	bool m_unpinnedSend;
+
+	///@brief True if received data hasn't been ACKed yet, and the socket is in the deferred ACK list
+	bool m_ackPending;
+
+	/**
+		@brief Opaque slot for use by the application layer, reset to -1 when the socket is allocated
+
+		TCPServer stores the connection ID here so it can find the connection context without a search.
+	 */
+	int m_appContext;
+};
+
+/**
+	@brief Lookup key for a single entry in the TCP socket table
+
+	This is a copy of the connection 4-tuple from the TCPTableEntry, kept separately so that lookups only touch a
+	small amount of memory. A local port of zero marks the entry as unused.
+ */
+class TCPTableKey
+{
+public:
+	bool Matches(IPv4Address ip, uint16_t localPort, uint16_t remotePort) const
+	{ return (m_remoteIP == ip) && (m_localPort == localPort) && (m_remotePort == remotePort); }
+
+	IPv4Address m_remoteIP;
+	uint16_t m_localPort;
+	uint16_t m_remotePort;
 };
 
 /**
-	@brief A single bank of the TCP socket table (direct mapped)
+	@brief Lookup keys for all ways of a single line of the TCP socket table
+
+	8 bytes per way, so with the default of 4 ways an entire line fits in one 32-byte cache line.
  */
-class TCPTableWay
+class __attribute__((aligned(32))) TCPTableKeyLine
 {
 public:
-	TCPTableEntry m_lines[TCP_TABLE_LINES];
+	TCPTableKey m_ways[TCP_TABLE_WAYS];
 };
 
 #define TCP_IPV4_PAYLOAD_MTU (IPV4_PAYLOAD_MTU - 20)
+#define TCP_IPV6_PAYLOAD_MTU (IPV6_PAYLOAD_MTU - 20)
 
 /**
 	@brief TCP protocol driver
@@ -119,44 +428,141 @@ public:
 class TCPProtocol
 {
 public:
-	TCPProtocol(IPv4Protocol* ipv4);
-	//TODO: IPv6 backend
+	TCPProtocol(IPv4Protocol* ipv4, IPv6Protocol* ipv6 = nullptr);
 
 	bool IsTxBufferAvailable()
-	{ return m_ipv4->IsTxBufferAvailable(); }
+	{ return m_eth->IsTxBufferAvailable(); }
+
+	bool IsTxBufferAvailable(TCPTableEntry* state);
 
 	void OnRxPacket(
 		TCPSegment* segment,
 		uint16_t ipPayloadLength,
-		IPv4Address sourceAddress,
+		const TCPRemoteAddress& sourceAddress,
 		uint16_t pseudoHeaderChecksum);
 
+	///@brief Gets the IPv4 stack we're attached to (may be null)
+	IPv4Protocol* GetIPv4()
+	{ return m_ipv4; }
+
+	///@brief Gets the IPv6 stack we're attached to (may be null)
+	IPv6Protocol* GetIPv6()
+	{ return m_ipv6; }
+
+	void OnAgingTick();
 	virtual void OnAgingTick10x();
+	void OnTimer();
+	uint32_t GetNextDeadline();
+	void OnTxSpaceAvailable();
+
+	void SetAckDeferral(bool defer);
+	void FlushDeferredAcks();
 
 	TCPSegment* GetTxSegment(TCPTableEntry* state);
 
+	void SendTxSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t payloadLength);
+
+	///@brief Cancels sending of a packet
+	void CancelTxSegment(TCPSegment* segment, TCPTableEntry* state);
+
+	TCPTableEntry* Connect(const TCPRemoteAddress& ip, uint16_t remotePort, uint16_t localPort = 0);
+
+	/**
+		@brief Marks this instance as one shard of a stack which is split across several threads by flow hash
+
+		Connect() then only picks local ports for which GetFlowShard() returns this shard, so that replies to our
+		outbound connections are steered back to us. An explicitly chosen local port is used as-is.
+	 */
+	void SetShard(uint32_t index, uint32_t count)
+	{
+		m_shardIndex = index;
+		m_shardCount = count ? count : 1;
+	}
+
+	static uint32_t GetFlowShard(IPv4Address key, uint16_t localPort, uint16_t remotePort, uint32_t count);
+
+	bool Send(TCPTableEntry* state, const uint8_t* data, uint32_t len);
+
+	bool StartStream(TCPTableEntry* state);
+
+	///@brief Stops pulling data from OnStreamData() on this socket
+	void StopStream(TCPTableEntry* state)
+	{ state->m_streaming = false; }
+
+	///@brief Checks if a previous Send() call on this socket is still in progress
+	bool IsSendInProgress(TCPTableEntry* state)
+	{ return state->m_sendData != nullptr; }
+
+	uint32_t Write(TCPTableEntry* state, const uint8_t* data, uint32_t len);
+	void Flush(TCPTableEntry* state);
+
+	///@brief Checks if any data sent on this socket has not yet been ACKed
+	bool HasUnackedData(TCPTableEntry* state)
+	{ return state->m_unackedHead != nullptr; }
+
+	bool SetSegmentLimits(TCPTableEntry* state, uint8_t minSegments, uint8_t maxSegments);
+
+	///@brief Sets the priority class used for data segments on this socket
+	void SetTxClass(TCPTableEntry* state, txclass_t txclass)
+	{ state->m_txClass = txclass; }
+
 	/**
-		@brief Sends a TCP segment on a given socket handle
+		@brief Enables or disables unpinned mode for Send() on this socket
+
+		In unpinned mode, each segment's frame is returned to the driver as soon as it has been sent, and only the
+		sequence range is remembered. Retransmits are regenerated from the Send() buffer into a fresh frame, so the
+		buffer is held until every byte has been ACKed rather than just segmented. This keeps a deep send window from
+		tying up the (usually small) pool of DMA capable TX frames.
+
+		Must not be changed while a Send() is in progress.
 	 */
-	void SendTxSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t payloadLength)
+	void SetUnpinnedSend(TCPTableEntry* state, bool unpinned)
+	{ state->m_unpinnedSend = unpinned; }
+
+	/**
+		@brief Gets the number of bytes the remote side's receive window lets us send right now
+	 */
+	uint32_t GetSendWindow(TCPTableEntry* state)
 	{
-		//Update the socket state to expect a new ACK number in response to this segment
-		auto packet = reinterpret_cast<IPv4Packet*>(reinterpret_cast<uint8_t*>(segment) - sizeof(IPv4Packet));
-		state->m_localSeq += payloadLength;
+		int32_t window = state->m_sendWindowEdge - state->m_localSeq;
+		return (window > 0) ? window : 0;
+	}
 
-		//Add the PSH flag since this segment contains data
-		segment->m_offsetAndFlags |= TCPSegment::FLAG_PSH;
+	///@brief Gets the largest segment payload our network layer can carry on this socket
+	static uint16_t GetLocalMSS(TCPTableEntry* state)
+	{ return state->m_isIPv6 ? TCP_IPV6_PAYLOAD_MTU : TCP_IPV4_PAYLOAD_MTU; }
 
-		//Reay to send
-		SendSegment(state, segment, packet, payloadLength + sizeof(TCPSegment));
+	///@brief Gets the largest payload we can put in a single segment on this socket
+	uint16_t GetMaxSegmentSize(TCPTableEntry* state)
+	{
+		uint16_t mss = GetLocalMSS(state);
+		if(state->m_remoteMSS < mss)
+			return state->m_remoteMSS;
+		return mss;
 	}
 
-	///@brief Cancels sending of a packet
-	void CancelTxSegment(TCPSegment* segment, TCPTableEntry* state);
+	///@brief Sets the idle timeout for a socket, in ms (zero to disable)
+	void SetIdleTimeout(TCPTableEntry* state, uint32_t timeoutMs)
+	{ state->m_idleTimeout = timeoutMs; }
 
 	///@brief Close a socket from the server side
 	void CloseSocket(TCPTableEntry* state);
 
+	void AbortSocket(TCPTableEntry* state);
+
+	/**
+		@brief Takes ownership of the frame containing the payload passed to OnRxData()
+
+		Returns nullptr if the frame can't be held, in which case the data must be copied before OnRxData() returns.
+		See EthernetProtocol::RetainRxFrame() for details.
+	 */
+	EthernetFrame* RetainRxFrame()
+	{ return m_eth->RetainRxFrame(); }
+
+	///@brief Releases a frame previously taken by RetainRxFrame()
+	void ReleaseRxFrame(EthernetFrame* frame)
+	{ m_eth->ReleaseRxFrame(frame); }
+
 protected:
 	virtual bool IsPortOpen(uint16_t port);
 
@@ -169,26 +575,122 @@ protected:
 
 	virtual void OnRxData(TCPTableEntry* state, uint8_t* payload, uint16_t payloadLen);
 	virtual void OnConnectionAccepted(TCPTableEntry* state);
+	virtual void OnConnected(TCPTableEntry* state);
 	virtual void OnConnectionClosed(TCPTableEntry* state);
+	virtual void OnSendComplete(TCPTableEntry* state);
+	virtual void OnTxSpaceAvailable(TCPTableEntry* state);
+	virtual uint16_t OnStreamData(TCPTableEntry* state, uint8_t* payload, uint16_t maxLength);
 
 protected:
-	void OnRxSYN(TCPSegment* segment, IPv4Address sourceAddress);
-	void OnRxRST(TCPSegment* segment, IPv4Address sourceAddress);
-	void OnRxACK(TCPSegment* segment, IPv4Address sourceAddress, uint16_t payloadLen);
+	void OnRxSYN(TCPSegment* segment, const TCPRemoteAddress& sourceAddress);
+	void OnRxSYNACK(TCPSegment* segment, const TCPRemoteAddress& sourceAddress);
+	void OnRxRST(TCPSegment* segment, const TCPRemoteAddress& sourceAddress);
+	void OnRxACK(TCPSegment* segment, const TCPRemoteAddress& sourceAddress, uint16_t payloadLen);
+	void OnRxFIN(TCPTableEntry* state);
+	bool DeferAck(TCPTableEntry* state);
+
+	///@brief Moves a socket to a new state and starts the state's timeout
+	void EnterState(TCPTableEntry* state, TCPTableEntry::state_t newState)
+	{
+		state->m_state = newState;
+		state->m_stateTime = GetTimeMs();
+	}
+
+	void SendSYN(TCPTableEntry* state);
+	void SendFIN(TCPTableEntry* state);
+	void SendProbe(TCPTableEntry* state);
+
+	bool IsSendWindowOpen(TCPTableEntry* state);
+
+	void ContinueSend(TCPTableEntry* state);
+	void ContinueStream(TCPTableEntry* state);
+	void SendDataSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t payloadLength, bool pin);
+	void RegenerateSegment(TCPTableEntry* state, TCPSentSegment* seg);
+	bool HasUnpinnedData(TCPTableEntry* state);
 
 	uint16_t Hash(IPv4Address ip, uint16_t localPort, uint16_t remotePort);
+	uint16_t AlternateHash(IPv4Address ip, uint16_t localPort, uint16_t remotePort);
+
+	TCPTableEntry* AllocateSocketHandle(const TCPRemoteAddress& ip, uint16_t localPort, uint16_t remotePort);
+	uint16_t AllocateEphemeralPort(const TCPRemoteAddress& ip, uint16_t remotePort);
+	void FreeSocketHandle(TCPTableEntry* state);
+	TCPTableEntry* GetSocketState(const TCPRemoteAddress& ip, uint16_t localPort, uint16_t remotePort);
+	TCPSegment* CreateReply(TCPTableEntry* state, txclass_t txclass = TX_CLASS_CONTROL);
+
+	void SendSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t length = sizeof(TCPSegment), bool pin = true);
+	void TransmitSegment(TCPTableEntry* state, TCPSegment* segment, uint16_t length, bool markFree);
+
+	TCPSegment* AllocatePacket(const TCPRemoteAddress& dest, txclass_t txclass, IPv4TxTemplate* tmpl = nullptr);
+	void SendPacket(TCPSegment* segment, uint16_t length, bool ipv6, bool markFree, IPv4TxTemplate* tmpl = nullptr);
+	void ResendPacket(TCPSegment* segment, bool ipv6);
+	void CancelPacket(TCPSegment* segment, bool ipv6);
+
+	///@brief Gets the IPv4 packet containing a segment
+	static IPv4Packet* GetIPv4Packet(TCPSegment* segment)
+	{ return reinterpret_cast<IPv4Packet*>(reinterpret_cast<uint8_t*>(segment) - sizeof(IPv4Packet)); }
+
+	///@brief Gets the IPv6 packet containing a segment
+	static IPv6Packet* GetIPv6Packet(TCPSegment* segment)
+	{ return reinterpret_cast<IPv6Packet*>(reinterpret_cast<uint8_t*>(segment) - sizeof(IPv6Packet)); }
 
-	TCPTableEntry* AllocateSocketHandle(uint16_t hash);
-	TCPTableEntry* GetSocketState(IPv4Address ip, uint16_t localPort, uint16_t remotePort);
-	IPv4Packet* CreateReply(TCPTableEntry* state);
+	bool ClaimSegmentSlot(TCPTableEntry* state);
+	void ReleaseSegmentSlot(TCPTableEntry* state);
+	void FreeUnackedSegment(TCPTableEntry* state, TCPSentSegment* prev, TCPSentSegment* seg, bool freeFrame);
 
-	void SendSegment(TCPTableEntry* state, TCPSegment* segment, IPv4Packet* packet, uint16_t length = sizeof(TCPSegment));
+	///@brief Gets the current time from the Ethernet layer
+	uint32_t GetTimeMs()
+	{ return m_eth->GetTimeMs(); }
 
-	///@brief The IPv4 protocol stack
+	///@brief The IPv4 protocol stack (if present)
 	IPv4Protocol* m_ipv4;
 
-	///@brief The socket state table
-	TCPTableWay m_socketTable[TCP_TABLE_WAYS];
+	///@brief The IPv6 protocol stack (if present)
+	IPv6Protocol* m_ipv6;
+
+	///@brief The Ethernet stack under whichever IP stacks we're using
+	EthernetProtocol* m_eth;
+
+	///@brief The socket lookup table (same indexing as m_socketState)
+	TCPTableKeyLine m_socketKeys[TCP_TABLE_LINES];
+
+	///@brief The socket state table, indexed by [line][way]
+	TCPTableEntry m_socketState[TCP_TABLE_LINES][TCP_TABLE_WAYS];
+
+	///@brief Key of the most recently looked up socket
+	TCPTableKey m_lastHitKey;
+
+	///@brief State of the most recently looked up socket (null if not valid)
+	TCPTableEntry* m_lastHitState;
+
+	///@brief Storage for tracking sent but un-ACKed segments on all sockets
+	TCPSentSegment m_segmentPool[TCP_SEGMENT_POOL_SIZE];
+
+	///@brief Unused entries in m_segmentPool
+	TCPSentSegment* m_segmentFreeList;
+
+	///@brief Number of pool entries not in use or claimed by GetTxSegment()
+	uint16_t m_segmentSlotsFree;
+
+	///@brief Number of free pool entries held back to meet the m_minSegments guarantee of all sockets
+	uint16_t m_segmentSlotsReserved;
+
+	///@brief Next local port number to try for an outbound connection (zero until the first Connect() call)
+	uint16_t m_nextEphemeralPort;
+
+	///@brief Which shard of a sharded stack we are (see SetShard())
+	uint32_t m_shardIndex;
+
+	///@brief Number of shards in the stack (1 if not sharded)
+	uint32_t m_shardCount;
+
+	///@brief True if ACKs for received data should wait for FlushDeferredAcks()
+	bool m_deferAcks;
+
+	///@brief Sockets with an ACK waiting for FlushDeferredAcks()
+	TCPTableEntry* m_deferredAcks[TCP_MAX_DEFERRED_ACKS];
+
+	///@brief Number of valid entries in m_deferredAcks
+	uint8_t m_deferredAckCount;
 };
 
 #endif
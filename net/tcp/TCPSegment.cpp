@@ -29,3 +29,66 @@
 
 #include <staticnet-config.h>
 #include <staticnet/stack/staticnet.h>
+
+/**
+	@brief Gets the maximum segment size option from a SYN segment
+
+	Returns TCP_DEFAULT_MSS if no MSS option is present. Values below TCP_MIN_MSS are clamped up to it.
+ */
+uint16_t TCPSegment::GetMSSOption()
+{
+	auto opt = reinterpret_cast<uint8_t*>(this) + sizeof(TCPSegment);
+	auto end = Payload();
+
+	while(opt < end)
+	{
+		//End of option list
+		if(opt[0] == 0)
+			break;
+
+		//No-op for padding
+		if(opt[0] == 1)
+		{
+			opt ++;
+			continue;
+		}
+
+		//Everything else has a length field. Stop on malformed options
+		if( (opt + 1) >= end)
+			break;
+		uint8_t len = opt[1];
+		if( (len < 2) || ( (opt + len) > end) )
+			break;
+
+		//Maximum segment size
+		if( (opt[0] == 2) && (len == 4) )
+		{
+			uint16_t mss = (opt[2] << 8) | opt[3];
+			if(mss < TCP_MIN_MSS)
+				return TCP_MIN_MSS;
+			return mss;
+		}
+
+		opt += len;
+	}
+
+	return TCP_DEFAULT_MSS;
+}
+
+/**
+	@brief Adds a maximum segment size option to a SYN segment being built, and updates the data offset to match
+
+	Must be called before anything else is written to the option area.
+	Returns the size of the header including options.
+ */
+uint16_t TCPSegment::SetMSSOption(uint16_t mss)
+{
+	auto opt = reinterpret_cast<uint8_t*>(this) + sizeof(TCPSegment);
+	opt[0] = 2;
+	opt[1] = 4;
+	opt[2] = mss >> 8;
+	opt[3] = mss & 0xff;
+
+	m_offsetAndFlags = (m_offsetAndFlags & 0x0fff) | (6 << 12);
+	return sizeof(TCPSegment) + 4;
+}
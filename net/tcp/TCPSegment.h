@@ -35,8 +35,22 @@
 #ifndef TCPSegment_h
 #define TCPSegment_h
 
+#include "../../util/BigEndian.h"
+
+///@brief MSS to assume if the remote side doesn't send one (RFC 9293 section 3.7.1)
+#define TCP_DEFAULT_MSS 536
+
+//Smallest peer MSS we accept. Anything lower is clamped up, so a bogus or hostile MSS option can't make us spray
+//tiny (or zero length) segments
+#ifndef TCP_MIN_MSS
+#define TCP_MIN_MSS 64
+#endif
+
 /**
 	@brief A TCP segment sent over IPv4
+
+	Header fields are stored in network byte order and converted on access (see BigEndian), except for the checksum
+	which is always handled in network byte order.
  */
 class __attribute__((packed)) TCPSegment
 {
@@ -52,21 +66,6 @@ public:
 		FLAG_ACK	= 0x10
 	};
 
-	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// Byte ordering correction
-
-	void ByteSwap()
-	{
-		m_sourcePort = __builtin_bswap16(m_sourcePort);
-		m_destPort = __builtin_bswap16(m_destPort);
-		m_sequence = __builtin_bswap32(m_sequence);
-		m_ack = __builtin_bswap32(m_ack);
-		m_offsetAndFlags = __builtin_bswap16(m_offsetAndFlags);
-		m_windowSize = __builtin_bswap16(m_windowSize);
-		//don't swap checksum, we do that in network byte order
-		//ignore urgent pointer
-	}
-
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Accessors for actual packet data
 
@@ -76,32 +75,35 @@ public:
 	uint8_t* Payload()
 	{ return reinterpret_cast<uint8_t*>(this) + GetDataOffsetBytes(); }
 
+	uint16_t GetMSSOption();
+	uint16_t SetMSSOption(uint16_t mss);
+
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Data members
 
 	///@brief Source port number
-	uint16_t m_sourcePort;
+	be16 m_sourcePort;
 
 	///@brief Destination port number
-	uint16_t m_destPort;
+	be16 m_destPort;
 
 	///@brief Sequence number
-	uint32_t m_sequence;
+	be32 m_sequence;
 
 	///@brief Acknowledgement number
-	uint32_t m_ack;
+	be32 m_ack;
 
 	///@brief Data offset and flags
-	uint16_t m_offsetAndFlags;
+	be16 m_offsetAndFlags;
 
 	///@brief Window size (before scaling)
-	uint16_t m_windowSize;
+	be16 m_windowSize;
 
 	///@brief Checksum
 	uint16_t m_checksum;
 
 	///@brief Urgent pointer (ignored)
-	uint16_t m_urgent;
+	be16 m_urgent;
 
 	//Options and data apper after this
 };
@@ -55,6 +55,16 @@ public:
 	virtual bool OnRxData(TCPTableEntry* socket, uint8_t* payload, uint16_t payloadLen) =0;
 	virtual void GracefulDisconnect(int id, TCPTableEntry* socket) =0;
 
+	/**
+		@brief Called when a socket which was blocked on TX buffers can send again
+
+		The TCPProtocol subclass should forward TCPProtocol::OnTxSpaceAvailable() here, just like OnRxData() etc.
+
+		The default implementation does nothing.
+	 */
+	virtual void OnTxSpaceAvailable(TCPTableEntry* /*socket*/)
+	{}
+
 	TCPSegment* GetTxSegment(TCPTableEntry* socket)
 	{ return m_tcp.GetTxSegment(socket); }
 
@@ -62,15 +72,18 @@ protected:
 
 	/**
 		@brief Finds the connection ID for a TCP socket, or returns -1 if it's not a currently connected session
+
+		The ID is stored in the socket's application context slot by AllocateConnectionID(). Since the slot is not
+		cleared when a connection closes, validate it against our own table before trusting it.
 	 */
 	int GetConnectionID(TCPTableEntry* socket)
 	{
-		//Just a linear search for now
-		for(int i=0; i<MAXCONNS; i++)
-		{
-			if(m_state[i].m_valid && (m_state[i].m_socket == socket))
-				return i;
-		}
+		int id = socket->m_appContext;
+		if( (id < 0) || (id >= MAXCONNS) )
+			return -1;
+
+		if(m_state[id].m_valid && (m_state[id].m_socket == socket))
+			return id;
 
 		return -1;
 	}
@@ -87,6 +100,7 @@ protected:
 				m_state[i].Clear();
 				m_state[i].m_valid = true;
 				m_state[i].m_socket = socket;
+				socket->m_appContext = i;
 				return i;
 			}
 		}
@@ -36,25 +36,18 @@
 #define UDPPacket_h
 
 #include "../ipv4/IPv4Packet.h"
+#include "../../util/BigEndian.h"
 
 /**
 	@brief A UDP packet sent over IPv4
+
+	Header fields are stored in network byte order and converted on access (see BigEndian), except for the checksum
+	which is always handled in network byte order.
  */
 class UDPPacket
 {
 public:
 
-	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// Byte ordering correction
-
-	void ByteSwap()
-	{
-		m_sourcePort = __builtin_bswap16(m_sourcePort);
-		m_destPort = __builtin_bswap16(m_destPort);
-		m_len = __builtin_bswap16(m_len);
-		//don't swap checksum, we do that in network byte order
-	}
-
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// Accessors for actual packet data
 
@@ -68,13 +61,13 @@ public:
 	// Data members
 
 	///@brief Source port number
-	uint16_t m_sourcePort;
+	be16 m_sourcePort;
 
 	///@brief Destination port number
-	uint16_t m_destPort;
+	be16 m_destPort;
 
 	///@brief Packet length
-	uint16_t m_len;
+	be16 m_len;
 
 	///@brief Checksum
 	uint16_t m_checksum;
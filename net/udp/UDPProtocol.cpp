@@ -65,7 +65,6 @@ void UDPProtocol::OnRxPacket(
 	{
 		return;
 	}
-	packet->ByteSwap();
 
 	//Sanity check packet length fits in the packet
 	if(packet->m_len > ipPayloadLength)
@@ -81,10 +80,10 @@ void UDPProtocol::OnRxPacket(
 #ifdef HAVE_ITCM
 __attribute__((section(".tcmtext")))
 #endif
-UDPPacket* UDPProtocol::GetTxPacket(IPv4Address dstip)
+UDPPacket* UDPProtocol::GetTxPacket(IPv4Address dstip, txclass_t txclass)
 {
 	//Allocate the frame and fail if we couldn't allocate one
-	auto reply = m_ipv4->GetTxPacket(dstip, IP_PROTO_UDP);
+	auto reply = m_ipv4->GetTxPacket(dstip, IP_PROTO_UDP, txclass);
 	if(reply == nullptr)
 		return nullptr;
 
@@ -122,9 +121,6 @@ void UDPProtocol::SendTxPacket(UDPPacket* packet, uint16_t sport, uint16_t dport
 	//Zeroize the checksum when computing it
 	packet->m_checksum = 0;
 
-	//Need to be in network byte order before we send
-	packet->ByteSwap();
-
 	#ifdef HAVE_UDP_V4_CHECKSUM_OFFLOAD
 		packet->m_checksum = 0x0000;	//will be filled in by hardware, but don't leave uninitialized
 	#else
@@ -60,7 +60,7 @@ public:
 	{}
 
 	///@brief Allocates an outbound packet
-	UDPPacket* GetTxPacket(IPv4Address dstip);
+	UDPPacket* GetTxPacket(IPv4Address dstip, txclass_t txclass = TX_CLASS_NORMAL);
 
 	///@brief Cancels sending of a packet
 	void CancelTxPacket(UDPPacket* packet);
@@ -73,7 +73,28 @@ __attribute__((section(".tcmtext")))
 #endif
 bool SFTPServer::OnRxData(int id, SFTPConnectionState* state, TCPTableEntry* socket, uint8_t* data, uint16_t len)
 {
-	//Push the data into our RX FIFO
+	//Fast path for bulk uploads: if we're in the middle of a huge packet and nothing is buffered, feed the new data
+	//straight to the handler rather than copying it through the FIFO.
+	//Same chunking rules as the buffered path, so tiny fragments still get batched up.
+	if(state->m_hugePacketInProgress && (state->m_rxBuffer.ReadSize() == 0) )
+	{
+		uint32_t bytesLeft = state->m_hugePacketTotalLength - state->m_hugePacketBytesSoFar;
+		if(len >= bytesLeft)
+		{
+			OnHugePacketRxData(id, state, socket, data, bytesLeft);
+			state->m_hugePacketInProgress = false;
+			data += bytesLeft;
+			len -= bytesLeft;
+		}
+		else if(len > 64)
+		{
+			OnHugePacketRxData(id, state, socket, data, len);
+			state->m_hugePacketBytesSoFar += len;
+			len = 0;
+		}
+	}
+
+	//Push the remaining data into our RX FIFO
 	if(!state->m_rxBuffer.Push(data, len))
 		return false;
 
@@ -91,7 +112,7 @@ bool SFTPServer::OnRxData(int id, SFTPConnectionState* state, TCPTableEntry* soc
 		while(IsPacketReady(state))
 		{
 			//If there's no space to send a reply, ignore any incoming messages
-			if(!m_ssh->IsTxBufferAvailable())
+			if(!m_ssh->IsTxBufferAvailable(socket))
 			{
 				//g_log("OnRxData no tx buffer 1\n");
 				state->m_packetPendingTxBuffer = true;
@@ -105,7 +126,7 @@ bool SFTPServer::OnRxData(int id, SFTPConnectionState* state, TCPTableEntry* soc
 		}
 
 		//If there's no space to send a reply, ignore any incoming messages
-		if(!m_ssh->IsTxBufferAvailable())
+		if(!m_ssh->IsTxBufferAvailable(socket))
 		{
 			//g_log("OnRxData no tx buffer 2\n");
 			state->m_packetPendingTxBuffer = true;
@@ -55,6 +55,15 @@ class SSHExecRequestPacket;
 
 #define INVALID_CHANNEL 0xffffffff
 
+//Max channel data bytes per packet
+//(this is enough to be comfortably below typical 1500 byte MTUs after header overhead)
+#define SSH_MAX_CHANNEL_DATA 1280
+
+//Max number of TCP segments in flight on a SFTP session (bulk transfers can use more of the shared retransmit pool)
+#ifndef SSH_SFTP_MAX_UNACKED
+#define SSH_SFTP_MAX_UNACKED 32
+#endif
+
 /**
 	@brief Helper function for loading a 32-bit network-byte-order value that might not be on a 32-bit aligned boundary
 
@@ -93,6 +102,8 @@ public:
 		m_rxBuffer.Reset();
 		memset(m_username, 0, SSH_MAX_USERNAME);
 		m_channelType = CHANNEL_TYPE_UNINITIALIZED;
+		m_txCoalesceSegment = nullptr;
+		m_txCoalesceLength = 0;
 
 		//Zeroize crypto state
 		if(m_crypto)
@@ -162,6 +173,12 @@ public:
 
 	///@brief SFTP state (if we're using SFTP)
 	SFTPConnectionState* m_sftpState;
+
+	///@brief Unencrypted SSH_MSG_CHANNEL_DATA packet being filled by QueueSessionData() (null if none)
+	TCPSegment* m_txCoalesceSegment;
+
+	///@brief Number of channel data bytes in m_txCoalesceSegment
+	uint16_t m_txCoalesceLength;
 };
 
 /**
@@ -177,10 +194,14 @@ public:
 	bool IsTxBufferAvailable()
 	{ return m_tcp.IsTxBufferAvailable(); }
 
+	bool IsTxBufferAvailable(TCPTableEntry* socket)
+	{ return m_tcp.IsTxBufferAvailable(socket); }
+
 	//Event handlers
 	virtual void OnConnectionAccepted(TCPTableEntry* socket) override;
 	virtual void OnConnectionClosed(TCPTableEntry* socket) override;
 	virtual bool OnRxData(TCPTableEntry* socket, uint8_t* payload, uint16_t payloadLen) override;
+	virtual void OnTxSpaceAvailable(TCPTableEntry* socket) override;
 	void OnAgingTick10x();
 
 	void SendEncryptedPacket(
@@ -191,6 +212,8 @@ public:
 		TCPTableEntry* socket);
 
 	bool SendSessionData(int id, TCPTableEntry* socket, const char* data, uint16_t length);
+	bool QueueSessionData(int id, TCPTableEntry* socket, const char* data, uint16_t length);
+	void FlushSessionData(int id, TCPTableEntry* socket);
 
 	SSHTransportPacket* AllocateReply(int id, TCPTableEntry* socket, TCPSegment*& segment);
 
@@ -239,6 +262,7 @@ protected:
 	void OnRxKexEcdhInit(int id, TCPTableEntry* socket);
 	void OnRxNewKeys(int id, TCPTableEntry* socket);
 	void OnRxEncryptedPacket(int id, TCPTableEntry* socket);
+	void OnRxEncryptedPacket(int id, TCPTableEntry* socket, SSHTransportPacket* pack);
 	void OnRxIgnore(int id, TCPTableEntry* socket, SSHTransportPacket* packet);
 	void OnRxServiceRequest(int id, TCPTableEntry* socket, SSHTransportPacket* packet);
 	void OnRxServiceRequestUserAuth(int id, TCPTableEntry* socket);
@@ -258,6 +282,7 @@ protected:
 	virtual void DoExecRequest(int id, TCPTableEntry* socket, const char* cmd, uint16_t len) =0;
 
 	virtual void DropConnection(int id, TCPTableEntry* socket);
+	void DiscardSessionData(int id, TCPTableEntry* socket);
 
 	/**
 		@brief Called when a session initializes and runs a shell
@@ -0,0 +1,148 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Implementation of StackRunner
+ */
+
+#include <staticnet-config.h>
+#include <staticnet/stack/staticnet.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+StackRunner::StackRunner(EthernetInterface& iface, EthernetProtocol& eth, uint32_t budget)
+	: m_iface(iface)
+	, m_eth(eth)
+	, m_tcp(nullptr)
+	, m_budget(budget ? budget : 1)
+	, m_lastBatchSize(0)
+	, m_polling(false)
+	, m_idlePolls(0)
+	, m_deadlineValid(false)
+	, m_nextDeadline(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main loop
+
+/**
+	@brief Processes one batch of received frames, then runs end-of-batch work and any timers which are due
+
+	Returns true if Poll() should be called again right away (the budget ran out, or we're in polling mode). Returns
+	false if the caller can sleep until the RX interrupt fires or GetNextDeadline() passes.
+ */
+#ifdef HAVE_ITCM
+__attribute__((section(".tcmtext")))
+#endif
+bool StackRunner::Poll()
+{
+	//Process received frames, up to our budget
+	uint32_t count = 0;
+	while(count < m_budget)
+	{
+		auto frame = m_iface.GetRxFrame();
+		if(!frame)
+			break;
+		m_eth.OnRxFrame(frame);
+		count ++;
+	}
+	m_lastBatchSize = count;
+
+	//End of batch: one ACK per connection covers everything we just received, then let blocked senders continue
+	if(m_tcp)
+		m_tcp->FlushDeferredAcks();
+	m_eth.DeliverTxSpaceNotification();
+
+	//Run timers if they're due. Received traffic may have armed new timers, so recalculate the deadline then too
+	auto now = m_eth.GetTimeMs();
+	bool expired = !m_deadlineValid || MonotonicClock::IsExpired(now, m_nextDeadline);
+	if(expired)
+		m_eth.OnTimer();
+	if(expired || (count > 0) )
+	{
+		m_nextDeadline = now + m_eth.GetNextDeadline();
+		m_deadlineValid = true;
+	}
+
+	//Switch modes depending on load
+	bool more = (count >= m_budget);
+	if(more)
+	{
+		m_idlePolls = 0;
+		SetPolling(true);
+	}
+	else if(m_polling)
+	{
+		if(count > 0)
+			m_idlePolls = 0;
+		else
+		{
+			m_idlePolls ++;
+			if(m_idlePolls >= STACK_RUNNER_IDLE_POLLS)
+				SetPolling(false);
+		}
+	}
+
+	return more || m_polling;
+}
+
+/**
+	@brief Returns the number of milliseconds the caller may sleep for if no RX interrupt arrives
+
+	Always zero in polling mode. Otherwise the stack is asked again every time, since the application may have armed
+	new timers (e.g. a retransmit for data it sent) since the last Poll().
+ */
+uint32_t StackRunner::GetNextDeadline()
+{
+	if(m_polling)
+		return 0;
+
+	//Also update Poll()'s copy, so the new timers run on time when we wake up
+	auto now = m_eth.GetTimeMs();
+	auto next = m_eth.GetNextDeadline();
+	m_nextDeadline = now + next;
+	m_deadlineValid = true;
+	return next;
+}
+
+/**
+	@brief Switches between polling and interrupt mode
+ */
+void StackRunner::SetPolling(bool polling)
+{
+	if(polling == m_polling)
+		return;
+
+	m_polling = polling;
+	m_idlePolls = 0;
+	m_iface.SetRxInterruptEnabled(!polling);
+}
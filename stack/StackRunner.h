@@ -0,0 +1,140 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of StackRunner
+ */
+
+#ifndef StackRunner_h
+#define StackRunner_h
+
+//Max number of received frames processed by one StackRunner::Poll() call
+#ifndef STACK_RUNNER_RX_BUDGET
+#define STACK_RUNNER_RX_BUDGET 16
+#endif
+
+//Number of consecutive polls which find no frames before StackRunner goes back to interrupt mode
+#ifndef STACK_RUNNER_IDLE_POLLS
+#define STACK_RUNNER_IDLE_POLLS 4
+#endif
+
+/**
+	@brief Main loop helper which drives the stack with a bounded amount of work per call
+
+	Each call to Poll() processes up to a fixed budget of received frames, then sends one ACK per TCP connection covering
+	the whole batch, notifies anyone waiting for TX buffers, and runs any timers which are due. The amount of time spent
+	in one call is thus predictable, and other firmware tasks can run between calls even during a burst of traffic.
+
+	The runner switches between two modes, similar to NAPI in Linux. In interrupt mode, the application sleeps until
+	the driver's RX interrupt fires or GetNextDeadline() passes. If a batch uses the whole budget, the runner disables
+	the RX interrupt (see EthernetInterface::SetRxInterruptEnabled()) and goes to polling mode, where the application
+	calls Poll() again right away. Once several polls in a row find nothing to do, it enables the interrupt again and
+	returns to interrupt mode.
+
+	A MonotonicClock must be attached to the EthernetProtocol. The application should no longer call OnRxFrame(),
+	OnTimer(), or the aging tick functions itself.
+
+	Typical use:
+
+		StackRunner runner(iface, eth);
+		runner.UseTCP(&tcp);
+		while(true)
+		{
+			if(!runner.Poll())
+				WaitForInterruptOrTimeout(runner.GetNextDeadline());
+			DoOtherWork();
+		}
+ */
+class StackRunner
+{
+public:
+	StackRunner(EthernetInterface& iface, EthernetProtocol& eth, uint32_t budget = STACK_RUNNER_RX_BUDGET);
+
+	/**
+		@brief Attaches the TCP stack, so ACKs for received data can be deferred to the end of each batch
+
+		Once attached, all received frames must be processed through Poll().
+	 */
+	void UseTCP(TCPProtocol* tcp)
+	{
+		if(m_tcp)
+			m_tcp->SetAckDeferral(false);
+		m_tcp = tcp;
+		if(m_tcp)
+			m_tcp->SetAckDeferral(true);
+	}
+
+	bool Poll();
+	uint32_t GetNextDeadline();
+
+	///@brief Sets the max number of received frames processed by one Poll() call
+	void SetBudget(uint32_t budget)
+	{ m_budget = budget ? budget : 1; }
+
+	///@brief Returns true if the runner is in polling mode (RX interrupt disabled)
+	bool IsPolling()
+	{ return m_polling; }
+
+	///@brief Returns the number of frames processed by the most recent Poll() call
+	uint32_t GetLastBatchSize()
+	{ return m_lastBatchSize; }
+
+protected:
+	void SetPolling(bool polling);
+
+	///@brief Driver for the Ethernet MAC
+	EthernetInterface& m_iface;
+
+	///@brief The Ethernet protocol stack
+	EthernetProtocol& m_eth;
+
+	///@brief The TCP stack, if ACKs are being deferred
+	TCPProtocol* m_tcp;
+
+	///@brief Max number of received frames processed by one Poll() call
+	uint32_t m_budget;
+
+	///@brief Number of frames processed by the most recent Poll() call
+	uint32_t m_lastBatchSize;
+
+	///@brief True if we're in polling mode
+	bool m_polling;
+
+	///@brief Number of consecutive polls, in polling mode, which found no frames
+	uint32_t m_idlePolls;
+
+	///@brief True if m_nextDeadline has been calculated
+	bool m_deadlineValid;
+
+	///@brief Timestamp at which the stack's timers next need to run
+	uint32_t m_nextDeadline;
+};
+
+#endif
@@ -48,7 +48,9 @@
 #include <memory.h>
 
 #include "../drivers/base/EthernetInterface.h"
+#include "../drivers/base/MonotonicClock.h"
 #include "../net/ethernet/EthernetProtocol.h"
+#include "../net/ethernet/IngressFilter.h"
 #include "../net/arp/ARPProtocol.h"
 #include "../net/ipv4/IPv4Protocol.h"
 #include "../net/ipv6/IPv6Protocol.h"
@@ -56,6 +58,7 @@
 #include "../net/icmpv6/ICMPv6Protocol.h"
 #include "../net/tcp/TCPProtocol.h"
 #include "../net/udp/UDPProtocol.h"
+#include "StackRunner.h"
 
 //Constants used for FNV hash
 #define FNV_INITIAL	0x811c9dc5
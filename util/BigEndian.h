@@ -0,0 +1,117 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of BigEndian
+ */
+#ifndef BigEndian_h
+#define BigEndian_h
+
+#include <stdint.h>
+
+/**
+	@brief An integer stored in network (big endian) byte order
+
+	Packet headers declare their multi-byte fields with this type, so the buffer always holds wire format and
+	conversion to host order only happens for the fields that are actually read or written. There is no separate
+	byte swapping pass over the header, and no way to read a field in the wrong byte order.
+
+	Comparisons between two BigEndian values are done in network order. Comparing a field against a constant wrapped
+	in BigEndian (e.g. m_port == be16(22)) swaps the constant at compile time rather than the field at run time.
+
+	Assumes host is little endian.
+ */
+template<class T>
+class __attribute__((packed)) BigEndian
+{
+public:
+	BigEndian() = default;
+
+	constexpr explicit BigEndian(T value)
+	: m_raw(Swap(value))
+	{}
+
+	///@brief Returns the value in host byte order
+	constexpr operator T() const
+	{ return Swap(m_raw); }
+
+	///@brief Stores a value given in host byte order
+	BigEndian& operator=(T value)
+	{
+		m_raw = Swap(value);
+		return *this;
+	}
+
+	///@brief Sets bits given in host byte order (without converting the stored value)
+	BigEndian& operator|=(T bits)
+	{
+		m_raw |= Swap(bits);
+		return *this;
+	}
+
+	///@brief Clears bits given in host byte order (without converting the stored value)
+	BigEndian& operator&=(T bits)
+	{
+		m_raw &= Swap(bits);
+		return *this;
+	}
+
+	constexpr bool operator==(const BigEndian& rhs) const
+	{ return m_raw == rhs.m_raw; }
+
+	constexpr bool operator!=(const BigEndian& rhs) const
+	{ return m_raw != rhs.m_raw; }
+
+	///@brief Returns the value exactly as stored (network byte order)
+	constexpr T Raw() const
+	{ return m_raw; }
+
+	///@brief Converts between host and network byte order
+	static constexpr T Swap(T value)
+	{
+		static_assert( (sizeof(T) == 2) || (sizeof(T) == 4) || (sizeof(T) == 8), "Unsupported BigEndian width");
+
+		if constexpr(sizeof(T) == 2)
+			return __builtin_bswap16(value);
+		else if constexpr(sizeof(T) == 4)
+			return __builtin_bswap32(value);
+		else
+			return __builtin_bswap64(value);
+	}
+
+protected:
+	T m_raw;
+};
+
+typedef BigEndian<uint16_t> be16;
+typedef BigEndian<uint32_t> be32;
+typedef BigEndian<uint64_t> be64;
+
+#endif
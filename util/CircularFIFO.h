@@ -43,7 +43,8 @@
 	Pointers are 16 bit to reduce the memory footprint. One extra bit is required to distinguish between
 	empty and full positions so the maximum legal value for SIZE is 2^15-1.
 
-	This class has no interlocks and is not thread/interrupt safe without external locks.
+	This class has no interlocks and is not thread/interrupt safe without external locks. Use SPSCByteFIFO to pass data
+	between an interrupt handler and the main loop (or between threads).
  */
 template<uint16_t SIZE>
 class CircularFIFO
@@ -0,0 +1,170 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of SPSCByteFIFO
+ */
+#ifndef SPSCByteFIFO_h
+#define SPSCByteFIFO_h
+
+#include <string.h>
+#include "SPSCRing.h"
+
+/**
+	@brief A lock-free single producer, single consumer FIFO for byte-stream data
+
+	Byte-stream counterpart to SPSCRing, for things like passing a UART or console stream between an interrupt
+	handler and the main loop. Same rules apply: one producer context calls Push() and WriteSize(), one consumer
+	context calls everything else, and no locks or interrupt masking are needed. Unlike CircularFIFO, data is never
+	moved once written, so the consumer can't get a single contiguous view of wrapped data; Peek() returns the part
+	up to the end of the buffer, and the rest is available after Pop().
+
+	SIZE must be a power of two.
+ */
+template<uint32_t SIZE>
+class SPSCByteFIFO
+{
+public:
+	static_assert( (SIZE > 0) && ( (SIZE & (SIZE - 1)) == 0), "SPSCByteFIFO size must be a power of two");
+
+	SPSCByteFIFO()
+	{ Reset(); }
+
+	/**
+		@brief Empties the FIFO
+
+		Not safe to call while either side may be using the FIFO.
+	 */
+	void Reset()
+	{
+		m_writePtr = 0;
+		m_readPtr = 0;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Producer side
+
+	///@brief Returns the number of bytes of free buffer space (may be more by the time it's used, never less)
+	uint32_t WriteSize()
+	{ return SIZE - (__atomic_load_n(&m_writePtr, __ATOMIC_RELAXED) - __atomic_load_n(&m_readPtr, __ATOMIC_ACQUIRE)); }
+
+	/**
+		@brief Pushes a buffer of data into the FIFO
+
+		Writes are all-or-nothing. If len > WriteSize() this function returns false and the FIFO state is unmodified.
+	 */
+	bool Push(const uint8_t* data, uint32_t len)
+	{
+		if(len > WriteSize())
+			return false;
+
+		//Copy in up to two pieces if we wrap around the end of the buffer
+		uint32_t wptr = __atomic_load_n(&m_writePtr, __ATOMIC_RELAXED);
+		uint32_t off = wptr & (SIZE - 1);
+		uint32_t first = SIZE - off;
+		if(first > len)
+			first = len;
+		memcpy(m_data + off, data, first);
+		memcpy(m_data, data + first, len - first);
+
+		__atomic_store_n(&m_writePtr, wptr + len, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Consumer side
+
+	///@brief Returns the number of bytes of data available to read (may be more by the time it's used, never less)
+	uint32_t ReadSize()
+	{ return __atomic_load_n(&m_writePtr, __ATOMIC_ACQUIRE) - __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED); }
+
+	/**
+		@brief Gets a pointer to the oldest data in the FIFO, without removing it
+
+		len is set to the number of contiguous bytes available at the pointer, which may be less than ReadSize() if
+		the data wraps around the end of the buffer.
+	 */
+	const uint8_t* Peek(uint32_t& len)
+	{
+		uint32_t avail = ReadSize();
+		uint32_t off = __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED) & (SIZE - 1);
+
+		len = SIZE - off;
+		if(len > avail)
+			len = avail;
+		return m_data + off;
+	}
+
+	///@brief Discards data from the FIFO (capped at the amount available)
+	void Pop(uint32_t len)
+	{
+		uint32_t avail = ReadSize();
+		if(len > avail)
+			len = avail;
+
+		__atomic_store_n(&m_readPtr, __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED) + len, __ATOMIC_RELEASE);
+	}
+
+	/**
+		@brief Copies data out of the FIFO and removes it
+
+		Returns the number of bytes copied, which is less than len if there wasn't that much data available.
+	 */
+	uint32_t Read(uint8_t* data, uint32_t len)
+	{
+		uint32_t avail = ReadSize();
+		if(len > avail)
+			len = avail;
+
+		uint32_t rptr = __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED);
+		uint32_t off = rptr & (SIZE - 1);
+		uint32_t first = SIZE - off;
+		if(first > len)
+			first = len;
+		memcpy(data, m_data + off, first);
+		memcpy(data + first, m_data, len - first);
+
+		__atomic_store_n(&m_readPtr, rptr + len, __ATOMIC_RELEASE);
+		return len;
+	}
+
+protected:
+
+	///@brief Total number of bytes ever written (written by the producer only)
+	alignas(SPSC_CACHE_LINE_SIZE) uint32_t m_writePtr;
+
+	///@brief Total number of bytes ever read (written by the consumer only)
+	alignas(SPSC_CACHE_LINE_SIZE) uint32_t m_readPtr;
+
+	///@brief The buffer
+	alignas(SPSC_CACHE_LINE_SIZE) uint8_t m_data[SIZE];
+};
+
+#endif
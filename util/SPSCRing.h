@@ -0,0 +1,173 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* staticnet                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2024-2025 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Declaration of SPSCRing
+ */
+#ifndef SPSCRing_h
+#define SPSCRing_h
+
+#include <stdint.h>
+
+//Size of a cache line, used to keep the producer and consumer sides of lock-free queues from sharing one.
+//32 bytes matches the Cortex-M7 L1 cache; host builds should set this to 64.
+#ifndef SPSC_CACHE_LINE_SIZE
+#define SPSC_CACHE_LINE_SIZE 32
+#endif
+
+/**
+	@brief A lock-free single producer, single consumer ring of fixed size elements (typically EthernetFrame*)
+
+	Exactly one context may call the producer functions (Push(), WriteSize()) and exactly one may call the consumer
+	functions (Pop(), Peek(), IsEmpty(), ReadSize()). The two may be an interrupt handler and the main loop, or two
+	threads on different cores. No interrupts need to be disabled and no locks are taken.
+
+	Each side publishes its position with a release store and reads the other side's with an acquire load, so an
+	element is always fully written before the consumer can see it, and fully read before the producer can reuse its
+	slot. Only plain loads and stores (plus barriers) are needed, so this also works on cores without LDREX/STREX.
+	Each side also keeps a private copy of the other's position, and only goes back to the shared one when the copy
+	says the ring is full (or empty), to keep cache lines from bouncing between cores.
+
+	SIZE must be a power of two. Positions are free running 32-bit counters, so all SIZE slots are usable.
+ */
+template<class T, uint32_t SIZE>
+class SPSCRing
+{
+public:
+	static_assert( (SIZE > 0) && ( (SIZE & (SIZE - 1)) == 0), "SPSCRing size must be a power of two");
+
+	SPSCRing()
+	{ Reset(); }
+
+	/**
+		@brief Empties the ring
+
+		Not safe to call while either side may be using the ring.
+	 */
+	void Reset()
+	{
+		m_writePtr = 0;
+		m_cachedReadPtr = 0;
+		m_readPtr = 0;
+		m_cachedWritePtr = 0;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Producer side
+
+	/**
+		@brief Adds an element to the ring
+
+		Returns false, without changing anything, if the ring is full.
+	 */
+	bool Push(const T& item)
+	{
+		uint32_t wptr = __atomic_load_n(&m_writePtr, __ATOMIC_RELAXED);
+		if( (wptr - m_cachedReadPtr) >= SIZE)
+		{
+			m_cachedReadPtr = __atomic_load_n(&m_readPtr, __ATOMIC_ACQUIRE);
+			if( (wptr - m_cachedReadPtr) >= SIZE)
+				return false;
+		}
+
+		m_items[wptr & (SIZE - 1)] = item;
+		__atomic_store_n(&m_writePtr, wptr + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	///@brief Returns the number of free slots (may be more by the time it's used, never fewer)
+	uint32_t WriteSize()
+	{
+		m_cachedReadPtr = __atomic_load_n(&m_readPtr, __ATOMIC_ACQUIRE);
+		return SIZE - (__atomic_load_n(&m_writePtr, __ATOMIC_RELAXED) - m_cachedReadPtr);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// Consumer side
+
+	/**
+		@brief Removes the oldest element from the ring
+
+		Returns false, without changing anything, if the ring is empty.
+	 */
+	bool Pop(T& item)
+	{
+		if(!Peek(item))
+			return false;
+
+		__atomic_store_n(&m_readPtr, __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	///@brief Gets the oldest element without removing it. Returns false if the ring is empty
+	bool Peek(T& item)
+	{
+		uint32_t rptr = __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED);
+		if(rptr == m_cachedWritePtr)
+		{
+			m_cachedWritePtr = __atomic_load_n(&m_writePtr, __ATOMIC_ACQUIRE);
+			if(rptr == m_cachedWritePtr)
+				return false;
+		}
+
+		item = m_items[rptr & (SIZE - 1)];
+		return true;
+	}
+
+	///@brief Checks if the ring is empty (it may not be by the time the result is used)
+	bool IsEmpty()
+	{ return ReadSize() == 0; }
+
+	///@brief Returns the number of elements waiting (may be more by the time it's used, never fewer)
+	uint32_t ReadSize()
+	{
+		m_cachedWritePtr = __atomic_load_n(&m_writePtr, __ATOMIC_ACQUIRE);
+		return m_cachedWritePtr - __atomic_load_n(&m_readPtr, __ATOMIC_RELAXED);
+	}
+
+protected:
+
+	///@brief Position of the next slot to write (written by the producer only)
+	alignas(SPSC_CACHE_LINE_SIZE) uint32_t m_writePtr;
+
+	///@brief Producer's copy of m_readPtr
+	uint32_t m_cachedReadPtr;
+
+	///@brief Position of the next slot to read (written by the consumer only)
+	alignas(SPSC_CACHE_LINE_SIZE) uint32_t m_readPtr;
+
+	///@brief Consumer's copy of m_writePtr
+	uint32_t m_cachedWritePtr;
+
+	///@brief The elements
+	alignas(SPSC_CACHE_LINE_SIZE) T m_items[SIZE];
+};
+
+#endif